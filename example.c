@@ -254,10 +254,10 @@ static char* bar_params[] = {
 };
 
 static MunitParameterEnum test_params[] = {
-  { (char*) "foo", foo_params },
-  { (char*) "bar", bar_params },
-  { (char*) "baz", NULL },
-  { NULL, NULL },
+  { (char*) "foo", foo_params, NULL },
+  { (char*) "bar", bar_params, NULL },
+  { (char*) "baz", NULL, NULL },
+  { NULL, NULL, NULL },
 };
 
 /* Creating a test suite is pretty simple.  First, you'll need an
@@ -285,28 +285,33 @@ static MunitTest test_suite_tests[] = {
      * may want to pass a corresponding callback here to reverse the
      * operation. */
     test_compare_tear_down,
-    /* Finally, there is a bitmask for options you can pass here.  You
-     * can provide either MUNIT_TEST_OPTION_NONE or 0 here to use the
+    /* There is a bitmask for options you can pass here.  You can
+     * provide either MUNIT_TEST_OPTION_NONE or 0 here to use the
      * defaults. */
     MUNIT_TEST_OPTION_NONE,
-    NULL
+    /* The parameters the test accepts; more on those later. */
+    NULL,
+    /* Finally, the number of seconds the test may take before it is
+     * killed and reported as an error.  0 means no limit (unless one
+     * is passed to the CLI with --timeout). */
+    0
   },
   /* Usually this is written in a much more compact format; all these
    * comments kind of ruin that, though.  Here is how you'll usually
    * see entries written: */
-  { (char*) "/example/rand", test_rand, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+  { (char*) "/example/rand", test_rand, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL, 0 },
   /* To tell the test runner when the array is over, just add a NULL
    * entry at the end. */
-  { (char*) "/example/parameters", test_parameters, NULL, NULL, MUNIT_TEST_OPTION_NONE, test_params },
-  { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+  { (char*) "/example/parameters", test_parameters, NULL, NULL, MUNIT_TEST_OPTION_NONE, test_params, 0 },
+  { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL, 0 }
 };
 
 /* If you wanted to have your test suite run other test suites you
  * could declare an array of them.  Of course each sub-suite can
  * contain more suites, etc. */
 /* static const MunitSuite other_suites[] = { */
-/*   { "/second", test_suite_tests, NULL, 1, MUNIT_SUITE_OPTION_NONE }, */
-/*   { NULL, NULL, NULL, 0, MUNIT_SUITE_OPTION_NONE } */
+/*   { "/second", test_suite_tests, NULL, 1, MUNIT_SUITE_OPTION_NONE, NULL, NULL }, */
+/*   { NULL, NULL, NULL, 0, MUNIT_SUITE_OPTION_NONE, NULL, NULL } */
 /* }; */
 
 /* Now we'll actually declare the test suite.  You could do this in
@@ -334,7 +339,16 @@ static const MunitSuite test_suite = {
   1,
   /* Just like MUNIT_TEST_OPTION_NONE, you can provide
    * MUNIT_SUITE_OPTION_NONE or 0 to use the default settings. */
-  MUNIT_SUITE_OPTION_NONE
+  MUNIT_SUITE_OPTION_NONE,
+  /* Suites can also have a fixture.  Unlike the fixtures for tests,
+   * which are set up again for every iteration of every test, it is
+   * set up only once, before any of the suite's tests are run, which
+   * is handy for things which are expensive to create.  Whatever the
+   * setup function returns is used as the user_data for all the tests
+   * in the suite (and in any child suites).  We don't need one here,
+   * so just pass NULL for the setup and tear down functions. */
+  NULL,
+  NULL
 };
 
 /* This is only necessary for EXIT_SUCCESS and EXIT_FAILURE, which you
@@ -45,6 +45,81 @@
 #  define MUNIT_TEST_NAME_LEN 37
 #endif
 
+/* When running tests in parallel (--jobs), results are reported in
+ * the same order the tests appear in the suite, so a slow test will
+ * hold back the results of tests which come after it.  This limits
+ * how many test cases (per job) may be waiting to be reported before
+ * we stop starting new ones. */
+#if !defined(MUNIT_JOBS_BACKLOG)
+#  define MUNIT_JOBS_BACKLOG 4
+#endif
+
+/* With a timing database (--timing-db) the runner picks the slowest
+ * of the waiting test cases to start next, so it's allowed to look
+ * further ahead. */
+#if !defined(MUNIT_JOBS_LOOKAHEAD)
+#  define MUNIT_JOBS_LOOKAHEAD 64
+#endif
+
+/* Defaults for benchmark mode (--benchmark).  Each test case is run
+ * until it has been warmed up for MUNIT_BENCH_WARMUP seconds, then
+ * MUNIT_BENCH_SAMPLES samples are taken, each running the test enough
+ * times to take at least MUNIT_BENCH_MIN_TIME seconds. */
+#if !defined(MUNIT_BENCH_SAMPLES)
+#  define MUNIT_BENCH_SAMPLES 50
+#endif
+#if !defined(MUNIT_BENCH_MIN_TIME)
+#  define MUNIT_BENCH_MIN_TIME 0.001
+#endif
+#if !defined(MUNIT_BENCH_WARMUP)
+#  define MUNIT_BENCH_WARMUP 0.05
+#endif
+
+/* Defaults for the per-test arena (--arena).  munit_malloc() takes
+ * memory from chunks of at least MUNIT_ARENA_CHUNK_SIZE bytes, aligned
+ * to MUNIT_ARENA_ALIGNMENT (which must be a power of two).  With huge
+ * pages, chunks are rounded up to MUNIT_ARENA_HUGE_PAGE_SIZE. */
+#if !defined(MUNIT_ARENA_CHUNK_SIZE)
+#  define MUNIT_ARENA_CHUNK_SIZE (1024 * 1024)
+#endif
+#if !defined(MUNIT_ARENA_ALIGNMENT)
+#  define MUNIT_ARENA_ALIGNMENT 16
+#endif
+#if !defined(MUNIT_ARENA_HUGE_PAGE_SIZE)
+#  define MUNIT_ARENA_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#endif
+
+/* With guard pages (--guard-pages), the end of each allocation is
+ * placed this close to the guard page.  The default keeps pointers
+ * from munit_malloc() aligned as well as malloc()'s would be, so
+ * turning guard pages on can't cause misaligned accesses, but an
+ * overrun smaller than the padding this adds goes unnoticed.  Set it
+ * to 1 to catch even one-byte overruns if your tests don't need
+ * aligned buffers. */
+#if !defined(MUNIT_GUARD_ALIGNMENT)
+#  define MUNIT_GUARD_ALIGNMENT 16
+#endif
+
+/* With --fail-alloc, a test is run once for every allocation it
+ * makes, with that allocation failing.  This is how many allocations
+ * we'll try before giving up. */
+#if !defined(MUNIT_FAIL_ALLOC_LIMIT)
+#  define MUNIT_FAIL_ALLOC_LIMIT 10000
+#endif
+
+/* When comparing benchmark results against a baseline
+ * (--compare-baseline), a difference is only considered significant
+ * if the Mann-Whitney U test's z score is beyond this (the default is
+ * the two-sided 95% confidence level), and the median changed by more
+ * than --regression-threshold percent (MUNIT_REGRESSION_THRESHOLD by
+ * default). */
+#if !defined(MUNIT_BASELINE_Z_CRITICAL)
+#  define MUNIT_BASELINE_Z_CRITICAL 1.959964
+#endif
+#if !defined(MUNIT_REGRESSION_THRESHOLD)
+#  define MUNIT_REGRESSION_THRESHOLD 5.0
+#endif
+
 /* If you don't like the timing information, you can disable it by
  * defining MUNIT_DISABLE_TIMING. */
 #if !defined(MUNIT_DISABLE_TIMING)
@@ -106,6 +181,19 @@
 #  include <unistd.h>
 #  include <sys/types.h>
 #  include <sys/wait.h>
+#  include <sys/socket.h>
+#  include <sys/mman.h>
+#  if defined(__linux__)
+/* <sys/mman.h> only has MAP_ANONYMOUS, MAP_HUGETLB, etc. with
+ * _DEFAULT_SOURCE, but the kernel's header always does. */
+#    include <linux/mman.h>
+#  endif
+#  include <poll.h>
+#  include <signal.h>
+#  include <fcntl.h>
+#  if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#    define MAP_ANONYMOUS MAP_ANON
+#  endif
 #else
 #  include <windows.h>
 #  include <io.h>
@@ -143,6 +231,89 @@
 #  define MUNIT_NO_BUFFER
 #endif
 
+/* On Linux, stderr is buffered in anonymous memory (memfd) instead of
+ * a temporary file, and replayed with sendfile(). */
+#if defined(__linux__) && defined(__GLIBC__) && \
+  ((__GLIBC__ > 2) || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27)) && \
+  !defined(MUNIT_NO_BUFFER) && !defined(MUNIT_NO_MEMFD)
+#  define MUNIT_HAVE_MEMFD
+#  include <sys/sendfile.h>
+/* Only declared by <sys/mman.h> with _GNU_SOURCE. */
+int memfd_create(const char* name, unsigned int flags);
+#endif
+
+#if defined(__linux__) && defined(MUNIT_ENABLE_TIMING) && !defined(MUNIT_NO_PERF_EVENTS)
+#  include <sys/syscall.h>
+#  if defined(__NR_perf_event_open)
+#    define MUNIT_HAVE_PERF_EVENTS
+#    include <sys/ioctl.h>
+#    include <linux/perf_event.h>
+/* Only declared by <unistd.h> with _DEFAULT_SOURCE. */
+long syscall(long number, ...);
+#  endif
+#endif
+
+#if !defined(_WIN32) && !defined(MUNIT_NO_RUSAGE)
+#  define MUNIT_HAVE_RUSAGE
+#  include <sys/resource.h>
+#  if !defined(MUNIT_NO_FORK)
+/* Only declared by <sys/wait.h> with _DEFAULT_SOURCE. */
+pid_t wait4(pid_t pid, int* status, int options, struct rusage* rusage);
+#  endif
+#endif
+
+/* Huge pages for the arena, either explicitly (MAP_HUGETLB) or by
+ * asking for transparent huge pages (MADV_HUGEPAGE). */
+#if defined(MAP_ANONYMOUS) && !defined(MUNIT_NO_HUGE_PAGES) && \
+  (defined(MAP_HUGETLB) || defined(MADV_HUGEPAGE))
+#  define MUNIT_HAVE_HUGE_PAGES
+#  if defined(MADV_HUGEPAGE)
+/* Only declared by <sys/mman.h> with _DEFAULT_SOURCE. */
+int madvise(void* addr, size_t length, int advice);
+#  endif
+#endif
+
+/* Allocations from munit_malloc() can be placed right before an
+ * inaccessible page (--guard-pages), so overruns crash immediately.
+ * Define MUNIT_GUARD_PAGES to make that the default. */
+#if defined(MAP_ANONYMOUS) && !defined(MUNIT_NO_GUARD_PAGES)
+#  define MUNIT_HAVE_GUARD_PAGES
+#endif
+
+/* Timings from earlier runs, kept in a file we map into memory
+ * (--timing-db). */
+#if defined(MUNIT_ENABLE_TIMING) && !defined(_WIN32) && !defined(MUNIT_NO_TIMING_DB)
+#  define MUNIT_HAVE_TIMING_DB
+#  include <sys/stat.h>
+#endif
+
+/* Replacing malloc() only works if nothing else is trying to do the
+ * same thing, which the sanitizers are. */
+#if defined(__has_feature)
+#  if __has_feature(address_sanitizer) || __has_feature(memory_sanitizer) || __has_feature(thread_sanitizer)
+#    define MUNIT_NO_ALLOC_HOOKS
+#  endif
+#endif
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#  define MUNIT_NO_ALLOC_HOOKS
+#endif
+
+/* glibc exports its allocator under a second set of names, so we can
+ * define malloc() & co. ourselves and forward to the real thing.
+ * That replaces the allocator for the whole program, including any
+ * (jemalloc, tcmalloc, ...) it would otherwise have used, so it has to
+ * be asked for by defining MUNIT_ENABLE_ALLOC_HOOKS.  Without it
+ * --count-allocs and --fail-alloc=malloc aren't available. */
+#if defined(MUNIT_ENABLE_ALLOC_HOOKS) && defined(__GLIBC__) && defined(__GNUC__) && !defined(MUNIT_NO_ALLOC_HOOKS)
+#  define MUNIT_HAVE_ALLOC_HOOKS
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t nmemb, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void* __libc_valloc(size_t size);
+void __libc_free(void* ptr);
+#endif
+
 /*** Logging ***/
 
 static MunitLogLevel munit_log_level_visible = MUNIT_LOG_INFO;
@@ -153,6 +324,9 @@ static MUNIT_THREAD_LOCAL munit_bool munit_error_jmp_buf_valid = 0;
 static MUNIT_THREAD_LOCAL jmp_buf munit_error_jmp_buf;
 #endif
 
+/* Passed to longjmp() for errors (MUNIT_ERROR) instead of failures. */
+#define MUNIT_ERROR_JMP_ERROR 2
+
 /* At certain warning levels, mingw will trigger warnings about
  * suggesting the format attribute, which we've explicity *not* set
  * because it will then choke on our attempts to use the MS-specific
@@ -270,1281 +444,6969 @@ munit_log_errno(MunitLogLevel level, FILE* fp, const char* msg) {
 
 /*** Memory allocation ***/
 
-void*
-munit_malloc_ex(const char* filename, int line, size_t size) {
-  void* ptr;
+#if !defined(MUNIT_NO_FORK)
+#define MUNIT_FAIL_ALLOC_NONE   0
+#define MUNIT_FAIL_ALLOC_MUNIT  1
+#define MUNIT_FAIL_ALLOC_MALLOC 2
+
+/* Allocation failure injection (--fail-alloc).  In a child forked just
+ * for the purpose, the at-th allocation made by the test (not its
+ * setup or tear_down) fails.  Where that allocation came from is sent
+ * to the runner as soon as it happens, so even if the test crashes
+ * afterwards we can say which allocation it didn't cope with.  Once
+ * the test finishes, the same message is sent again with done set. */
+typedef struct {
+  munit_bool done;
+  int result;
+  munit_bool hit;
+  const char* file;
+  int line;
+  const void* caller;
+} MunitFailAllocRun;
 
-  if (size == 0)
-    return NULL;
+typedef struct {
+  int mode;
+  munit_bool active;
+  unsigned long at;
+  unsigned long count;
+  int fd;
+  MunitFailAllocRun run;
+} MunitFailAlloc;
+
+static MunitFailAlloc munit_fail_alloc = {
+  MUNIT_FAIL_ALLOC_NONE, 0, 0, 0, -1, { 0, 0, 0, NULL, 0, NULL }
+};
 
-  ptr = calloc(1, size);
-  if (MUNIT_UNLIKELY(ptr == NULL)) {
-    munit_logf_ex(MUNIT_LOG_ERROR, filename, line, "Failed to allocate %" MUNIT_SIZE_MODIFIER "u bytes.", size);
-  }
+/* Returns true if this allocation should fail. */
+static munit_bool
+munit_fail_alloc_check(const char* file, int line, const void* caller) {
+  ssize_t write_res;
 
-  return ptr;
-}
+  if (++munit_fail_alloc.count != munit_fail_alloc.at)
+    return 0;
 
-/*** Timer code ***/
+  munit_fail_alloc.run.hit = 1;
+  munit_fail_alloc.run.file = file;
+  munit_fail_alloc.run.line = line;
+  munit_fail_alloc.run.caller = caller;
 
-#if defined(MUNIT_ENABLE_TIMING)
+  /* Small enough to be written atomically, and write() won't try to
+   * allocate anything. */
+  write_res = write(munit_fail_alloc.fd, &(munit_fail_alloc.run), sizeof(MunitFailAllocRun));
+  (void) write_res;
 
-#define psnip_uint64_t munit_uint64_t
-#define psnip_uint32_t munit_uint32_t
+  return 1;
+}
+#endif
 
-/* Code copied from portable-snippets
- * <https://github.com/nemequ/portable-snippets/>.  If you need to
- * change something, please do it there so we can keep the code in
- * sync. */
+/* The per-test arena (--arena).  While a test, its setup or its
+ * tear_down is running, munit_malloc() hands out memory from a list of
+ * chunks by bumping an offset.  Once tear_down returns the arena is
+ * reset by going back to the start of the first chunk; the chunks are
+ * kept for the next test, so after the first iteration the arena
+ * doesn't have to allocate at all. */
+typedef struct MunitArenaChunk_ MunitArenaChunk;
+
+struct MunitArenaChunk_ {
+  MunitArenaChunk* next;
+  size_t size;
+  /* Everything from this offset on has never been handed out, so it
+   * is still zeroed. */
+  size_t dirty;
+};
 
-/* Clocks (v1)
- * Portable Snippets - https://gitub.com/nemequ/portable-snippets
- * Created by Evan Nemerson <evan@nemerson.com>
- *
- *   To the extent possible under law, the authors have waived all
- *   copyright and related or neighboring rights to this code.  For
- *   details, see the Creative Commons Zero 1.0 Universal license at
- *   https://creativecommons.org/publicdomain/zero/1.0/
- */
+typedef struct {
+  munit_bool enabled;
+  munit_bool active;
+  munit_bool huge_pages;
+  size_t chunk_size;
+  size_t alignment;
+  MunitArenaChunk* first;
+  MunitArenaChunk* current;
+  size_t used;
+} MunitArena;
+
+static MunitArena munit_arena = {
+  0, 0, 0, MUNIT_ARENA_CHUNK_SIZE, MUNIT_ARENA_ALIGNMENT, NULL, NULL, 0
+};
 
-#if !defined(PSNIP_CLOCK_H)
-#define PSNIP_CLOCK_H
+static size_t
+munit_align_up(size_t value, size_t alignment) {
+  return (value + (alignment - 1)) & ~(alignment - 1);
+}
 
-#if !defined(psnip_uint64_t)
-#  include "../exact-int/exact-int.h"
+static MunitArenaChunk*
+munit_arena_chunk_new(size_t size) {
+  MunitArenaChunk* chunk;
+#if defined(MAP_ANONYMOUS)
+  void* mem = MAP_FAILED;
+
+  if (munit_arena.huge_pages) {
+    size = munit_align_up(size, MUNIT_ARENA_HUGE_PAGE_SIZE);
+#if defined(MUNIT_HAVE_HUGE_PAGES) && defined(MAP_HUGETLB)
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
 #endif
+  }
 
-#if !defined(PSNIP_CLOCK_STATIC_INLINE)
-#  if defined(__GNUC__)
-#    define PSNIP_CLOCK__COMPILER_ATTRIBUTES __attribute__((__unused__))
-#  else
-#    define PSNIP_CLOCK__COMPILER_ATTRIBUTES
-#  endif
+  if (mem == MAP_FAILED) {
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MUNIT_UNLIKELY(mem == MAP_FAILED))
+      return NULL;
+#if defined(MUNIT_HAVE_HUGE_PAGES) && defined(MADV_HUGEPAGE)
+    /* No huge pages reserved; transparent huge pages will have to do. */
+    if (munit_arena.huge_pages)
+      madvise(mem, size, MADV_HUGEPAGE);
+#endif
+  }
 
-#  define PSNIP_CLOCK__FUNCTION PSNIP_CLOCK__COMPILER_ATTRIBUTES static
+  chunk = (MunitArenaChunk*) mem;
+#else
+  chunk = (MunitArenaChunk*) calloc(1, size);
+  if (MUNIT_UNLIKELY(chunk == NULL))
+    return NULL;
 #endif
 
-enum PsnipClockType {
-  /* This clock provides the current time, in units since 1970-01-01
-   * 00:00:00 UTC not including leap seconds.  In other words, UNIX
-   * time.  Keep in mind that this clock doesn't account for leap
-   * seconds, and can go backwards (think NTP adjustments). */
-  PSNIP_CLOCK_TYPE_WALL = 1,
-  /* The CPU time is a clock which increases only when the current
-   * process is active (i.e., it doesn't increment while blocking on
-   * I/O). */
-  PSNIP_CLOCK_TYPE_CPU = 2,
-  /* Monotonic time is always running (unlike CPU time), but it only
-     ever moves forward unless you reboot the system.  Things like NTP
-     adjustments have no effect on this clock. */
-  PSNIP_CLOCK_TYPE_MONOTONIC = 3
-};
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->dirty = sizeof(MunitArenaChunk);
 
-struct PsnipClockTimespec {
-  psnip_uint64_t seconds;
-  psnip_uint64_t nanoseconds;
-};
+  return chunk;
+}
 
-/* Methods we support: */
+static void*
+munit_arena_alloc(size_t size) {
+  MunitArenaChunk* chunk = munit_arena.current;
+  MunitArenaChunk* last;
+  size_t offset = munit_arena.used;
+  size_t chunk_size;
+  char* ptr;
 
-#define PSNIP_CLOCK_METHOD_CLOCK_GETTIME                   1
-#define PSNIP_CLOCK_METHOD_TIME                            2
-#define PSNIP_CLOCK_METHOD_GETTIMEOFDAY                    3
-#define PSNIP_CLOCK_METHOD_QUERYPERFORMANCECOUNTER         4
-#define PSNIP_CLOCK_METHOD_MACH_ABSOLUTE_TIME              5
-#define PSNIP_CLOCK_METHOD_CLOCK                           6
-#define PSNIP_CLOCK_METHOD_GETPROCESSTIMES                 7
-#define PSNIP_CLOCK_METHOD_GETRUSAGE                       8
-#define PSNIP_CLOCK_METHOD_GETSYSTEMTIMEPRECISEASFILETIME  9
-#define PSNIP_CLOCK_METHOD_GETTICKCOUNT64                 10
+  if (MUNIT_UNLIKELY(size > ((size_t) -1) / 2))
+    return NULL;
 
-#include <assert.h>
+  for (;;) {
+    if (chunk != NULL) {
+      /* Align the address, not the offset, so alignments larger than
+       * the chunk's own alignment work too. */
+      offset = munit_align_up((size_t) ((uintptr_t) chunk + offset), munit_arena.alignment) - (size_t) (uintptr_t) chunk;
+      if (offset + size <= chunk->size)
+        break;
+      if (chunk->next != NULL) {
+        chunk = chunk->next;
+        offset = sizeof(MunitArenaChunk);
+        continue;
+      }
+    }
 
-#if defined(HEDLEY_UNREACHABLE)
-#  define PSNIP_CLOCK_UNREACHABLE() HEDLEY_UNREACHABLE()
-#else
-#  define PSNIP_CLOCK_UNREACHABLE() assert(0)
-#endif
+    /* Out of room; add a chunk big enough for this allocation. */
+    last = chunk;
+    chunk_size = sizeof(MunitArenaChunk) + munit_arena.alignment + size;
+    if (chunk_size < munit_arena.chunk_size)
+      chunk_size = munit_arena.chunk_size;
+    chunk = munit_arena_chunk_new(chunk_size);
+    if (MUNIT_UNLIKELY(chunk == NULL))
+      return NULL;
+    if (last == NULL)
+      munit_arena.first = chunk;
+    else
+      last->next = chunk;
+    offset = sizeof(MunitArenaChunk);
+  }
 
-/* Choose an implementation */
+  ptr = ((char*) chunk) + offset;
+  if (offset < chunk->dirty)
+    memset(ptr, 0, (chunk->dirty - offset < size) ? chunk->dirty - offset : size);
 
-/* #undef PSNIP_CLOCK_WALL_METHOD */
-/* #undef PSNIP_CLOCK_CPU_METHOD */
-/* #undef PSNIP_CLOCK_MONOTONIC_METHOD */
+  munit_arena.current = chunk;
+  munit_arena.used = offset + size;
+  if (munit_arena.used > chunk->dirty)
+    chunk->dirty = munit_arena.used;
 
-/* We want to be able to detect the libc implementation, so we include
-   <limits.h> (<features.h> isn't available everywhere). */
+  return ptr;
+}
 
-#if defined(__unix__) || defined(__unix) || defined(__linux__)
-#  include <limits.h>
-#  include <unistd.h>
-#endif
+/* Called before a test's setup, and after its tear_down. */
+static void
+munit_arena_reset(munit_bool active) {
+  munit_arena.active = munit_arena.enabled && active;
+  munit_arena.current = munit_arena.first;
+  munit_arena.used = sizeof(MunitArenaChunk);
+}
 
-#if defined(_POSIX_TIMERS) && (_POSIX_TIMERS > 0)
-/* These are known to work without librt.  If you know of others
- * please let us know so we can add them. */
-#  if \
-  (defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 17))) || \
-  (defined(__FreeBSD__))
-#    define PSNIP_CLOCK_HAVE_CLOCK_GETTIME
-#  elif !defined(PSNIP_CLOCK_NO_LIBRT)
-#    define PSNIP_CLOCK_HAVE_CLOCK_GETTIME
-#  endif
-#endif
+static munit_bool
+munit_arena_contains(const void* ptr) {
+  const uintptr_t addr = (uintptr_t) ptr;
+  const MunitArenaChunk* chunk;
 
-#if defined(_WIN32)
-#  if !defined(PSNIP_CLOCK_CPU_METHOD)
-#    define PSNIP_CLOCK_CPU_METHOD PSNIP_CLOCK_METHOD_GETPROCESSTIMES
-#  endif
-#  if !defined(PSNIP_CLOCK_MONOTONIC_METHOD)
-#    define PSNIP_CLOCK_MONOTONIC_METHOD PSNIP_CLOCK_METHOD_QUERYPERFORMANCECOUNTER
-#  endif
-#endif
+  for (chunk = munit_arena.first ; chunk != NULL ; chunk = chunk->next) {
+    if (addr >= (uintptr_t) chunk && addr < ((uintptr_t) chunk) + chunk->size)
+      return 1;
+  }
 
-#if defined(__MACH__) && !defined(__gnu_hurd__)
-#  if !defined(PSNIP_CLOCK_MONOTONIC_METHOD)
-#    define PSNIP_CLOCK_MONOTONIC_METHOD PSNIP_CLOCK_METHOD_MACH_ABSOLUTE_TIME
-#  endif
-#endif
+  return 0;
+}
 
-#if defined(PSNIP_CLOCK_HAVE_CLOCK_GETTIME)
-#  include <time.h>
-#  if !defined(PSNIP_CLOCK_WALL_METHOD)
-#    if defined(CLOCK_REALTIME_PRECISE)
-#      define PSNIP_CLOCK_WALL_METHOD PSNIP_CLOCK_METHOD_CLOCK_GETTIME
-#      define PSNIP_CLOCK_CLOCK_GETTIME_WALL CLOCK_REALTIME_PRECISE
-#    elif !defined(__sun)
-#      define PSNIP_CLOCK_WALL_METHOD PSNIP_CLOCK_METHOD_CLOCK_GETTIME
-#      define PSNIP_CLOCK_CLOCK_GETTIME_WALL CLOCK_REALTIME
-#    endif
-#  endif
-#  if !defined(PSNIP_CLOCK_CPU_METHOD)
-#    if defined(_POSIX_CPUTIME) || defined(CLOCK_PROCESS_CPUTIME_ID)
-#      define PSNIP_CLOCK_CPU_METHOD PSNIP_CLOCK_METHOD_CLOCK_GETTIME
-#      define PSNIP_CLOCK_CLOCK_GETTIME_CPU CLOCK_PROCESS_CPUTIME_ID
-#    elif defined(CLOCK_VIRTUAL)
-#      define PSNIP_CLOCK_CPU_METHOD PSNIP_CLOCK_METHOD_CLOCK_GETTIME
-#      define PSNIP_CLOCK_CLOCK_GETTIME_CPU CLOCK_VIRTUAL
-#    endif
-#  endif
-#  if !defined(PSNIP_CLOCK_MONOTONIC_METHOD)
-#    if defined(CLOCK_MONOTONIC_RAW)
-#      define PSNIP_CLOCK_MONOTONIC_METHOD PSNIP_CLOCK_METHOD_CLOCK_GETTIME
-#      define PSNIP_CLOCK_CLOCK_GETTIME_MONOTONIC CLOCK_MONOTONIC
-#    elif defined(CLOCK_MONOTONIC_PRECISE)
-#      define PSNIP_CLOCK_MONOTONIC_METHOD PSNIP_CLOCK_METHOD_CLOCK_GETTIME
-#      define PSNIP_CLOCK_CLOCK_GETTIME_MONOTONIC CLOCK_MONOTONIC_PRECISE
-#    elif defined(_POSIX_MONOTONIC_CLOCK) || defined(CLOCK_MONOTONIC)
-#      define PSNIP_CLOCK_MONOTONIC_METHOD PSNIP_CLOCK_METHOD_CLOCK_GETTIME
-#      define PSNIP_CLOCK_CLOCK_GETTIME_MONOTONIC CLOCK_MONOTONIC
-#    endif
-#  endif
+static void
+munit_arena_fini(void) {
+  MunitArenaChunk* chunk = munit_arena.first;
+  MunitArenaChunk* next;
+
+  while (chunk != NULL) {
+    next = chunk->next;
+#if defined(MAP_ANONYMOUS)
+    munmap(chunk, chunk->size);
+#else
+    free(chunk);
 #endif
+    chunk = next;
+  }
 
-#if defined(_POSIX_VERSION) && (_POSIX_VERSION >= 200112L)
-#  if !defined(PSNIP_CLOCK_WALL_METHOD)
-#    define PSNIP_CLOCK_WALL_METHOD PSNIP_CLOCK_METHOD_GETTIMEOFDAY
-#  endif
-#endif
+  munit_arena.first = NULL;
+  munit_arena.current = NULL;
+  munit_arena.used = 0;
+}
 
-#if !defined(PSNIP_CLOCK_WALL_METHOD)
-#  define PSNIP_CLOCK_WALL_METHOD PSNIP_CLOCK_METHOD_TIME
+#if defined(MUNIT_HAVE_GUARD_PAGES)
+#if defined(MUNIT_GUARD_PAGES)
+static munit_bool munit_guard_pages = 1;
+#else
+static munit_bool munit_guard_pages = 0;
 #endif
 
-#if !defined(PSNIP_CLOCK_CPU_METHOD)
-#  define PSNIP_CLOCK_CPU_METHOD PSNIP_CLOCK_METHOD_CLOCK
-#endif
+/* Each allocation with --guard-pages gets a mapping of its own, which
+ * ends with a PROT_NONE page.  This is stored right before the
+ * buffer so munit_free() knows what to unmap. */
+#define MUNIT_GUARD_MAGIC 0x4d554e4954475044ULL /* "MUNITGPD" */
 
-/* Primarily here for testing. */
-#if !defined(PSNIP_CLOCK_MONOTONIC_METHOD) && defined(PSNIP_CLOCK_REQUIRE_MONOTONIC)
-#  error No monotonic clock found.
-#endif
+typedef struct {
+  munit_uint64_t magic;
+  char* base;
+  size_t length;
+} MunitGuardHeader;
+
+/* The buffers munit_guard_alloc() has handed out and which haven't
+ * been freed yet, in an open-addressed hash set (linear probing).
+ * munit_free() looks pointers up here before reading anything in
+ * front of them, since anything else (memory from malloc(), say)
+ * needn't have a readable header's worth of bytes there.  The table
+ * itself is mapped rather than malloc()ed so it doesn't show up in
+ * --count-allocs or --fail-alloc. */
+static struct {
+  uintptr_t* slots;
+  size_t size;
+  size_t used;
+} munit_guard_live = { NULL, 0, 0 };
+
+static size_t
+munit_page_size(void) {
+  static size_t page_size = 0;
+
+  if (page_size == 0) {
+    const long res = sysconf(_SC_PAGESIZE);
+    page_size = (res > 0) ? (size_t) res : 4096;
+  }
 
-/* Implementations */
+  return page_size;
+}
 
-#if \
-  (defined(PSNIP_CLOCK_CPU_METHOD)       && (PSNIP_CLOCK_CPU_METHOD       == PSNIP_CLOCK_METHOD_CLOCK_GETTIME)) || \
-  (defined(PSNIP_CLOCK_WALL_METHOD)      && (PSNIP_CLOCK_WALL_METHOD      == PSNIP_CLOCK_METHOD_CLOCK_GETTIME)) || \
-  (defined(PSNIP_CLOCK_MONOTONIC_METHOD) && (PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_CLOCK_GETTIME)) || \
-  (defined(PSNIP_CLOCK_CPU_METHOD)       && (PSNIP_CLOCK_CPU_METHOD       == PSNIP_CLOCK_METHOD_CLOCK)) || \
-  (defined(PSNIP_CLOCK_WALL_METHOD)      && (PSNIP_CLOCK_WALL_METHOD      == PSNIP_CLOCK_METHOD_CLOCK)) || \
-  (defined(PSNIP_CLOCK_MONOTONIC_METHOD) && (PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_CLOCK)) || \
-  (defined(PSNIP_CLOCK_CPU_METHOD)       && (PSNIP_CLOCK_CPU_METHOD       == PSNIP_CLOCK_METHOD_TIME)) || \
-  (defined(PSNIP_CLOCK_WALL_METHOD)      && (PSNIP_CLOCK_WALL_METHOD      == PSNIP_CLOCK_METHOD_TIME)) || \
-  (defined(PSNIP_CLOCK_MONOTONIC_METHOD) && (PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_TIME))
-#  include <time.h>
-#endif
+static size_t
+munit_guard_live_hash(uintptr_t addr) {
+  return (size_t) ((((munit_uint64_t) addr) * 0x9E3779B97F4A7C15ULL) >> 32) & (munit_guard_live.size - 1);
+}
 
-#if \
-  (defined(PSNIP_CLOCK_CPU_METHOD)       && (PSNIP_CLOCK_CPU_METHOD       == PSNIP_CLOCK_METHOD_GETTIMEOFDAY)) || \
-  (defined(PSNIP_CLOCK_WALL_METHOD)      && (PSNIP_CLOCK_WALL_METHOD      == PSNIP_CLOCK_METHOD_GETTIMEOFDAY)) || \
-  (defined(PSNIP_CLOCK_MONOTONIC_METHOD) && (PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_GETTIMEOFDAY))
-#  include <sys/time.h>
-#endif
+static size_t
+munit_guard_live_slot(uintptr_t addr) {
+  const size_t mask = munit_guard_live.size - 1;
+  size_t i = munit_guard_live_hash(addr);
 
-#if \
-  (defined(PSNIP_CLOCK_CPU_METHOD)       && (PSNIP_CLOCK_CPU_METHOD       == PSNIP_CLOCK_METHOD_GETPROCESSTIMES)) || \
-  (defined(PSNIP_CLOCK_WALL_METHOD)      && (PSNIP_CLOCK_WALL_METHOD      == PSNIP_CLOCK_METHOD_GETPROCESSTIMES)) || \
-  (defined(PSNIP_CLOCK_MONOTONIC_METHOD) && (PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_GETPROCESSTIMES)) || \
-  (defined(PSNIP_CLOCK_CPU_METHOD)       && (PSNIP_CLOCK_CPU_METHOD       == PSNIP_CLOCK_METHOD_GETTICKCOUNT64)) || \
-  (defined(PSNIP_CLOCK_WALL_METHOD)      && (PSNIP_CLOCK_WALL_METHOD      == PSNIP_CLOCK_METHOD_GETTICKCOUNT64)) || \
-  (defined(PSNIP_CLOCK_MONOTONIC_METHOD) && (PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_GETTICKCOUNT64))
-#  include <windows.h>
-#endif
+  while (munit_guard_live.slots[i] != 0 && munit_guard_live.slots[i] != addr)
+    i = (i + 1) & mask;
 
-#if \
-  (defined(PSNIP_CLOCK_CPU_METHOD)       && (PSNIP_CLOCK_CPU_METHOD       == PSNIP_CLOCK_METHOD_GETRUSAGE)) || \
-  (defined(PSNIP_CLOCK_WALL_METHOD)      && (PSNIP_CLOCK_WALL_METHOD      == PSNIP_CLOCK_METHOD_GETRUSAGE)) || \
-  (defined(PSNIP_CLOCK_MONOTONIC_METHOD) && (PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_GETRUSAGE))
-#  include <sys/time.h>
-#  include <sys/resource.h>
-#endif
+  return i;
+}
 
-#if \
-  (defined(PSNIP_CLOCK_CPU_METHOD)       && (PSNIP_CLOCK_CPU_METHOD       == PSNIP_CLOCK_METHOD_MACH_ABSOLUTE_TIME)) || \
-  (defined(PSNIP_CLOCK_WALL_METHOD)      && (PSNIP_CLOCK_WALL_METHOD      == PSNIP_CLOCK_METHOD_MACH_ABSOLUTE_TIME)) || \
-  (defined(PSNIP_CLOCK_MONOTONIC_METHOD) && (PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_MACH_ABSOLUTE_TIME))
-#  include <CoreServices/CoreServices.h>
-#  include <mach/mach.h>
-#  include <mach/mach_time.h>
-#endif
+static munit_bool
+munit_guard_live_add(uintptr_t addr) {
+  uintptr_t* old_slots = munit_guard_live.slots;
+  const size_t old_size = munit_guard_live.size;
+  size_t size;
+  void* mem;
+  size_t i;
+
+  /* Keep it at most half full. */
+  if ((munit_guard_live.used + 1) * 2 > old_size) {
+    size = (old_size != 0) ? old_size * 2 : munit_page_size() / sizeof(uintptr_t);
+    mem = mmap(NULL, size * sizeof(uintptr_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MUNIT_UNLIKELY(mem == MAP_FAILED))
+      return 0;
+
+    munit_guard_live.slots = (uintptr_t*) mem;
+    munit_guard_live.size = size;
+    for (i = 0 ; i < old_size ; i++) {
+      if (old_slots[i] != 0)
+        munit_guard_live.slots[munit_guard_live_slot(old_slots[i])] = old_slots[i];
+    }
+    if (old_slots != NULL)
+      munmap(old_slots, old_size * sizeof(uintptr_t));
+  }
 
-/*** Implementations ***/
+  munit_guard_live.slots[munit_guard_live_slot(addr)] = addr;
+  munit_guard_live.used++;
+  return 1;
+}
 
-#define PSNIP_CLOCK_NSEC_PER_SEC ((psnip_uint32_t) (1000000000ULL))
+/* Remove addr, if it's there.  Returns whether it was. */
+static munit_bool
+munit_guard_live_remove(uintptr_t addr) {
+  const size_t mask = munit_guard_live.size - 1;
+  size_t i, j, home;
 
-#if \
-  (defined(PSNIP_CLOCK_CPU_METHOD)       && (PSNIP_CLOCK_CPU_METHOD       == PSNIP_CLOCK_METHOD_CLOCK_GETTIME)) || \
-  (defined(PSNIP_CLOCK_WALL_METHOD)      && (PSNIP_CLOCK_WALL_METHOD      == PSNIP_CLOCK_METHOD_CLOCK_GETTIME)) || \
-  (defined(PSNIP_CLOCK_MONOTONIC_METHOD) && (PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_CLOCK_GETTIME))
-PSNIP_CLOCK__FUNCTION psnip_uint32_t
-psnip_clock__clock_getres (clockid_t clk_id) {
-  struct timespec res;
-  int r;
+  if (munit_guard_live.size == 0)
+    return 0;
 
-  r = clock_getres(clk_id, &res);
-  if (r != 0)
+  i = munit_guard_live_slot(addr);
+  if (munit_guard_live.slots[i] == 0)
     return 0;
 
-  return (psnip_uint32_t) (PSNIP_CLOCK_NSEC_PER_SEC / res.tv_nsec);
+  /* Move later entries of the same run back into the hole if their
+   * probe sequence passes through it, so lookups still find them. */
+  for (j = (i + 1) & mask ; munit_guard_live.slots[j] != 0 ; j = (j + 1) & mask) {
+    home = munit_guard_live_hash(munit_guard_live.slots[j]);
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      munit_guard_live.slots[i] = munit_guard_live.slots[j];
+      i = j;
+    }
+  }
+  munit_guard_live.slots[i] = 0;
+  munit_guard_live.used--;
+
+  return 1;
 }
 
-PSNIP_CLOCK__FUNCTION int
-psnip_clock__clock_gettime (clockid_t clk_id, struct PsnipClockTimespec* res) {
-  struct timespec ts;
+static void*
+munit_guard_alloc(size_t size) {
+  const size_t page_size = munit_page_size();
+  const size_t data_size = munit_align_up(size, MUNIT_GUARD_ALIGNMENT);
+  MunitGuardHeader header;
+  void* mem;
+  char* ptr;
 
-  if (clock_gettime(clk_id, &ts) != 0)
-    return -10;
+  if (MUNIT_UNLIKELY(data_size > ((size_t) -1) / 2))
+    return NULL;
 
-  res->seconds = (psnip_uint64_t) (ts.tv_sec);
-  res->nanoseconds = (psnip_uint64_t) (ts.tv_nsec);
+  header.magic = MUNIT_GUARD_MAGIC;
+  header.length = munit_align_up(data_size + sizeof(MunitGuardHeader), page_size) + page_size;
+  mem = mmap(NULL, header.length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (MUNIT_UNLIKELY(mem == MAP_FAILED))
+    return NULL;
+  header.base = (char*) mem;
 
-  return 0;
+  ptr = header.base + header.length - page_size - data_size;
+  if (MUNIT_UNLIKELY(mprotect(header.base + header.length - page_size, page_size, PROT_NONE) != 0) ||
+      MUNIT_UNLIKELY(!munit_guard_live_add((uintptr_t) ptr))) {
+    munmap(mem, header.length);
+    return NULL;
+  }
+
+  memcpy(ptr - sizeof(MunitGuardHeader), &header, sizeof(MunitGuardHeader));
+
+  return ptr;
 }
-#endif
 
-PSNIP_CLOCK__FUNCTION psnip_uint32_t
-psnip_clock_wall_get_precision (void) {
-#if !defined(PSNIP_CLOCK_WALL_METHOD)
-  return 0;
-#elif defined(PSNIP_CLOCK_WALL_METHOD) && PSNIP_CLOCK_WALL_METHOD == PSNIP_CLOCK_METHOD_CLOCK_GETTIME
-  return psnip_clock__clock_getres(PSNIP_CLOCK_CLOCK_GETTIME_WALL);
-#elif defined(PSNIP_CLOCK_WALL_METHOD) && PSNIP_CLOCK_WALL_METHOD == PSNIP_CLOCK_METHOD_GETTIMEOFDAY
-  return 1000000;
-#elif defined(PSNIP_CLOCK_WALL_METHOD) && PSNIP_CLOCK_WALL_METHOD == PSNIP_CLOCK_METHOD_TIME
+/* Returns false if ptr didn't come from munit_guard_alloc() (or was
+ * already freed), without touching the memory around it. */
+static munit_bool
+munit_guard_free(void* ptr) {
+  const size_t page_size = munit_page_size();
+  MunitGuardHeader header;
+
+  if (!munit_guard_live_remove((uintptr_t) ptr))
+    return 0;
+
+  /* Something has written over the header, most likely an underrun.
+   * Better to leak the mapping than unmap the wrong thing. */
+  memcpy(&header, ((char*) ptr) - sizeof(MunitGuardHeader), sizeof(MunitGuardHeader));
+  if (header.magic != MUNIT_GUARD_MAGIC ||
+      ((uintptr_t) header.base) % page_size != 0 || header.length % page_size != 0 ||
+      (uintptr_t) ptr < ((uintptr_t) header.base) + sizeof(MunitGuardHeader) ||
+      (uintptr_t) ptr >= ((uintptr_t) header.base) + header.length - page_size) {
+    munit_logf_ex(MUNIT_LOG_ERROR, NULL, 0, "munit_free(%p): the memory in front of the allocation was overwritten", ptr);
+    return 1;
+  }
+
+  munmap(header.base, header.length);
   return 1;
-#else
-  return 0;
-#endif
 }
+#endif
 
-PSNIP_CLOCK__FUNCTION int
-psnip_clock_wall_get_time (struct PsnipClockTimespec* res) {
-  (void) res;
+void*
+munit_malloc_ex(const char* filename, int line, size_t size) {
+  void* ptr;
 
-#if !defined(PSNIP_CLOCK_WALL_METHOD)
-  return -2;
-#elif defined(PSNIP_CLOCK_WALL_METHOD) && PSNIP_CLOCK_WALL_METHOD == PSNIP_CLOCK_METHOD_CLOCK_GETTIME
-  return psnip_clock__clock_gettime(PSNIP_CLOCK_CLOCK_GETTIME_WALL, res);
-#elif defined(PSNIP_CLOCK_WALL_METHOD) && PSNIP_CLOCK_WALL_METHOD == PSNIP_CLOCK_METHOD_TIME
-  res->seconds = time(NULL);
-  res->nanoseconds = 0;
-#elif defined(PSNIP_CLOCK_WALL_METHOD) && PSNIP_CLOCK_WALL_METHOD == PSNIP_CLOCK_METHOD_GETTIMEOFDAY
-  struct timeval tv;
+  if (size == 0)
+    return NULL;
 
-  if (gettimeofday(&tv, NULL) != 0)
-    return -6;
+#if !defined(MUNIT_NO_FORK)
+  if (MUNIT_UNLIKELY(munit_fail_alloc.active)) {
+    if (munit_fail_alloc_check(filename, line, NULL))
+      return NULL;
+
+    /* The calloc() underneath doesn't count as another allocation. */
+    munit_fail_alloc.active = 0;
+    ptr = munit_malloc_ex(filename, line, size);
+    munit_fail_alloc.active = 1;
+    return ptr;
+  }
+#endif
 
-  res->seconds = tv.tv_sec;
-  res->nanoseconds = tv.tv_usec * 1000;
-#else
-  return -2;
+#if defined(MUNIT_HAVE_GUARD_PAGES)
+  if (munit_guard_pages)
+    ptr = munit_guard_alloc(size);
+  else
 #endif
+  if (munit_arena.active)
+    ptr = munit_arena_alloc(size);
+  else
+    ptr = calloc(1, size);
+  if (MUNIT_UNLIKELY(ptr == NULL)) {
+    munit_logf_ex(MUNIT_LOG_ERROR, filename, line, "Failed to allocate %" MUNIT_SIZE_MODIFIER "u bytes.", size);
+  }
 
-  return 0;
+  return ptr;
 }
 
-PSNIP_CLOCK__FUNCTION psnip_uint32_t
-psnip_clock_cpu_get_precision (void) {
-#if !defined(PSNIP_CLOCK_CPU_METHOD)
-  return 0;
-#elif defined(PSNIP_CLOCK_CPU_METHOD) && PSNIP_CLOCK_CPU_METHOD == PSNIP_CLOCK_METHOD_CLOCK_GETTIME
-  return psnip_clock__clock_getres(PSNIP_CLOCK_CLOCK_GETTIME_CPU);
-#elif defined(PSNIP_CLOCK_CPU_METHOD) && PSNIP_CLOCK_CPU_METHOD == PSNIP_CLOCK_METHOD_CLOCK
-  return CLOCKS_PER_SEC;
-#elif defined(PSNIP_CLOCK_CPU_METHOD) && PSNIP_CLOCK_CPU_METHOD == PSNIP_CLOCK_METHOD_GETPROCESSTIMES
-  return PSNIP_CLOCK_NSEC_PER_SEC / 100;
-#else
-  return 0;
+void
+munit_free(void* ptr) {
+  if (ptr == NULL || munit_arena_contains(ptr))
+    return;
+
+#if defined(MUNIT_HAVE_GUARD_PAGES)
+  if (munit_guard_pages && munit_guard_free(ptr))
+    return;
 #endif
-}
 
-PSNIP_CLOCK__FUNCTION int
-psnip_clock_cpu_get_time (struct PsnipClockTimespec* res) {
-#if !defined(PSNIP_CLOCK_CPU_METHOD)
-  (void) res;
-  return -2;
-#elif defined(PSNIP_CLOCK_CPU_METHOD) && PSNIP_CLOCK_CPU_METHOD == PSNIP_CLOCK_METHOD_CLOCK_GETTIME
-  return psnip_clock__clock_gettime(PSNIP_CLOCK_CLOCK_GETTIME_CPU, res);
-#elif defined(PSNIP_CLOCK_CPU_METHOD) && PSNIP_CLOCK_CPU_METHOD == PSNIP_CLOCK_METHOD_CLOCK
-  clock_t t = clock();
-  if (t == ((clock_t) -1))
-    return -5;
-  res->seconds = t / CLOCKS_PER_SEC;
-  res->nanoseconds = (t % CLOCKS_PER_SEC) * (PSNIP_CLOCK_NSEC_PER_SEC / CLOCKS_PER_SEC);
-#elif defined(PSNIP_CLOCK_CPU_METHOD) && PSNIP_CLOCK_CPU_METHOD == PSNIP_CLOCK_METHOD_GETPROCESSTIMES
-  FILETIME CreationTime, ExitTime, KernelTime, UserTime;
-  LARGE_INTEGER date, adjust;
+  free(ptr);
+}
 
-  if (!GetProcessTimes(GetCurrentProcess(), &CreationTime, &ExitTime, &KernelTime, &UserTime))
-    return -7;
+/*** Allocation counting ***/
 
-  /* http://www.frenk.com/2009/12/convert-filetime-to-unix-timestamp/ */
-  date.HighPart = UserTime.dwHighDateTime;
-  date.LowPart = UserTime.dwLowDateTime;
-  adjust.QuadPart = 11644473600000 * 10000;
-  date.QuadPart -= adjust.QuadPart;
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+/* How many callers currently want allocations counted.  While this is
+ * zero the hooks cost a single load. */
+static int munit_alloc_active = 0;
+static munit_uint64_t munit_alloc_allocations = 0;
+static munit_uint64_t munit_alloc_bytes = 0;
+static munit_uint64_t munit_alloc_frees = 0;
 
-  res->seconds = date.QuadPart / 10000000;
-  res->nanoseconds = (date.QuadPart % 10000000) * (PSNIP_CLOCK_NSEC_PER_SEC / 100);
-#elif PSNIP_CLOCK_CPU_METHOD == PSNIP_CLOCK_METHOD_GETRUSAGE
-  struct rusage usage;
-  if (getrusage(RUSAGE_SELF, &usage) != 0)
-    return -8;
+/* Returns true if the allocation should fail (--fail-alloc). */
+static munit_bool
+munit_alloc_record(size_t size, const void* caller) {
+  if (MUNIT_LIKELY(__atomic_load_n(&munit_alloc_active, __ATOMIC_RELAXED) == 0))
+    return 0;
 
-  res->seconds = usage.ru_utime.tv_sec;
-  res->nanoseconds = tv.tv_usec * 1000;
+#if !defined(MUNIT_NO_FORK)
+  if (munit_fail_alloc.active && munit_fail_alloc.mode == MUNIT_FAIL_ALLOC_MALLOC &&
+      munit_fail_alloc_check(NULL, 0, caller)) {
+    errno = ENOMEM;
+    return 1;
+  }
 #else
-  (void) res;
-  return -2;
+  (void) caller;
 #endif
 
+  __atomic_add_fetch(&munit_alloc_allocations, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&munit_alloc_bytes, (munit_uint64_t) size, __ATOMIC_RELAXED);
   return 0;
 }
 
-PSNIP_CLOCK__FUNCTION psnip_uint32_t
-psnip_clock_monotonic_get_precision (void) {
-#if !defined(PSNIP_CLOCK_MONOTONIC_METHOD)
-  return 0;
-#elif defined(PSNIP_CLOCK_MONOTONIC_METHOD) && PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_CLOCK_GETTIME
-  return psnip_clock__clock_getres(PSNIP_CLOCK_CLOCK_GETTIME_MONOTONIC);
-#elif defined(PSNIP_CLOCK_MONOTONIC_METHOD) && PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_MACH_ABSOLUTE_TIME
-  static mach_timebase_info_data_t tbi = { 0, };
-  if (tbi.denom == 0)
-    mach_timebase_info(&tbi);
-  return (psnip_uint32_t) (tbi.numer / tbi.denom);
-#elif defined(PSNIP_CLOCK_MONOTONIC_METHOD) && PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_GETTICKCOUNT64
-  return 1000;
-#elif defined(PSNIP_CLOCK_MONOTONIC_METHOD) && PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_QUERYPERFORMANCECOUNTER
-  LARGE_INTEGER Frequency;
-  QueryPerformanceFrequency(&Frequency);
-  return (psnip_uint32_t) ((Frequency.QuadPart > PSNIP_CLOCK_NSEC_PER_SEC) ? PSNIP_CLOCK_NSEC_PER_SEC : Frequency.QuadPart);
-#else
-  return 0;
-#endif
+void*
+malloc(size_t size) {
+  if (munit_alloc_record(size, __builtin_return_address(0)))
+    return NULL;
+  return __libc_malloc(size);
 }
 
-PSNIP_CLOCK__FUNCTION int
-psnip_clock_monotonic_get_time (struct PsnipClockTimespec* res) {
-#if !defined(PSNIP_CLOCK_MONOTONIC_METHOD)
-  (void) res;
-  return -2;
-#elif defined(PSNIP_CLOCK_MONOTONIC_METHOD) && PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_CLOCK_GETTIME
-  return psnip_clock__clock_gettime(PSNIP_CLOCK_CLOCK_GETTIME_MONOTONIC, res);
-#elif defined(PSNIP_CLOCK_MONOTONIC_METHOD) && PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_MACH_ABSOLUTE_TIME
-  psnip_uint64_t nsec = mach_absolute_time();
-  static mach_timebase_info_data_t tbi = { 0, };
-  if (tbi.denom == 0)
-    mach_timebase_info(&tbi);
-  nsec *= ((psnip_uint64_t) tbi.numer) / ((psnip_uint64_t) tbi.denom);
-  res->seconds = nsec / PSNIP_CLOCK_NSEC_PER_SEC;
-  res->nanoseconds = nsec % PSNIP_CLOCK_NSEC_PER_SEC;
-#elif defined(PSNIP_CLOCK_MONOTONIC_METHOD) && PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_QUERYPERFORMANCECOUNTER
-  LARGE_INTEGER t, f;
-  if (QueryPerformanceCounter(&t) == 0)
-    return -12;
+void*
+calloc(size_t nmemb, size_t size) {
+  /* If the size overflows glibc will fail it anyway, so there's no
+   * allocation to count. */
+  if (size != 0 && nmemb > SIZE_MAX / size)
+    return __libc_calloc(nmemb, size);
+  if (munit_alloc_record(nmemb * size, __builtin_return_address(0)))
+    return NULL;
+  return __libc_calloc(nmemb, size);
+}
 
-  QueryPerformanceFrequency(&f);
-  res->seconds = t.QuadPart / f.QuadPart;
-  res->nanoseconds = t.QuadPart % f.QuadPart;
-  if (f.QuadPart > PSNIP_CLOCK_NSEC_PER_SEC)
-    res->nanoseconds /= f.QuadPart / PSNIP_CLOCK_NSEC_PER_SEC;
-  else
-    res->nanoseconds *= PSNIP_CLOCK_NSEC_PER_SEC / f.QuadPart;
-#elif defined(PSNIP_CLOCK_MONOTONIC_METHOD) && PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_GETTICKCOUNT64
-  const ULONGLONG msec = GetTickCount64();
-  res->seconds = msec / 1000;
-  res->nanoseconds = sec % 1000;
-#else
-  return -2;
-#endif
+void*
+realloc(void* ptr, size_t size) {
+  /* glibc frees ptr and returns NULL, so this is a free rather than
+   * an allocation, and failing it would look like a leak. */
+  if (ptr != NULL && size == 0) {
+    if (MUNIT_UNLIKELY(__atomic_load_n(&munit_alloc_active, __ATOMIC_RELAXED) != 0))
+      __atomic_add_fetch(&munit_alloc_frees, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, 0);
+  }
 
+  if (munit_alloc_record(size, __builtin_return_address(0)))
+    return NULL;
+  return __libc_realloc(ptr, size);
+}
+
+int
+posix_memalign(void** memptr, size_t alignment, size_t size) {
+  void* ptr;
+
+  if (alignment == 0 || (alignment % sizeof(void*)) != 0 || (alignment & (alignment - 1)) != 0)
+    return EINVAL;
+
+  if (munit_alloc_record(size, __builtin_return_address(0)))
+    return ENOMEM;
+  ptr = __libc_memalign(alignment, size);
+  if (ptr == NULL)
+    return ENOMEM;
+
+  *memptr = ptr;
   return 0;
 }
 
-/* Returns the number of ticks per second for the specified clock.
- * For example, a clock with millisecond precision would return 1000,
- * and a clock with 1 second (such as the time() function) would
- * return 1.
- *
- * If the requested clock isn't available, it will return 0.
- * Hopefully this will be rare, but if it happens to you please let us
- * know so we can work on finding a way to support your system.
+/* Only declared by <stdlib.h> with C11, and <malloc.h>. */
+void* aligned_alloc(size_t alignment, size_t size);
+void* memalign(size_t alignment, size_t size);
+void* valloc(size_t size);
+
+void*
+aligned_alloc(size_t alignment, size_t size) {
+  if (munit_alloc_record(size, __builtin_return_address(0)))
+    return NULL;
+  return __libc_memalign(alignment, size);
+}
+
+void*
+memalign(size_t alignment, size_t size) {
+  if (munit_alloc_record(size, __builtin_return_address(0)))
+    return NULL;
+  return __libc_memalign(alignment, size);
+}
+
+void*
+valloc(size_t size) {
+  if (munit_alloc_record(size, __builtin_return_address(0)))
+    return NULL;
+  return __libc_valloc(size);
+}
+
+void
+free(void* ptr) {
+  if (MUNIT_UNLIKELY(__atomic_load_n(&munit_alloc_active, __ATOMIC_RELAXED) != 0) && ptr != NULL)
+    __atomic_add_fetch(&munit_alloc_frees, 1, __ATOMIC_RELAXED);
+  __libc_free(ptr);
+}
+
+/* Allocations made while counting was active, summed over every
+ * successful iteration (--count-allocs). */
+typedef struct {
+  munit_uint64_t allocations;
+  munit_uint64_t bytes;
+  munit_uint64_t frees;
+} MunitAllocReport;
+
+static void
+munit_alloc_counting_start(MunitAllocReport* begin) {
+  __atomic_add_fetch(&munit_alloc_active, 1, __ATOMIC_SEQ_CST);
+  begin->allocations = __atomic_load_n(&munit_alloc_allocations, __ATOMIC_SEQ_CST);
+  begin->bytes = __atomic_load_n(&munit_alloc_bytes, __ATOMIC_SEQ_CST);
+  begin->frees = __atomic_load_n(&munit_alloc_frees, __ATOMIC_SEQ_CST);
+}
+
+/* Stop counting, and add everything counted since begin to report (if
+ * it isn't NULL). */
+static void
+munit_alloc_counting_stop(const MunitAllocReport* begin, MunitAllocReport* report) {
+  const munit_uint64_t allocations = __atomic_load_n(&munit_alloc_allocations, __ATOMIC_SEQ_CST);
+  const munit_uint64_t bytes = __atomic_load_n(&munit_alloc_bytes, __ATOMIC_SEQ_CST);
+  const munit_uint64_t frees = __atomic_load_n(&munit_alloc_frees, __ATOMIC_SEQ_CST);
+
+  __atomic_sub_fetch(&munit_alloc_active, 1, __ATOMIC_SEQ_CST);
+
+  if (report != NULL) {
+    report->allocations += allocations - begin->allocations;
+    report->bytes += bytes - begin->bytes;
+    report->frees += frees - begin->frees;
+  }
+}
+
+/* A failed assertion can longjmp() past munit_alloc_counting_stop()
+ * or munit_alloc_count_end(), so the runner puts the count of active
+ * callers back to what it was before the test. */
+static int
+munit_alloc_active_get(void) {
+  return __atomic_load_n(&munit_alloc_active, __ATOMIC_SEQ_CST);
+}
+
+static void
+munit_alloc_active_reset(int active) {
+  __atomic_store_n(&munit_alloc_active, active, __ATOMIC_SEQ_CST);
+}
+#endif
+
+munit_uint64_t
+munit_alloc_count_begin(void) {
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+  __atomic_add_fetch(&munit_alloc_active, 1, __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&munit_alloc_allocations, __ATOMIC_SEQ_CST);
+#else
+  static munit_bool warned = 0;
+
+  if (!warned) {
+    munit_log_internal(MUNIT_LOG_WARNING, stderr, "allocation counting is not enabled (it needs glibc and MUNIT_ENABLE_ALLOC_HOOKS), allocations will not be detected");
+    warned = 1;
+  }
+
+  return 0;
+#endif
+}
+
+munit_uint64_t
+munit_alloc_count_end(munit_uint64_t begin) {
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+  const munit_uint64_t allocations = __atomic_load_n(&munit_alloc_allocations, __ATOMIC_SEQ_CST);
+
+  __atomic_sub_fetch(&munit_alloc_active, 1, __ATOMIC_SEQ_CST);
+
+  return allocations - begin;
+#else
+  (void) begin;
+  return 0;
+#endif
+}
+
+#if !defined(MUNIT_NO_FORK)
+/* Called around the test itself in a --fail-alloc child. */
+static void
+munit_fail_alloc_start(void) {
+  munit_fail_alloc.count = 0;
+  munit_fail_alloc.active = 1;
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+  if (munit_fail_alloc.mode == MUNIT_FAIL_ALLOC_MALLOC)
+    __atomic_add_fetch(&munit_alloc_active, 1, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static void
+munit_fail_alloc_stop(void) {
+  munit_fail_alloc.active = 0;
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+  if (munit_fail_alloc.mode == MUNIT_FAIL_ALLOC_MALLOC)
+    __atomic_sub_fetch(&munit_alloc_active, 1, __ATOMIC_SEQ_CST);
+#endif
+}
+#endif
+
+/*** Resource usage ***/
+
+#if defined(MUNIT_HAVE_RUSAGE)
+/* Resources used by a test case (--show-usage).  When the test case
+ * ran in its own process these are what wait4() says the child used;
+ * otherwise they are the difference in getrusage() across the test,
+ * except max_rss which is the peak for the whole process so far. */
+typedef struct {
+  munit_bool valid;
+  munit_uint64_t max_rss;
+  munit_uint64_t minor_faults;
+  munit_uint64_t major_faults;
+  munit_uint64_t voluntary_switches;
+  munit_uint64_t involuntary_switches;
+} MunitUsage;
+
+static munit_uint64_t
+munit_rusage_max_rss(const struct rusage* usage) {
+#if defined(__APPLE__)
+  /* Darwin reports bytes, everyone else uses kilobytes. */
+  return (munit_uint64_t) usage->ru_maxrss;
+#else
+  return ((munit_uint64_t) usage->ru_maxrss) * 1024;
+#endif
+}
+
+static void
+munit_usage_set(MunitUsage* usage, const struct rusage* ru) {
+  usage->valid = 1;
+  usage->max_rss = munit_rusage_max_rss(ru);
+  usage->minor_faults = (munit_uint64_t) ru->ru_minflt;
+  usage->major_faults = (munit_uint64_t) ru->ru_majflt;
+  usage->voluntary_switches = (munit_uint64_t) ru->ru_nvcsw;
+  usage->involuntary_switches = (munit_uint64_t) ru->ru_nivcsw;
+}
+
+/* For test cases which didn't get a process of their own.  There is
+ * no way to reset the peak RSS, so that is still for the process. */
+static void
+munit_usage_set_delta(MunitUsage* usage, const struct rusage* before, const struct rusage* after) {
+  munit_usage_set(usage, after);
+  usage->minor_faults -= (munit_uint64_t) before->ru_minflt;
+  usage->major_faults -= (munit_uint64_t) before->ru_majflt;
+  usage->voluntary_switches -= (munit_uint64_t) before->ru_nvcsw;
+  usage->involuntary_switches -= (munit_uint64_t) before->ru_nivcsw;
+}
+#endif
+
+munit_uint64_t
+munit_memory_peak(void) {
+#if defined(MUNIT_HAVE_RUSAGE)
+  struct rusage usage;
+
+  if (MUNIT_UNLIKELY(getrusage(RUSAGE_SELF, &usage) != 0))
+    return 0;
+
+  return munit_rusage_max_rss(&usage);
+#else
+  return 0;
+#endif
+}
+
+/*** Timer code ***/
+
+#if defined(MUNIT_ENABLE_TIMING)
+
+#define psnip_uint64_t munit_uint64_t
+#define psnip_uint32_t munit_uint32_t
+
+/* Code copied from portable-snippets
+ * <https://github.com/nemequ/portable-snippets/>.  If you need to
+ * change something, please do it there so we can keep the code in
+ * sync. */
+
+/* Clocks (v1)
+ * Portable Snippets - https://gitub.com/nemequ/portable-snippets
+ * Created by Evan Nemerson <evan@nemerson.com>
  *
- * Note that different clocks on the same system often have a
- * different precisions.
+ *   To the extent possible under law, the authors have waived all
+ *   copyright and related or neighboring rights to this code.  For
+ *   details, see the Creative Commons Zero 1.0 Universal license at
+ *   https://creativecommons.org/publicdomain/zero/1.0/
  */
-PSNIP_CLOCK__FUNCTION psnip_uint32_t
-psnip_clock_get_precision (enum PsnipClockType clock_type) {
-  switch (clock_type) {
-    case PSNIP_CLOCK_TYPE_MONOTONIC:
-      return psnip_clock_monotonic_get_precision ();
-    case PSNIP_CLOCK_TYPE_CPU:
-      return psnip_clock_cpu_get_precision ();
-    case PSNIP_CLOCK_TYPE_WALL:
-      return psnip_clock_wall_get_precision ();
-  }
 
-  PSNIP_CLOCK_UNREACHABLE();
-  return 0;
-}
+#if !defined(PSNIP_CLOCK_H)
+#define PSNIP_CLOCK_H
+
+#if !defined(psnip_uint64_t)
+#  include "../exact-int/exact-int.h"
+#endif
+
+#if !defined(PSNIP_CLOCK_STATIC_INLINE)
+#  if defined(__GNUC__)
+#    define PSNIP_CLOCK__COMPILER_ATTRIBUTES __attribute__((__unused__))
+#  else
+#    define PSNIP_CLOCK__COMPILER_ATTRIBUTES
+#  endif
+
+#  define PSNIP_CLOCK__FUNCTION PSNIP_CLOCK__COMPILER_ATTRIBUTES static
+#endif
+
+enum PsnipClockType {
+  /* This clock provides the current time, in units since 1970-01-01
+   * 00:00:00 UTC not including leap seconds.  In other words, UNIX
+   * time.  Keep in mind that this clock doesn't account for leap
+   * seconds, and can go backwards (think NTP adjustments). */
+  PSNIP_CLOCK_TYPE_WALL = 1,
+  /* The CPU time is a clock which increases only when the current
+   * process is active (i.e., it doesn't increment while blocking on
+   * I/O). */
+  PSNIP_CLOCK_TYPE_CPU = 2,
+  /* Monotonic time is always running (unlike CPU time), but it only
+     ever moves forward unless you reboot the system.  Things like NTP
+     adjustments have no effect on this clock. */
+  PSNIP_CLOCK_TYPE_MONOTONIC = 3
+};
+
+struct PsnipClockTimespec {
+  psnip_uint64_t seconds;
+  psnip_uint64_t nanoseconds;
+};
+
+/* Methods we support: */
+
+#define PSNIP_CLOCK_METHOD_CLOCK_GETTIME                   1
+#define PSNIP_CLOCK_METHOD_TIME                            2
+#define PSNIP_CLOCK_METHOD_GETTIMEOFDAY                    3
+#define PSNIP_CLOCK_METHOD_QUERYPERFORMANCECOUNTER         4
+#define PSNIP_CLOCK_METHOD_MACH_ABSOLUTE_TIME              5
+#define PSNIP_CLOCK_METHOD_CLOCK                           6
+#define PSNIP_CLOCK_METHOD_GETPROCESSTIMES                 7
+#define PSNIP_CLOCK_METHOD_GETRUSAGE                       8
+#define PSNIP_CLOCK_METHOD_GETSYSTEMTIMEPRECISEASFILETIME  9
+#define PSNIP_CLOCK_METHOD_GETTICKCOUNT64                 10
+
+#include <assert.h>
+
+#if defined(HEDLEY_UNREACHABLE)
+#  define PSNIP_CLOCK_UNREACHABLE() HEDLEY_UNREACHABLE()
+#else
+#  define PSNIP_CLOCK_UNREACHABLE() assert(0)
+#endif
+
+/* Choose an implementation */
+
+/* #undef PSNIP_CLOCK_WALL_METHOD */
+/* #undef PSNIP_CLOCK_CPU_METHOD */
+/* #undef PSNIP_CLOCK_MONOTONIC_METHOD */
+
+/* We want to be able to detect the libc implementation, so we include
+   <limits.h> (<features.h> isn't available everywhere). */
+
+#if defined(__unix__) || defined(__unix) || defined(__linux__)
+#  include <limits.h>
+#  include <unistd.h>
+#endif
+
+#if defined(_POSIX_TIMERS) && (_POSIX_TIMERS > 0)
+/* These are known to work without librt.  If you know of others
+ * please let us know so we can add them. */
+#  if \
+  (defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 17))) || \
+  (defined(__FreeBSD__))
+#    define PSNIP_CLOCK_HAVE_CLOCK_GETTIME
+#  elif !defined(PSNIP_CLOCK_NO_LIBRT)
+#    define PSNIP_CLOCK_HAVE_CLOCK_GETTIME
+#  endif
+#endif
+
+#if defined(_WIN32)
+#  if !defined(PSNIP_CLOCK_CPU_METHOD)
+#    define PSNIP_CLOCK_CPU_METHOD PSNIP_CLOCK_METHOD_GETPROCESSTIMES
+#  endif
+#  if !defined(PSNIP_CLOCK_MONOTONIC_METHOD)
+#    define PSNIP_CLOCK_MONOTONIC_METHOD PSNIP_CLOCK_METHOD_QUERYPERFORMANCECOUNTER
+#  endif
+#endif
+
+#if defined(__MACH__) && !defined(__gnu_hurd__)
+#  if !defined(PSNIP_CLOCK_MONOTONIC_METHOD)
+#    define PSNIP_CLOCK_MONOTONIC_METHOD PSNIP_CLOCK_METHOD_MACH_ABSOLUTE_TIME
+#  endif
+#endif
+
+#if defined(PSNIP_CLOCK_HAVE_CLOCK_GETTIME)
+#  include <time.h>
+#  if !defined(PSNIP_CLOCK_WALL_METHOD)
+#    if defined(CLOCK_REALTIME_PRECISE)
+#      define PSNIP_CLOCK_WALL_METHOD PSNIP_CLOCK_METHOD_CLOCK_GETTIME
+#      define PSNIP_CLOCK_CLOCK_GETTIME_WALL CLOCK_REALTIME_PRECISE
+#    elif !defined(__sun)
+#      define PSNIP_CLOCK_WALL_METHOD PSNIP_CLOCK_METHOD_CLOCK_GETTIME
+#      define PSNIP_CLOCK_CLOCK_GETTIME_WALL CLOCK_REALTIME
+#    endif
+#  endif
+#  if !defined(PSNIP_CLOCK_CPU_METHOD)
+#    if defined(_POSIX_CPUTIME) || defined(CLOCK_PROCESS_CPUTIME_ID)
+#      define PSNIP_CLOCK_CPU_METHOD PSNIP_CLOCK_METHOD_CLOCK_GETTIME
+#      define PSNIP_CLOCK_CLOCK_GETTIME_CPU CLOCK_PROCESS_CPUTIME_ID
+#    elif defined(CLOCK_VIRTUAL)
+#      define PSNIP_CLOCK_CPU_METHOD PSNIP_CLOCK_METHOD_CLOCK_GETTIME
+#      define PSNIP_CLOCK_CLOCK_GETTIME_CPU CLOCK_VIRTUAL
+#    endif
+#  endif
+#  if !defined(PSNIP_CLOCK_MONOTONIC_METHOD)
+#    if defined(CLOCK_MONOTONIC_RAW)
+#      define PSNIP_CLOCK_MONOTONIC_METHOD PSNIP_CLOCK_METHOD_CLOCK_GETTIME
+#      define PSNIP_CLOCK_CLOCK_GETTIME_MONOTONIC CLOCK_MONOTONIC
+#    elif defined(CLOCK_MONOTONIC_PRECISE)
+#      define PSNIP_CLOCK_MONOTONIC_METHOD PSNIP_CLOCK_METHOD_CLOCK_GETTIME
+#      define PSNIP_CLOCK_CLOCK_GETTIME_MONOTONIC CLOCK_MONOTONIC_PRECISE
+#    elif defined(_POSIX_MONOTONIC_CLOCK) || defined(CLOCK_MONOTONIC)
+#      define PSNIP_CLOCK_MONOTONIC_METHOD PSNIP_CLOCK_METHOD_CLOCK_GETTIME
+#      define PSNIP_CLOCK_CLOCK_GETTIME_MONOTONIC CLOCK_MONOTONIC
+#    endif
+#  endif
+#endif
+
+#if defined(_POSIX_VERSION) && (_POSIX_VERSION >= 200112L)
+#  if !defined(PSNIP_CLOCK_WALL_METHOD)
+#    define PSNIP_CLOCK_WALL_METHOD PSNIP_CLOCK_METHOD_GETTIMEOFDAY
+#  endif
+#endif
+
+#if !defined(PSNIP_CLOCK_WALL_METHOD)
+#  define PSNIP_CLOCK_WALL_METHOD PSNIP_CLOCK_METHOD_TIME
+#endif
+
+#if !defined(PSNIP_CLOCK_CPU_METHOD)
+#  define PSNIP_CLOCK_CPU_METHOD PSNIP_CLOCK_METHOD_CLOCK
+#endif
+
+/* Primarily here for testing. */
+#if !defined(PSNIP_CLOCK_MONOTONIC_METHOD) && defined(PSNIP_CLOCK_REQUIRE_MONOTONIC)
+#  error No monotonic clock found.
+#endif
+
+/* Implementations */
+
+#if \
+  (defined(PSNIP_CLOCK_CPU_METHOD)       && (PSNIP_CLOCK_CPU_METHOD       == PSNIP_CLOCK_METHOD_CLOCK_GETTIME)) || \
+  (defined(PSNIP_CLOCK_WALL_METHOD)      && (PSNIP_CLOCK_WALL_METHOD      == PSNIP_CLOCK_METHOD_CLOCK_GETTIME)) || \
+  (defined(PSNIP_CLOCK_MONOTONIC_METHOD) && (PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_CLOCK_GETTIME)) || \
+  (defined(PSNIP_CLOCK_CPU_METHOD)       && (PSNIP_CLOCK_CPU_METHOD       == PSNIP_CLOCK_METHOD_CLOCK)) || \
+  (defined(PSNIP_CLOCK_WALL_METHOD)      && (PSNIP_CLOCK_WALL_METHOD      == PSNIP_CLOCK_METHOD_CLOCK)) || \
+  (defined(PSNIP_CLOCK_MONOTONIC_METHOD) && (PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_CLOCK)) || \
+  (defined(PSNIP_CLOCK_CPU_METHOD)       && (PSNIP_CLOCK_CPU_METHOD       == PSNIP_CLOCK_METHOD_TIME)) || \
+  (defined(PSNIP_CLOCK_WALL_METHOD)      && (PSNIP_CLOCK_WALL_METHOD      == PSNIP_CLOCK_METHOD_TIME)) || \
+  (defined(PSNIP_CLOCK_MONOTONIC_METHOD) && (PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_TIME))
+#  include <time.h>
+#endif
+
+#if \
+  (defined(PSNIP_CLOCK_CPU_METHOD)       && (PSNIP_CLOCK_CPU_METHOD       == PSNIP_CLOCK_METHOD_GETTIMEOFDAY)) || \
+  (defined(PSNIP_CLOCK_WALL_METHOD)      && (PSNIP_CLOCK_WALL_METHOD      == PSNIP_CLOCK_METHOD_GETTIMEOFDAY)) || \
+  (defined(PSNIP_CLOCK_MONOTONIC_METHOD) && (PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_GETTIMEOFDAY))
+#  include <sys/time.h>
+#endif
+
+#if \
+  (defined(PSNIP_CLOCK_CPU_METHOD)       && (PSNIP_CLOCK_CPU_METHOD       == PSNIP_CLOCK_METHOD_GETPROCESSTIMES)) || \
+  (defined(PSNIP_CLOCK_WALL_METHOD)      && (PSNIP_CLOCK_WALL_METHOD      == PSNIP_CLOCK_METHOD_GETPROCESSTIMES)) || \
+  (defined(PSNIP_CLOCK_MONOTONIC_METHOD) && (PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_GETPROCESSTIMES)) || \
+  (defined(PSNIP_CLOCK_CPU_METHOD)       && (PSNIP_CLOCK_CPU_METHOD       == PSNIP_CLOCK_METHOD_GETTICKCOUNT64)) || \
+  (defined(PSNIP_CLOCK_WALL_METHOD)      && (PSNIP_CLOCK_WALL_METHOD      == PSNIP_CLOCK_METHOD_GETTICKCOUNT64)) || \
+  (defined(PSNIP_CLOCK_MONOTONIC_METHOD) && (PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_GETTICKCOUNT64))
+#  include <windows.h>
+#endif
+
+#if \
+  (defined(PSNIP_CLOCK_CPU_METHOD)       && (PSNIP_CLOCK_CPU_METHOD       == PSNIP_CLOCK_METHOD_GETRUSAGE)) || \
+  (defined(PSNIP_CLOCK_WALL_METHOD)      && (PSNIP_CLOCK_WALL_METHOD      == PSNIP_CLOCK_METHOD_GETRUSAGE)) || \
+  (defined(PSNIP_CLOCK_MONOTONIC_METHOD) && (PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_GETRUSAGE))
+#  include <sys/time.h>
+#  include <sys/resource.h>
+#endif
+
+#if \
+  (defined(PSNIP_CLOCK_CPU_METHOD)       && (PSNIP_CLOCK_CPU_METHOD       == PSNIP_CLOCK_METHOD_MACH_ABSOLUTE_TIME)) || \
+  (defined(PSNIP_CLOCK_WALL_METHOD)      && (PSNIP_CLOCK_WALL_METHOD      == PSNIP_CLOCK_METHOD_MACH_ABSOLUTE_TIME)) || \
+  (defined(PSNIP_CLOCK_MONOTONIC_METHOD) && (PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_MACH_ABSOLUTE_TIME))
+#  include <CoreServices/CoreServices.h>
+#  include <mach/mach.h>
+#  include <mach/mach_time.h>
+#endif
+
+/*** Implementations ***/
+
+#define PSNIP_CLOCK_NSEC_PER_SEC ((psnip_uint32_t) (1000000000ULL))
+
+#if \
+  (defined(PSNIP_CLOCK_CPU_METHOD)       && (PSNIP_CLOCK_CPU_METHOD       == PSNIP_CLOCK_METHOD_CLOCK_GETTIME)) || \
+  (defined(PSNIP_CLOCK_WALL_METHOD)      && (PSNIP_CLOCK_WALL_METHOD      == PSNIP_CLOCK_METHOD_CLOCK_GETTIME)) || \
+  (defined(PSNIP_CLOCK_MONOTONIC_METHOD) && (PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_CLOCK_GETTIME))
+PSNIP_CLOCK__FUNCTION psnip_uint32_t
+psnip_clock__clock_getres (clockid_t clk_id) {
+  struct timespec res;
+  int r;
+
+  r = clock_getres(clk_id, &res);
+  if (r != 0)
+    return 0;
+
+  return (psnip_uint32_t) (PSNIP_CLOCK_NSEC_PER_SEC / res.tv_nsec);
+}
+
+PSNIP_CLOCK__FUNCTION int
+psnip_clock__clock_gettime (clockid_t clk_id, struct PsnipClockTimespec* res) {
+  struct timespec ts;
+
+  if (clock_gettime(clk_id, &ts) != 0)
+    return -10;
+
+  res->seconds = (psnip_uint64_t) (ts.tv_sec);
+  res->nanoseconds = (psnip_uint64_t) (ts.tv_nsec);
+
+  return 0;
+}
+#endif
+
+PSNIP_CLOCK__FUNCTION psnip_uint32_t
+psnip_clock_wall_get_precision (void) {
+#if !defined(PSNIP_CLOCK_WALL_METHOD)
+  return 0;
+#elif defined(PSNIP_CLOCK_WALL_METHOD) && PSNIP_CLOCK_WALL_METHOD == PSNIP_CLOCK_METHOD_CLOCK_GETTIME
+  return psnip_clock__clock_getres(PSNIP_CLOCK_CLOCK_GETTIME_WALL);
+#elif defined(PSNIP_CLOCK_WALL_METHOD) && PSNIP_CLOCK_WALL_METHOD == PSNIP_CLOCK_METHOD_GETTIMEOFDAY
+  return 1000000;
+#elif defined(PSNIP_CLOCK_WALL_METHOD) && PSNIP_CLOCK_WALL_METHOD == PSNIP_CLOCK_METHOD_TIME
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+PSNIP_CLOCK__FUNCTION int
+psnip_clock_wall_get_time (struct PsnipClockTimespec* res) {
+  (void) res;
+
+#if !defined(PSNIP_CLOCK_WALL_METHOD)
+  return -2;
+#elif defined(PSNIP_CLOCK_WALL_METHOD) && PSNIP_CLOCK_WALL_METHOD == PSNIP_CLOCK_METHOD_CLOCK_GETTIME
+  return psnip_clock__clock_gettime(PSNIP_CLOCK_CLOCK_GETTIME_WALL, res);
+#elif defined(PSNIP_CLOCK_WALL_METHOD) && PSNIP_CLOCK_WALL_METHOD == PSNIP_CLOCK_METHOD_TIME
+  res->seconds = time(NULL);
+  res->nanoseconds = 0;
+#elif defined(PSNIP_CLOCK_WALL_METHOD) && PSNIP_CLOCK_WALL_METHOD == PSNIP_CLOCK_METHOD_GETTIMEOFDAY
+  struct timeval tv;
+
+  if (gettimeofday(&tv, NULL) != 0)
+    return -6;
+
+  res->seconds = tv.tv_sec;
+  res->nanoseconds = tv.tv_usec * 1000;
+#else
+  return -2;
+#endif
+
+  return 0;
+}
+
+PSNIP_CLOCK__FUNCTION psnip_uint32_t
+psnip_clock_cpu_get_precision (void) {
+#if !defined(PSNIP_CLOCK_CPU_METHOD)
+  return 0;
+#elif defined(PSNIP_CLOCK_CPU_METHOD) && PSNIP_CLOCK_CPU_METHOD == PSNIP_CLOCK_METHOD_CLOCK_GETTIME
+  return psnip_clock__clock_getres(PSNIP_CLOCK_CLOCK_GETTIME_CPU);
+#elif defined(PSNIP_CLOCK_CPU_METHOD) && PSNIP_CLOCK_CPU_METHOD == PSNIP_CLOCK_METHOD_CLOCK
+  return CLOCKS_PER_SEC;
+#elif defined(PSNIP_CLOCK_CPU_METHOD) && PSNIP_CLOCK_CPU_METHOD == PSNIP_CLOCK_METHOD_GETPROCESSTIMES
+  return PSNIP_CLOCK_NSEC_PER_SEC / 100;
+#else
+  return 0;
+#endif
+}
+
+PSNIP_CLOCK__FUNCTION int
+psnip_clock_cpu_get_time (struct PsnipClockTimespec* res) {
+#if !defined(PSNIP_CLOCK_CPU_METHOD)
+  (void) res;
+  return -2;
+#elif defined(PSNIP_CLOCK_CPU_METHOD) && PSNIP_CLOCK_CPU_METHOD == PSNIP_CLOCK_METHOD_CLOCK_GETTIME
+  return psnip_clock__clock_gettime(PSNIP_CLOCK_CLOCK_GETTIME_CPU, res);
+#elif defined(PSNIP_CLOCK_CPU_METHOD) && PSNIP_CLOCK_CPU_METHOD == PSNIP_CLOCK_METHOD_CLOCK
+  clock_t t = clock();
+  if (t == ((clock_t) -1))
+    return -5;
+  res->seconds = t / CLOCKS_PER_SEC;
+  res->nanoseconds = (t % CLOCKS_PER_SEC) * (PSNIP_CLOCK_NSEC_PER_SEC / CLOCKS_PER_SEC);
+#elif defined(PSNIP_CLOCK_CPU_METHOD) && PSNIP_CLOCK_CPU_METHOD == PSNIP_CLOCK_METHOD_GETPROCESSTIMES
+  FILETIME CreationTime, ExitTime, KernelTime, UserTime;
+  LARGE_INTEGER date, adjust;
+
+  if (!GetProcessTimes(GetCurrentProcess(), &CreationTime, &ExitTime, &KernelTime, &UserTime))
+    return -7;
+
+  /* http://www.frenk.com/2009/12/convert-filetime-to-unix-timestamp/ */
+  date.HighPart = UserTime.dwHighDateTime;
+  date.LowPart = UserTime.dwLowDateTime;
+  adjust.QuadPart = 11644473600000 * 10000;
+  date.QuadPart -= adjust.QuadPart;
+
+  res->seconds = date.QuadPart / 10000000;
+  res->nanoseconds = (date.QuadPart % 10000000) * (PSNIP_CLOCK_NSEC_PER_SEC / 100);
+#elif PSNIP_CLOCK_CPU_METHOD == PSNIP_CLOCK_METHOD_GETRUSAGE
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return -8;
+
+  res->seconds = usage.ru_utime.tv_sec;
+  res->nanoseconds = tv.tv_usec * 1000;
+#else
+  (void) res;
+  return -2;
+#endif
+
+  return 0;
+}
+
+PSNIP_CLOCK__FUNCTION psnip_uint32_t
+psnip_clock_monotonic_get_precision (void) {
+#if !defined(PSNIP_CLOCK_MONOTONIC_METHOD)
+  return 0;
+#elif defined(PSNIP_CLOCK_MONOTONIC_METHOD) && PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_CLOCK_GETTIME
+  return psnip_clock__clock_getres(PSNIP_CLOCK_CLOCK_GETTIME_MONOTONIC);
+#elif defined(PSNIP_CLOCK_MONOTONIC_METHOD) && PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_MACH_ABSOLUTE_TIME
+  static mach_timebase_info_data_t tbi = { 0, };
+  if (tbi.denom == 0)
+    mach_timebase_info(&tbi);
+  return (psnip_uint32_t) (tbi.numer / tbi.denom);
+#elif defined(PSNIP_CLOCK_MONOTONIC_METHOD) && PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_GETTICKCOUNT64
+  return 1000;
+#elif defined(PSNIP_CLOCK_MONOTONIC_METHOD) && PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_QUERYPERFORMANCECOUNTER
+  LARGE_INTEGER Frequency;
+  QueryPerformanceFrequency(&Frequency);
+  return (psnip_uint32_t) ((Frequency.QuadPart > PSNIP_CLOCK_NSEC_PER_SEC) ? PSNIP_CLOCK_NSEC_PER_SEC : Frequency.QuadPart);
+#else
+  return 0;
+#endif
+}
+
+PSNIP_CLOCK__FUNCTION int
+psnip_clock_monotonic_get_time (struct PsnipClockTimespec* res) {
+#if !defined(PSNIP_CLOCK_MONOTONIC_METHOD)
+  (void) res;
+  return -2;
+#elif defined(PSNIP_CLOCK_MONOTONIC_METHOD) && PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_CLOCK_GETTIME
+  return psnip_clock__clock_gettime(PSNIP_CLOCK_CLOCK_GETTIME_MONOTONIC, res);
+#elif defined(PSNIP_CLOCK_MONOTONIC_METHOD) && PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_MACH_ABSOLUTE_TIME
+  psnip_uint64_t nsec = mach_absolute_time();
+  static mach_timebase_info_data_t tbi = { 0, };
+  if (tbi.denom == 0)
+    mach_timebase_info(&tbi);
+  nsec *= ((psnip_uint64_t) tbi.numer) / ((psnip_uint64_t) tbi.denom);
+  res->seconds = nsec / PSNIP_CLOCK_NSEC_PER_SEC;
+  res->nanoseconds = nsec % PSNIP_CLOCK_NSEC_PER_SEC;
+#elif defined(PSNIP_CLOCK_MONOTONIC_METHOD) && PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_QUERYPERFORMANCECOUNTER
+  LARGE_INTEGER t, f;
+  if (QueryPerformanceCounter(&t) == 0)
+    return -12;
+
+  QueryPerformanceFrequency(&f);
+  res->seconds = t.QuadPart / f.QuadPart;
+  res->nanoseconds = t.QuadPart % f.QuadPart;
+  if (f.QuadPart > PSNIP_CLOCK_NSEC_PER_SEC)
+    res->nanoseconds /= f.QuadPart / PSNIP_CLOCK_NSEC_PER_SEC;
+  else
+    res->nanoseconds *= PSNIP_CLOCK_NSEC_PER_SEC / f.QuadPart;
+#elif defined(PSNIP_CLOCK_MONOTONIC_METHOD) && PSNIP_CLOCK_MONOTONIC_METHOD == PSNIP_CLOCK_METHOD_GETTICKCOUNT64
+  const ULONGLONG msec = GetTickCount64();
+  res->seconds = msec / 1000;
+  res->nanoseconds = sec % 1000;
+#else
+  return -2;
+#endif
+
+  return 0;
+}
+
+/* Returns the number of ticks per second for the specified clock.
+ * For example, a clock with millisecond precision would return 1000,
+ * and a clock with 1 second (such as the time() function) would
+ * return 1.
+ *
+ * If the requested clock isn't available, it will return 0.
+ * Hopefully this will be rare, but if it happens to you please let us
+ * know so we can work on finding a way to support your system.
+ *
+ * Note that different clocks on the same system often have a
+ * different precisions.
+ */
+PSNIP_CLOCK__FUNCTION psnip_uint32_t
+psnip_clock_get_precision (enum PsnipClockType clock_type) {
+  switch (clock_type) {
+    case PSNIP_CLOCK_TYPE_MONOTONIC:
+      return psnip_clock_monotonic_get_precision ();
+    case PSNIP_CLOCK_TYPE_CPU:
+      return psnip_clock_cpu_get_precision ();
+    case PSNIP_CLOCK_TYPE_WALL:
+      return psnip_clock_wall_get_precision ();
+  }
+
+  PSNIP_CLOCK_UNREACHABLE();
+  return 0;
+}
+
+/* Set the provided timespec to the requested time.  Returns 0 on
+ * success, or a negative value on failure. */
+PSNIP_CLOCK__FUNCTION int
+psnip_clock_get_time (enum PsnipClockType clock_type, struct PsnipClockTimespec* res) {
+  assert(res != NULL);
+
+  switch (clock_type) {
+    case PSNIP_CLOCK_TYPE_MONOTONIC:
+      return psnip_clock_monotonic_get_time (res);
+    case PSNIP_CLOCK_TYPE_CPU:
+      return psnip_clock_cpu_get_time (res);
+    case PSNIP_CLOCK_TYPE_WALL:
+      return psnip_clock_wall_get_time (res);
+  }
+
+  return -1;
+}
+
+#endif /* !defined(PSNIP_CLOCK_H) */
+
+static psnip_uint64_t
+munit_clock_get_elapsed(struct PsnipClockTimespec* start, struct PsnipClockTimespec* end) {
+  psnip_uint64_t r = (end->seconds - start->seconds) * PSNIP_CLOCK_NSEC_PER_SEC;
+  if (end->nanoseconds < start->nanoseconds) {
+    r -= (start->nanoseconds - end->nanoseconds);
+  } else {
+    r += (end->nanoseconds - start->nanoseconds);
+  }
+  return r;
+}
+
+#if !defined(MUNIT_NO_FORK)
+static munit_uint64_t
+munit_clock_monotonic_ns(void) {
+  struct PsnipClockTimespec ts = { 0, };
+
+  psnip_clock_get_time(PSNIP_CLOCK_TYPE_MONOTONIC, &ts);
+  return ts.seconds * PSNIP_CLOCK_NSEC_PER_SEC + ts.nanoseconds;
+}
+#endif
+
+#else
+#  include <time.h>
+#endif /* defined(MUNIT_ENABLE_TIMING) */
+
+/*** PRNG stuff ***/
+
+/* This is (unless I screwed up, which is entirely possible) the
+ * version of PCG with 32-bit state.  It was chosen because it has a
+ * small enough state that we should reliably be able to use CAS
+ * instead of requiring a lock for thread-safety.
+ *
+ * If I did screw up, I probably will not bother changing it unless
+ * there is a significant bias.  It's really not important this be
+ * particularly strong, as long as it is fairly random it's much more
+ * important that it be reproducible, so bug reports have a better
+ * chance of being reproducible. */
+
+#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L) && !defined(__STDC_NO_ATOMICS__) && !defined(__EMSCRIPTEN__) && (!defined(__GNUC_MINOR__) || (__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ > 8))
+#  define HAVE_STDATOMIC
+#elif defined(__clang__)
+#  if __has_extension(c_atomic)
+#    define HAVE_CLANG_ATOMICS
+#  endif
+#endif
+
+/* Workaround for http://llvm.org/bugs/show_bug.cgi?id=26911 */
+#if defined(__clang__) && defined(_WIN32)
+#  undef HAVE_STDATOMIC
+#  if defined(__c2__)
+#    undef HAVE_CLANG_ATOMICS
+#  endif
+#endif
+
+#if defined(_OPENMP)
+#  define ATOMIC_UINT32_T uint32_t
+#  define ATOMIC_UINT32_INIT(x) (x)
+#elif defined(HAVE_STDATOMIC)
+#  include <stdatomic.h>
+#  define ATOMIC_UINT32_T _Atomic uint32_t
+#  define ATOMIC_UINT32_INIT(x) ATOMIC_VAR_INIT(x)
+#elif defined(HAVE_CLANG_ATOMICS)
+#  define ATOMIC_UINT32_T _Atomic uint32_t
+#  define ATOMIC_UINT32_INIT(x) (x)
+#elif defined(_WIN32)
+#  define ATOMIC_UINT32_T volatile LONG
+#  define ATOMIC_UINT32_INIT(x) (x)
+#else
+#  define ATOMIC_UINT32_T volatile uint32_t
+#  define ATOMIC_UINT32_INIT(x) (x)
+#endif
+
+
+#if defined(_OPENMP)
+static inline void
+munit_atomic_store(ATOMIC_UINT32_T* dest, ATOMIC_UINT32_T value) {
+#pragma omp critical (munit_atomics)
+  *dest = value;
+}
+
+static inline uint32_t
+munit_atomic_load(ATOMIC_UINT32_T* src) {
+  int ret;
+#pragma omp critical (munit_atomics)
+  ret = *src;
+  return ret;
+}
+
+static inline uint32_t
+munit_atomic_cas(ATOMIC_UINT32_T* dest, ATOMIC_UINT32_T* expected, ATOMIC_UINT32_T desired) {
+  munit_bool ret;
+
+#pragma omp critical (munit_atomics)
+  {
+    if (*dest == *expected) {
+      *dest = desired;
+      ret = 1;
+    } else {
+      ret = 0;
+    }
+  }
+
+  return ret;
+}
+#elif defined(HAVE_STDATOMIC)
+#  define munit_atomic_store(dest, value)         atomic_store(dest, value)
+#  define munit_atomic_load(src)                  atomic_load(src)
+#  define munit_atomic_cas(dest, expected, value) atomic_compare_exchange_weak(dest, expected, value)
+#elif defined(HAVE_CLANG_ATOMICS)
+#  define munit_atomic_store(dest, value)         __c11_atomic_store(dest, value, __ATOMIC_SEQ_CST)
+#  define munit_atomic_load(src)                  __c11_atomic_load(src, __ATOMIC_SEQ_CST)
+#  define munit_atomic_cas(dest, expected, value) __c11_atomic_compare_exchange_weak(dest, expected, value, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#elif defined(__GNUC__) && (__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7)
+#  define munit_atomic_store(dest, value)         __atomic_store_n(dest, value, __ATOMIC_SEQ_CST)
+#  define munit_atomic_load(src)                  __atomic_load_n(src, __ATOMIC_SEQ_CST)
+#  define munit_atomic_cas(dest, expected, value) __atomic_compare_exchange_n(dest, expected, value, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#elif defined(__GNUC__) && (__GNUC__ >= 4)
+#  define munit_atomic_store(dest,value)          do { *(dest) = (value); } while (0)
+#  define munit_atomic_load(src)                  (*(src))
+#  define munit_atomic_cas(dest, expected, value) __sync_bool_compare_and_swap(dest, *expected, value)
+#elif defined(_WIN32) /* Untested */
+#  define munit_atomic_store(dest,value)          do { *(dest) = (value); } while (0)
+#  define munit_atomic_load(src)                  (*(src))
+#  define munit_atomic_cas(dest, expected, value) InterlockedCompareExchange((dest), (value), *(expected))
+#else
+#  warning No atomic implementation, PRNG will not be thread-safe
+#  define munit_atomic_store(dest, value)         do { *(dest) = (value); } while (0)
+#  define munit_atomic_load(src)                  (*(src))
+static inline munit_bool
+munit_atomic_cas(ATOMIC_UINT32_T* dest, ATOMIC_UINT32_T* expected, ATOMIC_UINT32_T desired) {
+  if (*dest == *expected) {
+    *dest = desired;
+    return 1;
+  } else {
+    return 0;
+  }
+}
+#endif
+
+#if !defined(MUNIT_THREAD_LOCAL)
+static ATOMIC_UINT32_T munit_rand_state = ATOMIC_UINT32_INIT(42);
+#endif
+
+#define MUNIT_PRNG_MULTIPLIER (747796405U)
+#define MUNIT_PRNG_INCREMENT  (1729U)
+
+static munit_uint32_t
+munit_rand_next_state(munit_uint32_t state) {
+  return state * MUNIT_PRNG_MULTIPLIER + MUNIT_PRNG_INCREMENT;
+}
+
+static munit_uint32_t
+munit_rand_from_state(munit_uint32_t state) {
+  munit_uint32_t res = ((state >> ((state >> 28) + 4)) ^ state) * (277803737U);
+  res ^= res >> 22;
+  return res;
+}
+
+/* The state munit_rand_seed was last called with, from which the
+ * state for each thread is derived. */
+static ATOMIC_UINT32_T munit_rand_base = ATOMIC_UINT32_INIT(42);
+
+/* Derive the initial state for a thread.  Thread 0 (the one which
+ * called munit_rand_seed) gets the seed's state, so single-threaded
+ * tests see the same sequence they always have. */
+static munit_uint32_t
+munit_rand_thread_derive(munit_uint32_t base, munit_uint32_t index) {
+  if (index == 0)
+    return base;
+
+  return munit_rand_next_state(base ^ munit_rand_from_state(munit_rand_next_state(index * 2654435769U)));
+}
+
+#if defined(MUNIT_THREAD_LOCAL)
+/* Each thread has its own state, so threads don't fight over a single
+ * cache line (and munit_rand_memory doesn't have to regenerate the
+ * whole buffer every time another thread gets there first).  Threads
+ * are numbered in the order they first use the PRNG after it is
+ * seeded, unless they call munit_rand_seed_thread to choose their own
+ * index.  munit_rand_generation is bumped whenever the PRNG is seeded
+ * so the other threads know to derive a new state. */
+static ATOMIC_UINT32_T munit_rand_generation = ATOMIC_UINT32_INIT(1);
+static ATOMIC_UINT32_T munit_rand_threads = ATOMIC_UINT32_INIT(0);
+static MUNIT_THREAD_LOCAL munit_uint32_t munit_rand_thread_state = 0;
+static MUNIT_THREAD_LOCAL munit_uint32_t munit_rand_thread_generation = 0;
+
+static munit_uint32_t
+munit_rand_thread_next_index(void) {
+  munit_uint32_t old;
+
+  do {
+    old = munit_atomic_load(&munit_rand_threads);
+  } while (!munit_atomic_cas(&munit_rand_threads, &old, old + 1));
+
+  return old;
+}
+
+static munit_uint32_t*
+munit_rand_thread_state_get(void) {
+  munit_uint32_t generation = munit_atomic_load(&munit_rand_generation);
+
+  if (MUNIT_UNLIKELY(munit_rand_thread_generation != generation)) {
+    munit_rand_thread_state = munit_rand_thread_derive(munit_atomic_load(&munit_rand_base), munit_rand_thread_next_index());
+    munit_rand_thread_generation = generation;
+  }
+
+  return &munit_rand_thread_state;
+}
+
+void
+munit_rand_seed(munit_uint32_t seed) {
+  const munit_uint32_t state = munit_rand_next_state(seed + MUNIT_PRNG_INCREMENT);
+  munit_uint32_t generation;
+
+  munit_atomic_store(&munit_rand_base, state);
+  munit_atomic_store(&munit_rand_threads, 1);
+  generation = munit_atomic_load(&munit_rand_generation) + 1;
+  munit_atomic_store(&munit_rand_generation, generation);
+
+  munit_rand_thread_state = state;
+  munit_rand_thread_generation = generation;
+}
+
+void
+munit_rand_seed_thread(munit_uint32_t index) {
+  munit_rand_thread_generation = munit_atomic_load(&munit_rand_generation);
+  munit_rand_thread_state = munit_rand_thread_derive(munit_atomic_load(&munit_rand_base), index);
+}
+#else
+void
+munit_rand_seed(munit_uint32_t seed) {
+  munit_uint32_t state = munit_rand_next_state(seed + MUNIT_PRNG_INCREMENT);
+  munit_atomic_store(&munit_rand_base, state);
+  munit_atomic_store(&munit_rand_state, state);
+}
+
+void
+munit_rand_seed_thread(munit_uint32_t index) {
+  munit_atomic_store(&munit_rand_state, munit_rand_thread_derive(munit_atomic_load(&munit_rand_base), index));
+}
+#endif
+
+
+static munit_uint32_t
+munit_rand_generate_seed(void) {
+  munit_uint32_t seed, state;
+#if defined(MUNIT_ENABLE_TIMING)
+  struct PsnipClockTimespec wc = { 0, };
+
+  psnip_clock_get_time(PSNIP_CLOCK_TYPE_WALL, &wc);
+  seed = (munit_uint32_t) wc.nanoseconds;
+#else
+  seed = (munit_uint32_t) time(NULL);
+#endif
+
+  state = munit_rand_next_state(seed + MUNIT_PRNG_INCREMENT);
+  return munit_rand_from_state(state);
+}
+
+static munit_uint32_t
+munit_rand_state_uint32(munit_uint32_t* state) {
+  const munit_uint32_t old = *state;
+  *state = munit_rand_next_state(old);
+  return munit_rand_from_state(old);
+}
+
+munit_uint32_t
+munit_rand_uint32(void) {
+#if defined(MUNIT_THREAD_LOCAL)
+  return munit_rand_state_uint32(munit_rand_thread_state_get());
+#else
+  munit_uint32_t old, state;
+
+  do {
+    old = munit_atomic_load(&munit_rand_state);
+    state = munit_rand_next_state(old);
+  } while (!munit_atomic_cas(&munit_rand_state, &old, state));
+
+  return munit_rand_from_state(old);
+#endif
+}
+
+/* Bulk generation for munit_rand_memory.  Eight copies ("lanes") of
+ * the LCG are run side by side, lane k starting k steps ahead and
+ * each of them taking eight steps at a time, so the output is exactly
+ * what calling munit_rand_state_uint32 over and over would produce,
+ * but the lanes can be computed in parallel with SIMD. */
+
+#if !defined(MUNIT_NO_SIMD)
+#  if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#    define MUNIT_HAVE_SSE2
+#    include <emmintrin.h>
+#  endif
+#  if defined(MUNIT_HAVE_SSE2) && (defined(__x86_64__) || defined(__i386__)) && \
+  ((defined(__GNUC__) && !defined(__clang__) && ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))) || \
+   (defined(__clang__) && ((__clang_major__ > 3) || (__clang_major__ == 3 && __clang_minor__ >= 8))))
+#    define MUNIT_HAVE_AVX2_DISPATCH
+#    include <immintrin.h>
+#  endif
+#  if (defined(__ARM_NEON) || defined(__ARM_NEON__)) && !defined(__ARM_BIG_ENDIAN)
+#    define MUNIT_HAVE_NEON
+#    include <arm_neon.h>
+#  endif
+#endif
+
+#define MUNIT_PRNG_LANES 8
+
+/* Set up the lanes, and work out the multiplier and increment which
+ * advance a lane by MUNIT_PRNG_LANES steps at once. */
+static void
+munit_rand_lanes_init(munit_uint32_t state, munit_uint32_t lanes[MUNIT_PRNG_LANES], munit_uint32_t* mul, munit_uint32_t* inc) {
+  unsigned int i;
+
+  *mul = 1;
+  *inc = 0;
+  for (i = 0 ; i < MUNIT_PRNG_LANES ; i++) {
+    lanes[i] = state;
+    state = munit_rand_next_state(state);
+    *inc = *inc * MUNIT_PRNG_MULTIPLIER + MUNIT_PRNG_INCREMENT;
+    *mul = *mul * MUNIT_PRNG_MULTIPLIER;
+  }
+}
+
+/* Each of these fills blocks * MUNIT_PRNG_LANES 32-bit words, and
+ * leaves the state where munit_rand_state_uint32 would have. */
+#if !defined(MUNIT_HAVE_SSE2) && !defined(MUNIT_HAVE_NEON)
+static void
+munit_rand_state_blocks_scalar(munit_uint32_t* state, size_t blocks, munit_uint8_t* data) {
+  munit_uint32_t lanes[MUNIT_PRNG_LANES];
+  munit_uint32_t mul, inc, rv;
+  unsigned int i;
+
+  munit_rand_lanes_init(*state, lanes, &mul, &inc);
+
+  while (blocks-- > 0) {
+    for (i = 0 ; i < MUNIT_PRNG_LANES ; i++) {
+      rv = munit_rand_from_state(lanes[i]);
+      memcpy(data, &rv, sizeof(rv));
+      data += sizeof(rv);
+      lanes[i] = lanes[i] * mul + inc;
+    }
+  }
+
+  *state = lanes[0];
+}
+#endif
+
+#if defined(MUNIT_HAVE_SSE2)
+/* SSE2 has neither a 32-bit multiply nor per-lane shifts, so they have
+ * to be built out of _mm_mul_epu32. */
+static __m128i
+munit_mm_mullo_epi32(__m128i a, __m128i b) {
+  const __m128i even = _mm_mul_epu32(a, b);
+  const __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                            _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+/* x >> n is the high half of x * 2^(32 - n), as long as 0 < n < 32.
+ * 2^(32 - n) is built as a float and converted, which is only exact
+ * while it fits in an int (n > 1). */
+static __m128i
+munit_mm_srlv_epi32(__m128i x, __m128i n) {
+  const __m128i hi = _mm_set_epi32(-1, 0, -1, 0);
+  const __m128i pow = _mm_cvttps_epi32(_mm_castsi128_ps(_mm_slli_epi32(_mm_sub_epi32(_mm_set1_epi32(127 + 32), n), 23)));
+  const __m128i even = _mm_mul_epu32(x, pow);
+  const __m128i odd = _mm_mul_epu32(_mm_srli_epi64(x, 32), _mm_srli_epi64(pow, 32));
+
+  return _mm_or_si128(_mm_srli_epi64(even, 32), _mm_and_si128(odd, hi));
+}
+
+static __m128i
+munit_mm_rand_from_state(__m128i state) {
+  const __m128i shift = _mm_add_epi32(_mm_srli_epi32(state, 28), _mm_set1_epi32(4));
+  __m128i res = _mm_xor_si128(munit_mm_srlv_epi32(state, shift), state);
+
+  res = munit_mm_mullo_epi32(res, _mm_set1_epi32((int) 277803737U));
+  return _mm_xor_si128(res, _mm_srli_epi32(res, 22));
+}
+
+static void
+munit_rand_state_blocks_sse2(munit_uint32_t* state, size_t blocks, munit_uint8_t* data) {
+  munit_uint32_t lanes[MUNIT_PRNG_LANES];
+  munit_uint32_t mul, inc;
+  __m128i vmul, vinc, lo, hi;
+
+  munit_rand_lanes_init(*state, lanes, &mul, &inc);
+  vmul = _mm_set1_epi32((int) mul);
+  vinc = _mm_set1_epi32((int) inc);
+  lo = _mm_loadu_si128((const __m128i*) &(lanes[0]));
+  hi = _mm_loadu_si128((const __m128i*) &(lanes[4]));
+
+  while (blocks-- > 0) {
+    _mm_storeu_si128((__m128i*) data, munit_mm_rand_from_state(lo));
+    _mm_storeu_si128((__m128i*) (data + 16), munit_mm_rand_from_state(hi));
+    data += 32;
+    lo = _mm_add_epi32(munit_mm_mullo_epi32(lo, vmul), vinc);
+    hi = _mm_add_epi32(munit_mm_mullo_epi32(hi, vmul), vinc);
+  }
+
+  *state = (munit_uint32_t) _mm_cvtsi128_si32(lo);
+}
+#endif
+
+#if defined(MUNIT_HAVE_AVX2_DISPATCH)
+__attribute__((__target__("avx2")))
+static void
+munit_rand_state_blocks_avx2(munit_uint32_t* state, size_t blocks, munit_uint8_t* data) {
+  munit_uint32_t lanes[MUNIT_PRNG_LANES];
+  munit_uint32_t mul, inc;
+  __m256i vmul, vinc, four, out_mul, s, x;
+
+  munit_rand_lanes_init(*state, lanes, &mul, &inc);
+  vmul = _mm256_set1_epi32((int) mul);
+  vinc = _mm256_set1_epi32((int) inc);
+  four = _mm256_set1_epi32(4);
+  out_mul = _mm256_set1_epi32((int) 277803737U);
+  s = _mm256_loadu_si256((const __m256i*) lanes);
+
+  while (blocks-- > 0) {
+    x = _mm256_srlv_epi32(s, _mm256_add_epi32(_mm256_srli_epi32(s, 28), four));
+    x = _mm256_mullo_epi32(_mm256_xor_si256(x, s), out_mul);
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 22));
+    _mm256_storeu_si256((__m256i*) data, x);
+    data += 32;
+    s = _mm256_add_epi32(_mm256_mullo_epi32(s, vmul), vinc);
+  }
+
+  *state = (munit_uint32_t) _mm256_cvtsi256_si32(s);
+}
+#endif
+
+#if defined(MUNIT_HAVE_NEON)
+static uint32x4_t
+munit_neon_rand_from_state(uint32x4_t state) {
+  const int32x4_t shift = vreinterpretq_s32_u32(vaddq_u32(vshrq_n_u32(state, 28), vdupq_n_u32(4)));
+  uint32x4_t res = veorq_u32(vshlq_u32(state, vnegq_s32(shift)), state);
+
+  res = vmulq_u32(res, vdupq_n_u32(277803737U));
+  return veorq_u32(res, vshrq_n_u32(res, 22));
+}
+
+static void
+munit_rand_state_blocks_neon(munit_uint32_t* state, size_t blocks, munit_uint8_t* data) {
+  munit_uint32_t lanes[MUNIT_PRNG_LANES];
+  munit_uint32_t mul, inc;
+  uint32x4_t vmul, vinc, lo, hi;
+
+  munit_rand_lanes_init(*state, lanes, &mul, &inc);
+  vmul = vdupq_n_u32(mul);
+  vinc = vdupq_n_u32(inc);
+  lo = vld1q_u32(&(lanes[0]));
+  hi = vld1q_u32(&(lanes[4]));
+
+  while (blocks-- > 0) {
+    vst1q_u8(data, vreinterpretq_u8_u32(munit_neon_rand_from_state(lo)));
+    vst1q_u8(data + 16, vreinterpretq_u8_u32(munit_neon_rand_from_state(hi)));
+    data += 32;
+    lo = vmlaq_u32(vinc, lo, vmul);
+    hi = vmlaq_u32(vinc, hi, vmul);
+  }
+
+  *state = vgetq_lane_u32(lo, 0);
+}
+#endif
+
+static void
+munit_rand_state_blocks(munit_uint32_t* state, size_t blocks, munit_uint8_t* data) {
+#if defined(MUNIT_HAVE_AVX2_DISPATCH)
+  if (__builtin_cpu_supports("avx2")) {
+    munit_rand_state_blocks_avx2(state, blocks, data);
+    return;
+  }
+#endif
+
+#if defined(MUNIT_HAVE_SSE2)
+  munit_rand_state_blocks_sse2(state, blocks, data);
+#elif defined(MUNIT_HAVE_NEON)
+  munit_rand_state_blocks_neon(state, blocks, data);
+#else
+  munit_rand_state_blocks_scalar(state, blocks, data);
+#endif
+}
+
+static void
+munit_rand_state_memory(munit_uint32_t* state, size_t size, munit_uint8_t data[MUNIT_ARRAY_PARAM(size)]) {
+  size_t members_remaining = size / sizeof(munit_uint32_t);
+  size_t bytes_remaining = size % sizeof(munit_uint32_t);
+  munit_uint8_t* b = data;
+  munit_uint32_t rv;
+  const size_t blocks = members_remaining / MUNIT_PRNG_LANES;
+
+  if (blocks != 0) {
+    munit_rand_state_blocks(state, blocks, b);
+    b += blocks * MUNIT_PRNG_LANES * sizeof(munit_uint32_t);
+    members_remaining -= blocks * MUNIT_PRNG_LANES;
+  }
+
+  while (members_remaining-- > 0) {
+    rv = munit_rand_state_uint32(state);
+    memcpy(b, &rv, sizeof(munit_uint32_t));
+    b += sizeof(munit_uint32_t);
+  }
+  if (bytes_remaining != 0) {
+    rv = munit_rand_state_uint32(state);
+    memcpy(b, &rv, bytes_remaining);
+  }
+}
+
+void
+munit_rand_memory(size_t size, munit_uint8_t data[MUNIT_ARRAY_PARAM(size)]) {
+#if defined(MUNIT_THREAD_LOCAL)
+  munit_rand_state_memory(munit_rand_thread_state_get(), size, data);
+#else
+  munit_uint32_t old, state;
+
+  do {
+    state = old = munit_atomic_load(&munit_rand_state);
+    munit_rand_state_memory(&state, size, data);
+  } while (!munit_atomic_cas(&munit_rand_state, &old, state));
+#endif
+}
+
+static munit_uint32_t
+munit_rand_state_at_most(munit_uint32_t* state, munit_uint32_t salt, munit_uint32_t max) {
+  /* We want (UINT32_MAX + 1) % max, which in unsigned arithmetic is the same
+   * as (UINT32_MAX + 1 - max) % max = -max % max. We compute -max using not
+   * to avoid compiler warnings.
+   */
+  const munit_uint32_t min = (~max + 1U) % max;
+  munit_uint32_t x;
+
+  if (max == (~((munit_uint32_t) 0U)))
+    return munit_rand_state_uint32(state) ^ salt;
+
+  max++;
+
+  do {
+    x = munit_rand_state_uint32(state) ^ salt;
+  } while (x < min);
+
+  return x % max;
+}
+
+static munit_uint32_t
+munit_rand_at_most(munit_uint32_t salt, munit_uint32_t max) {
+#if defined(MUNIT_THREAD_LOCAL)
+  return munit_rand_state_at_most(munit_rand_thread_state_get(), salt, max);
+#else
+  munit_uint32_t old, state;
+  munit_uint32_t retval;
+
+  do {
+    state = old = munit_atomic_load(&munit_rand_state);
+    retval = munit_rand_state_at_most(&state, salt, max);
+  } while (!munit_atomic_cas(&munit_rand_state, &old, state));
+
+  return retval;
+#endif
+}
+
+int
+munit_rand_int_range(int min, int max) {
+  munit_uint64_t range = (munit_uint64_t) max - (munit_uint64_t) min;
+
+  if (min > max)
+    return munit_rand_int_range(max, min);
+
+  if (range > (~((munit_uint32_t) 0U)))
+    range = (~((munit_uint32_t) 0U));
+
+  return min + munit_rand_at_most(0, (munit_uint32_t) range);
+}
+
+double
+munit_rand_double(void) {
+#if defined(MUNIT_THREAD_LOCAL)
+  /* See http://mumble.net/~campbell/tmp/random_real.c for how to do
+   * this right.  Patches welcome if you feel that this is too
+   * biased. */
+  return munit_rand_state_uint32(munit_rand_thread_state_get()) / ((~((munit_uint32_t) 0U)) + 1.0);
+#else
+  munit_uint32_t old, state;
+  double retval = 0.0;
+
+  do {
+    state = old = munit_atomic_load(&munit_rand_state);
+
+    /* See http://mumble.net/~campbell/tmp/random_real.c for how to do
+     * this right.  Patches welcome if you feel that this is too
+     * biased. */
+    retval = munit_rand_state_uint32(&state) / ((~((munit_uint32_t) 0U)) + 1.0);
+  } while (!munit_atomic_cas(&munit_rand_state, &old, state));
+
+  return retval;
+#endif
+}
+
+/*** Test suite handling ***/
+
+#if defined(MUNIT_ENABLE_TIMING)
+/* Summary of the samples taken in benchmark mode.  Times are the wall
+ * clock time of a single iteration, in nanoseconds. */
+typedef struct {
+  unsigned int samples;
+  unsigned int iterations;
+  double min;
+  double median;
+  double p90;
+  double p99;
+  double stddev;
+  double mad;
+} MunitBenchStats;
+#endif
+
+#if defined(MUNIT_HAVE_PERF_EVENTS)
+#define MUNIT_PERF_TASK_CLOCK    0
+#define MUNIT_PERF_CYCLES        1
+#define MUNIT_PERF_INSTRUCTIONS  2
+#define MUNIT_PERF_CACHE_MISSES  3
+#define MUNIT_PERF_BRANCH_MISSES 4
+#define MUNIT_PERF_COUNTERS      5
+
+/* Hardware (and software) performance counters, summed over every
+ * successful iteration (--perf-counters).  Not every machine has every
+ * counter, so bit N of available is set if counter N was measured. */
+typedef struct {
+  unsigned int available;
+  munit_uint64_t values[MUNIT_PERF_COUNTERS];
+} MunitPerfReport;
+
+/* The counters opened for the current process, as a single group so
+ * they are all scheduled onto the PMU together.  The first one is the
+ * group leader. */
+typedef struct {
+  int fds[MUNIT_PERF_COUNTERS];
+  /* Which counter each value read from the group belongs to. */
+  unsigned int counters[MUNIT_PERF_COUNTERS];
+  unsigned int n;
+  /* What the counters read when measuring nothing at all (mostly the
+   * ioctl()s used to start and stop them), which is subtracted from
+   * every measurement. */
+  munit_uint64_t overhead[MUNIT_PERF_COUNTERS];
+} MunitPerfGroup;
+#endif
+
+#if defined(MUNIT_ENABLE_TIMING)
+/* Benchmark samples for one test case, loaded from a baseline file
+ * (--compare-baseline).  The samples are sorted. */
+typedef struct {
+  char* key;
+  size_t samples_l;
+  double* samples;
+} MunitBaselineEntry;
+
+/* One successful test case, for fitting the time taken against the
+ * parameter named by --scaling.  group is the other parameters,
+ * formatted like in the output, since those are fitted separately. */
+typedef struct {
+  char* group;
+  double n;
+  double ns;
+} MunitScalingPoint;
+#endif
+
+#if defined(MUNIT_HAVE_TIMING_DB)
+/* The timing database (--timing-db) is this header followed by an
+ * open-addressing hash table of capacity entries, which is always a
+ * power of two and never more than half full.  It's written in the
+ * machine's own byte order; if that's wrong, so is the version. */
+typedef struct {
+  char magic[8];
+  munit_uint32_t version;
+  munit_uint32_t capacity;
+  munit_uint32_t count;
+  munit_uint32_t reserved;
+} MunitTimingDbHeader;
+
+/* One test case.  hash is of the test name and parameters (see
+ * munit_timing_db_hash), and is never 0, which marks an empty entry. */
+typedef struct {
+  munit_uint64_t hash;
+  /* Moving average of the wall clock time, in nanoseconds. */
+  munit_uint64_t wall_clock;
+  munit_uint32_t runs;
+  munit_uint32_t reserved;
+} MunitTimingDbEntry;
+
+typedef struct {
+  const char* filename;
+  int fd;
+  /* Whether we got the lock.  If another process has it, we only
+   * read. */
+  munit_bool writable;
+  MunitTimingDbHeader* header;
+  size_t size;
+  /* What to expect from test cases which aren't in the database: the
+   * average of the ones which are. */
+  munit_uint64_t fallback;
+} MunitTimingDb;
+#endif
+
+typedef struct {
+  unsigned int successful;
+  unsigned int skipped;
+  unsigned int failed;
+  unsigned int errored;
+#if defined(MUNIT_ENABLE_TIMING)
+  munit_uint64_t cpu_clock;
+  munit_uint64_t wall_clock;
+  MunitBenchStats bench;
+#endif
+#if defined(MUNIT_HAVE_PERF_EVENTS)
+  MunitPerfReport perf;
+#endif
+#if defined(MUNIT_HAVE_RUSAGE)
+  MunitUsage usage;
+#endif
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+  MunitAllocReport allocs;
+#endif
+} MunitReport;
+
+#if !defined(MUNIT_NO_FORK)
+/* A test case (a test with one specific set of parameters) which has
+ * been started in a child process but not yet reported.  When running
+ * several tests at once (--jobs) these are kept in a queue so we can
+ * still report results in the order the tests appear in the suite. */
+typedef struct MunitTestCase_ MunitTestCase;
+
+#define MUNIT_RESULT_EMPTY 0
+#define MUNIT_RESULT_DONE  1
+
+/* Where a child process leaves its report.  These live in a shared
+ * mapping (the result arena) created before the runner forks anything,
+ * with one slot for each test case which may be running at once.  The
+ * status is only set to MUNIT_RESULT_DONE once the report is
+ * complete, so if the child dies part way through we know not to
+ * trust it. */
+typedef struct {
+  volatile munit_uint32_t status;
+  /* Only used by the runner. */
+  munit_bool busy;
+  unsigned int index;
+  MunitReport report;
+  /* In benchmark mode, followed by room for the samples. */
+} MunitResultSlot;
+
+#define MUNIT_RESULT_SLOT_SIZE(runner) \
+  (sizeof(MunitResultSlot) + sizeof(double) * (runner)->slot_samples)
+#define MUNIT_RESULT_SLOT(runner, i) \
+  ((MunitResultSlot*) (((munit_uint8_t*) (runner)->results) + MUNIT_RESULT_SLOT_SIZE(runner) * (i)))
+#define MUNIT_RESULT_SLOT_SAMPLES(slot) ((double*) ((slot) + 1))
+
+/* A long-lived child process which runs test cases sent to it by the
+ * runner (--fork-server). */
+typedef struct {
+  pid_t pid;
+  int sock;
+  MunitTestCase* tc;
+} MunitWorker;
+
+struct MunitTestCase_ {
+  const MunitTest* test;
+  /* Full name of the test. */
+  char* test_name;
+  MunitParameter* params;
+  /* Name of the test, if it needs to be printed before this case. */
+  char* name;
+  munit_bool parameterized;
+  FILE* stderr_buf;
+  MunitReport report;
+  pid_t pid;
+  MunitResultSlot* slot;
+  MunitWorker* worker;
+  /* Benchmark samples, and the name they're saved under in baseline
+   * files, if we need them. */
+  double* samples;
+  char* key;
+  /* Monotonic time (in nanoseconds) the case was started, and when it
+   * should be killed (0 for never). */
+  munit_uint64_t started;
+  munit_uint64_t deadline;
+  munit_bool timed_out;
+  /* Waiting for a free job slot; nothing has been started yet. */
+  munit_bool pending;
+  munit_bool done;
+#if defined(MUNIT_HAVE_TIMING_DB)
+  munit_uint64_t hash;
+  /* How long the timing database says it will take. */
+  munit_uint64_t expected;
+#endif
+  MunitTestCase* next;
+};
+
+/* What the runner sends to a worker to run a test case.  Workers are
+ * forked from the runner, so the test pointer is valid in the worker.
+ * It is followed by data_l bytes of parameters, stored as
+ * nul-terminated name and value pairs, and accompanied by the file
+ * descriptor the worker should use for stderr. */
+typedef struct {
+  const MunitTest* test;
+  munit_bool has_params;
+  size_t params_l;
+  size_t data_l;
+  /* Index of the result arena slot to put the report in. */
+  unsigned int slot;
+} MunitWorkerRequest;
+#endif
+
+/* Test names and patterns passed on the CLI.  Literal names, by far
+ * the most common, go in a trie; anything with glob characters is
+ * kept in a list. */
+typedef struct MunitFilterNode_ {
+  struct MunitFilterNode_* child;
+  struct MunitFilterNode_* next;
+  char c;
+  /* Whether a pattern ends here. */
+  munit_bool end;
+} MunitFilterNode;
+
+typedef struct {
+  MunitFilterNode root;
+  const char** globs;
+  size_t globs_l;
+} MunitFilter;
+
+typedef struct {
+  const char* s;
+  const char* next;
+} MunitFilterCursor;
+
+typedef enum {
+  MUNIT_SHARD_NONE,
+  /* Walking the tests to find every test case, without running any. */
+  MUNIT_SHARD_COUNT,
+  /* --list with --shard. */
+  MUNIT_SHARD_LIST,
+  MUNIT_SHARD_RUN
+} MunitShardMode;
+
+/* A test case (a test with one combination of parameters) found while
+ * planning the shards. */
+typedef struct {
+  /* Which test it belongs to, counting from 0 in the order they run. */
+  size_t test;
+  unsigned int shard;
+  /* Expected cost, or a negative number if we don't know. */
+  double weight;
+#if defined(MUNIT_HAVE_TIMING_DB)
+  /* From the timing database, in nanoseconds, or 0. */
+  munit_uint64_t expected;
+#endif
+} MunitShardCase;
+
+/* Which test cases this process runs (--shard). */
+typedef struct {
+  /* Counting from 0, unlike --shard. */
+  unsigned int index;
+  unsigned int count;
+  MunitShardMode mode;
+  MunitShardCase* cases;
+  size_t cases_l;
+  size_t cases_size;
+  size_t next_case;
+  size_t next_test;
+#if defined(MUNIT_ENABLE_TIMING)
+  MunitBaselineEntry* timings;
+  size_t timings_l;
+#endif
+} MunitShardPlan;
+
+typedef struct MunitReporter_ MunitReporter;
+
+typedef struct {
+  const char* prefix;
+  const MunitSuite* suite;
+  /* Full name of the test currently being run. */
+  const char* test_name;
+  /* The text reporter, followed by any from --reporter. */
+  MunitReporter* reporters;
+  size_t reporters_l;
+  MunitFilter tests;
+  MunitFilter exclude;
+  MunitShardPlan shard;
+  munit_uint32_t seed;
+  unsigned int iterations;
+  MunitParameter* parameters;
+  munit_bool single_parameter_mode;
+  /* Strength of the covering array to use for wildcard parameters
+   * (--param-coverage), or 0 for every combination. */
+  unsigned int param_coverage;
+  /* How many combinations of wildcard parameters to sample
+   * (--max-combinations), or 0 for all of them. */
+  unsigned int max_combinations;
+  void* user_data;
+  MunitReport report;
+  munit_bool colorize;
+  munit_bool fork;
+  munit_bool show_stderr;
+  munit_bool fatal_failures;
+  unsigned int jobs;
+  double timeout;
+#if defined(MUNIT_ENABLE_TIMING)
+  munit_bool benchmark;
+  unsigned int bench_samples;
+  double bench_min_time;
+  double bench_warmup;
+#endif
+#if defined(MUNIT_HAVE_PERF_EVENTS)
+  munit_bool perf_counters;
+  MunitPerfGroup perf;
+#endif
+#if defined(MUNIT_HAVE_RUSAGE)
+  munit_bool show_usage;
+#endif
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+  munit_bool count_allocs;
+#endif
+#if defined(MUNIT_ENABLE_TIMING)
+  MunitBaselineEntry* baseline;
+  size_t baseline_l;
+  FILE* baseline_out;
+  double regression_threshold;
+  unsigned int regressions;
+  /* Parameter to fit the time taken against (--scaling). */
+  const char* scaling;
+  MunitScalingPoint* scaling_points;
+  size_t scaling_points_l;
+  size_t scaling_points_size;
+#endif
+#if defined(MUNIT_HAVE_TIMING_DB)
+  MunitTimingDb timing_db;
+#endif
+#if !defined(MUNIT_NO_FORK)
+  munit_bool fork_server;
+  unsigned int fail_alloc_crashes;
+  MunitWorker* workers;
+  unsigned int workers_l;
+  MunitTestCase* cases;
+  MunitTestCase* cases_tail;
+  unsigned int cases_running;
+  unsigned int cases_queued;
+  struct pollfd* pollfds;
+  MunitResultSlot* results;
+  unsigned int slot_samples;
+  int sigchld_pipe[2];
+  munit_bool sigchld_installed;
+  struct sigaction sigchld_old;
+  /* Name of the test currently being queued, until it has been
+   * attached to its first test case. */
+  const char* pending_name;
+  munit_bool pending_name_parameterized;
+#endif
+} MunitTestRunner;
+
+#if !defined(MUNIT_NO_FORK)
+#  define MUNIT_TEST_RUNNER_PARALLEL(runner) ((runner)->fork && (runner)->jobs > 1)
+#else
+#  define MUNIT_TEST_RUNNER_PARALLEL(runner) 0
+#endif
+
+/* How a benchmarked test case compares to --compare-baseline. */
+typedef enum {
+  /* Not compared (no baseline was loaded, or it wasn't benchmarked). */
+  MUNIT_BASELINE_NONE,
+  /* The baseline doesn't have enough samples for this case. */
+  MUNIT_BASELINE_MISSING,
+  MUNIT_BASELINE_UNCHANGED,
+  MUNIT_BASELINE_SLOWER,
+  MUNIT_BASELINE_FASTER
+} MunitBaselineChange;
+
+/* A finished test case, as handed to the reporters. */
+typedef struct {
+  const MunitTest* test;
+  const char* test_name;
+  const MunitParameter* params;
+  /* What it counts as, once MUNIT_TEST_OPTION_TODO is taken into
+   * account.  A TODO test which failed is MUNIT_OK. */
+  MunitResult result;
+  munit_bool todo;
+  const MunitReport* report;
+  /* Whatever the test wrote to stderr, or NULL.  show_stderr is set
+   * if it's worth showing: the test failed, or --show-stderr. */
+  FILE* stderr_buf;
+  munit_bool show_stderr;
+  /* Comparison with the baseline, and the change in median time (as
+   * a percentage) and Mann-Whitney z which it is based on. */
+  MunitBaselineChange baseline;
+  double baseline_change;
+  double baseline_z;
+} MunitReporterCase;
+
+/* What the runner is about to do, right after suite_start.
+ * shard_count is 0 unless --shard was passed, and eta is 0 unless the
+ * timing database had an estimate. */
+typedef struct {
+  unsigned int shard_index;
+  unsigned int shard_count;
+  size_t cases;
+  size_t total_cases;
+  double eta;
+} MunitReporterPlan;
+
+/* A --fail-alloc run which didn't cope with its at-th allocation
+ * failing.  If it crashed, signal or exit_status says how (and the
+ * other is 0), otherwise result is MUNIT_FAIL or MUNIT_ERROR.
+ * stderr_buf is only set for crashes. */
+typedef struct {
+  const char* test_name;
+  const MunitParameter* params;
+  unsigned long at;
+  const char* file;
+  int line;
+  const void* caller;
+  munit_bool crashed;
+  munit_bool timed_out;
+  int signal;
+  int exit_status;
+  MunitResult result;
+  FILE* stderr_buf;
+} MunitReporterFailAlloc;
+
+/* The totals for every --fail-alloc run of a test case. */
+typedef struct {
+  const char* test_name;
+  const MunitParameter* params;
+  unsigned long allocations;
+  unsigned int handled;
+  unsigned int failed;
+  unsigned int crashed;
+} MunitReporterFailAllocSweep;
+
+/* How the time taken by a group of test cases grows with the
+ * --scaling parameter.  model is the name of the best fit, or NULL if
+ * there were too few values to fit; rms is relative to the mean. */
+typedef struct {
+  const char* test_name;
+  const char* group;
+  const char* parameter;
+  const char* model;
+  double rms;
+  double ns_per_element;
+} MunitReporterScaling;
+
+/* Everything the runner has to say about the tests goes through the
+ * reporters.  The text reporter writes what you see on
+ * MUNIT_OUTPUT_FILE, and the others (--reporter) write a
+ * machine-readable version to their own file as each test case is
+ * reported.  Any of the callbacks may be NULL.
+ *
+ * test_start is called before the first case of each test, and
+ * case_start before each case.  When running tests in parallel
+ * they're only called right before case_result, since results are
+ * reported in order.  fail_alloc and fail_alloc_sweep follow the
+ * case_result of the case they belong to, and scaling follows the
+ * last case of a test.  With --list --shard, only test_start and
+ * shard_case are called, with shard NULL if it isn't known. */
+typedef struct {
+  const char* name;
+  void (*suite_start)(MunitReporter* reporter, MunitTestRunner* runner);
+  void (*plan)(MunitReporter* reporter, MunitTestRunner* runner, const MunitReporterPlan* plan);
+  void (*test_start)(MunitReporter* reporter, MunitTestRunner* runner, const char* test_name, munit_bool parameterized);
+  void (*case_start)(MunitReporter* reporter, MunitTestRunner* runner, const char* test_name, const MunitParameter params[]);
+  void (*case_result)(MunitReporter* reporter, MunitTestRunner* runner, const MunitReporterCase* tc);
+  void (*fail_alloc)(MunitReporter* reporter, MunitTestRunner* runner, const MunitReporterFailAlloc* fa);
+  void (*fail_alloc_sweep)(MunitReporter* reporter, MunitTestRunner* runner, const MunitReporterFailAllocSweep* sweep);
+  void (*scaling)(MunitReporter* reporter, MunitTestRunner* runner, const MunitReporterScaling* fit);
+  void (*shard_case)(MunitReporter* reporter, MunitTestRunner* runner, const char* test_name, const MunitParameter params[], const MunitShardCase* shard);
+  void (*summary)(MunitReporter* reporter, MunitTestRunner* runner);
+} MunitReporterType;
+
+struct MunitReporter_ {
+  const MunitReporterType* type;
+  FILE* fp;
+  /* Totals of the cases this reporter has seen, and where to write
+   * them once they're known (the JUnit reporter), or -1. */
+  MunitReport totals;
+  long totals_pos;
+};
+
+const char*
+munit_parameters_get(const MunitParameter params[], const char* key) {
+  const MunitParameter* param;
+
+  for (param = params ; param != NULL && param->name != NULL ; param++)
+    if (strcmp(param->name, key) == 0)
+      return param->value;
+  return NULL;
+}
+
+#if defined(MUNIT_ENABLE_TIMING)
+static void
+munit_print_time(FILE* fp, double nanoseconds) {
+  fprintf(fp, "%" MUNIT_TEST_TIME_FORMAT, nanoseconds / ((double) PSNIP_CLOCK_NSEC_PER_SEC));
+}
+
+static void
+munit_print_duration(FILE* fp, double nanoseconds) {
+  const double seconds = nanoseconds / ((double) PSNIP_CLOCK_NSEC_PER_SEC);
+  const unsigned long whole = (unsigned long) (seconds + 0.5);
+
+  if (seconds < 10)
+    fprintf(fp, "%.2fs", seconds);
+  else if (seconds < 60)
+    fprintf(fp, "%.1fs", seconds);
+  else if (whole < 3600)
+    fprintf(fp, "%lum %02lus", whole / 60, whole % 60);
+  else
+    fprintf(fp, "%luh %02lum", whole / 3600, (whole / 60) % 60);
+}
+#endif
+
+/* Add a paramter to an array of parameters. */
+static MunitResult
+munit_parameters_add(size_t* params_size, MunitParameter* params[MUNIT_ARRAY_PARAM(*params_size)], char* name, char* value) {
+  *params = realloc(*params, sizeof(MunitParameter) * (*params_size + 2));
+  if (*params == NULL)
+    return MUNIT_ERROR;
+
+  (*params)[*params_size].name = name;
+  (*params)[*params_size].value = value;
+  (*params_size)++;
+  (*params)[*params_size].name = NULL;
+  (*params)[*params_size].value = NULL;
+
+  return MUNIT_OK;
+}
+
+/* Concatenate two strings, but just return one of the components
+ * unaltered if the other is NULL or "". */
+static char*
+munit_maybe_concat(size_t* len, char* prefix, char* suffix) {
+  char* res;
+  size_t res_l;
+  const size_t prefix_l = prefix != NULL ? strlen(prefix) : 0;
+  const size_t suffix_l = suffix != NULL ? strlen(suffix) : 0;
+  if (prefix_l == 0 && suffix_l == 0) {
+    res = NULL;
+    res_l = 0;
+  } else if (prefix_l == 0 && suffix_l != 0) {
+    res = suffix;
+    res_l = suffix_l;
+  } else if (prefix_l != 0 && suffix_l == 0) {
+    res = prefix;
+    res_l = prefix_l;
+  } else {
+    res_l = prefix_l + suffix_l;
+    res = malloc(res_l + 1);
+    memcpy(res, prefix, prefix_l);
+    memcpy(res + prefix_l, suffix, suffix_l);
+    res[res_l] = 0;
+  }
+
+  if (len != NULL)
+    *len = res_l;
+
+  return res;
+}
+
+/* Possbily free a string returned by munit_maybe_concat. */
+static void
+munit_maybe_free_concat(char* s, const char* prefix, const char* suffix) {
+  if (prefix != s && suffix != s)
+    free(s);
+}
+
+/* Cheap string hash function, used to salt the PRNG and to look up
+ * parameters by name. */
+static munit_uint32_t
+munit_str_hash(const char* name) {
+  const char *p;
+  munit_uint32_t h = 5381U;
+
+  for (p = name; *p != '\0'; p++)
+    h = (h << 5) + h + *p;
+
+  return h;
+}
+
+/*** Typed parameters ***/
+
+/* Every parameter value is parsed as each type once per combination
+ * (munit_parameters_index), instead of every time a test asks for
+ * it, and looked up through a hash of the names. */
+
+#define MUNIT_PARAMETER_INT64  (1 << 0)
+#define MUNIT_PARAMETER_UINT64 (1 << 1)
+#define MUNIT_PARAMETER_DOUBLE (1 << 2)
+#define MUNIT_PARAMETER_BOOL   (1 << 3)
+
+#define MUNIT_INT64_MAX ((munit_uint64_t) (~((munit_uint64_t) 0) >> 1))
+
+typedef struct {
+  /* The string this was parsed from, in case the test changes it. */
+  const char* value;
+  /* Which of the types below value is valid for. */
+  int types;
+  munit_int64_t i;
+  munit_uint64_t u;
+  double d;
+  munit_bool b;
+} MunitParameterValue;
+
+static struct {
+  const MunitParameter* params;
+  MunitParameterValue* values;
+  /* Open addressing; position in params + 1, or 0 if empty. */
+  size_t* index;
+  size_t index_mask;
+} munit_parameters_cache = { NULL, NULL, NULL, 0 };
+
+/* Binary multiple for a suffix like the "K" in "4K", or 0 if there
+ * isn't one.  Also eats an optional "iB" or "B". */
+static munit_uint64_t
+munit_parse_suffix(const char** str) {
+  const char* p = *str;
+  munit_uint64_t mul;
+
+  switch (*p) {
+    case '\0': return 1;
+    case 'k': case 'K': mul = 1ULL << 10; break;
+    case 'm': case 'M': mul = 1ULL << 20; break;
+    case 'g': case 'G': mul = 1ULL << 30; break;
+    case 't': case 'T': mul = 1ULL << 40; break;
+    default: return 0;
+  }
+
+  p++;
+  if (*p == 'i')
+    p++;
+  if (*p == 'B')
+    p++;
+  *str = p;
+
+  return mul;
+}
+
+/* strtoull() with a size suffix, and without quietly negating
+ * negative numbers. */
+static munit_bool
+munit_parse_uint64(const char* str, munit_uint64_t* value) {
+  const unsigned int base = (str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) ? 16 : 10;
+  munit_uint64_t v = 0;
+  munit_uint64_t mul;
+  unsigned int digit;
+  const char* p = (base == 16) ? str + 2 : str;
+  const char* digits = p;
+
+  for ( ; ; p++) {
+    if (*p >= '0' && *p <= '9')
+      digit = (unsigned int) (*p - '0');
+    else if (base == 16 && *p >= 'a' && *p <= 'f')
+      digit = (unsigned int) (*p - 'a') + 10;
+    else if (base == 16 && *p >= 'A' && *p <= 'F')
+      digit = (unsigned int) (*p - 'A') + 10;
+    else
+      break;
+
+    if (v > (~((munit_uint64_t) 0) - digit) / base)
+      return 0;
+    v = (v * base) + digit;
+  }
+
+  if (p == digits)
+    return 0;
+  mul = munit_parse_suffix(&p);
+  if (mul == 0 || *p != '\0' || v > ~((munit_uint64_t) 0) / mul)
+    return 0;
+
+  *value = v * mul;
+  return 1;
+}
+
+static void
+munit_parameter_value_parse(MunitParameterValue* pv, const char* value) {
+  const char* p;
+  char* endptr;
+  munit_uint64_t mul;
+
+  pv->value = value;
+  pv->types = 0;
+  if (value == NULL)
+    return;
+
+  if (munit_parse_uint64(value, &(pv->u)))
+    pv->types |= MUNIT_PARAMETER_UINT64;
+
+  if (pv->types & MUNIT_PARAMETER_UINT64) {
+    if (pv->u <= MUNIT_INT64_MAX) {
+      pv->i = (munit_int64_t) pv->u;
+      pv->types |= MUNIT_PARAMETER_INT64;
+    }
+  } else if (value[0] == '-' && munit_parse_uint64(value + 1, &(pv->u))) {
+    if (pv->u <= MUNIT_INT64_MAX + 1) {
+      pv->i = (pv->u == MUNIT_INT64_MAX + 1) ? -((munit_int64_t) MUNIT_INT64_MAX) - 1 : -((munit_int64_t) pv->u);
+      pv->types |= MUNIT_PARAMETER_INT64;
+    }
+  }
+
+  pv->d = strtod(value, &endptr);
+  if (endptr != value) {
+    p = endptr;
+    mul = munit_parse_suffix(&p);
+    if (mul != 0 && *p == '\0') {
+      pv->d *= (double) mul;
+      pv->types |= MUNIT_PARAMETER_DOUBLE;
+    }
+  }
+
+  if (strcmp(value, "true") == 0 || strcmp(value, "yes") == 0 || strcmp(value, "on") == 0 || strcmp(value, "1") == 0) {
+    pv->b = 1;
+    pv->types |= MUNIT_PARAMETER_BOOL;
+  } else if (strcmp(value, "false") == 0 || strcmp(value, "no") == 0 || strcmp(value, "off") == 0 || strcmp(value, "0") == 0) {
+    pv->b = 0;
+    pv->types |= MUNIT_PARAMETER_BOOL;
+  }
+}
+
+/* Parse and index the parameters for the test about to run. */
+static void
+munit_parameters_index(const MunitParameter params[]) {
+  size_t params_l = 0;
+  size_t mask;
+  size_t i;
+  size_t h;
+
+  munit_parameters_cache.params = NULL;
+  if (params == NULL)
+    return;
+
+  while (params[params_l].name != NULL)
+    params_l++;
+
+  for (mask = 1 ; mask < params_l * 2 ; mask <<= 1) { }
+  mask--;
+
+  if (mask > munit_parameters_cache.index_mask || munit_parameters_cache.index == NULL) {
+    free(munit_parameters_cache.index);
+    free(munit_parameters_cache.values);
+    munit_parameters_cache.index = malloc(sizeof(size_t) * (mask + 1));
+    munit_parameters_cache.values = malloc(sizeof(MunitParameterValue) * (mask + 1));
+    munit_parameters_cache.index_mask = mask;
+    if (munit_parameters_cache.index == NULL || munit_parameters_cache.values == NULL) {
+      free(munit_parameters_cache.index);
+      free(munit_parameters_cache.values);
+      munit_parameters_cache.index = NULL;
+      munit_parameters_cache.values = NULL;
+      return;
+    }
+  }
+
+  mask = munit_parameters_cache.index_mask;
+  memset(munit_parameters_cache.index, 0, sizeof(size_t) * (mask + 1));
+  for (i = 0 ; i < params_l ; i++) {
+    munit_parameter_value_parse(&(munit_parameters_cache.values[i]), params[i].value);
+    for (h = munit_str_hash(params[i].name) & mask ;
+         munit_parameters_cache.index[h] != 0 ;
+         h = (h + 1) & mask) { }
+    munit_parameters_cache.index[h] = i + 1;
+  }
+
+  munit_parameters_cache.params = params;
+}
+
+static void
+munit_parameters_index_fini(void) {
+  free(munit_parameters_cache.index);
+  free(munit_parameters_cache.values);
+  munit_parameters_cache.params = NULL;
+  munit_parameters_cache.values = NULL;
+  munit_parameters_cache.index = NULL;
+  munit_parameters_cache.index_mask = 0;
+}
+
+/* An invalid parameter is an error in the test setup, not a failure
+ * of the code being tested, so report it as MUNIT_ERROR. */
+static void
+munit_parameter_error(const char* key, const char* value, const char* type) {
+  if (value == NULL)
+    munit_logf_internal(MUNIT_LOG_ERROR, stderr, "no value for parameter \"%s\"", key);
+  else
+    munit_logf_internal(MUNIT_LOG_ERROR, stderr, "invalid %s value ('%s') for parameter \"%s\"", type, value, key);
+
+#if defined(MUNIT_THREAD_LOCAL)
+  if (munit_error_jmp_buf_valid)
+    longjmp(munit_error_jmp_buf, MUNIT_ERROR_JMP_ERROR);
+#endif
+  abort();
+}
+
+/* Look up a parameter and check it's a valid value of the requested
+ * type. */
+static const MunitParameterValue*
+munit_parameters_get_typed(const MunitParameter params[], const char* key, int type, const char* type_name, MunitParameterValue* scratch) {
+  const MunitParameterValue* pv = NULL;
+  const MunitParameter* param;
+  size_t mask = munit_parameters_cache.index_mask;
+  size_t h;
+  size_t i;
+
+  if (params != NULL && params == munit_parameters_cache.params) {
+    for (h = munit_str_hash(key) & mask ;
+         (i = munit_parameters_cache.index[h]) != 0 ;
+         h = (h + 1) & mask) {
+      if (strcmp(params[i - 1].name, key) == 0) {
+        pv = &(munit_parameters_cache.values[i - 1]);
+        if (MUNIT_UNLIKELY(pv->value != params[i - 1].value))
+          munit_parameter_value_parse(&(munit_parameters_cache.values[i - 1]), params[i - 1].value);
+        break;
+      }
+    }
+  } else {
+    for (param = params ; param != NULL && param->name != NULL ; param++) {
+      if (strcmp(param->name, key) == 0) {
+        munit_parameter_value_parse(scratch, param->value);
+        pv = scratch;
+        break;
+      }
+    }
+  }
+
+  if (MUNIT_UNLIKELY(pv == NULL || (pv->types & type) == 0))
+    munit_parameter_error(key, (pv == NULL) ? NULL : pv->value, type_name);
+
+  return pv;
+}
+
+int
+munit_parameters_get_int(const MunitParameter params[], const char* key) {
+  MunitParameterValue scratch;
+  const MunitParameterValue* pv = munit_parameters_get_typed(params, key, MUNIT_PARAMETER_INT64, "int", &scratch);
+
+  if (MUNIT_UNLIKELY(pv->i < INT_MIN || pv->i > INT_MAX))
+    munit_parameter_error(key, pv->value, "int");
+
+  return (int) pv->i;
+}
+
+munit_uint64_t
+munit_parameters_get_uint64(const MunitParameter params[], const char* key) {
+  MunitParameterValue scratch;
+
+  return munit_parameters_get_typed(params, key, MUNIT_PARAMETER_UINT64, "uint64", &scratch)->u;
+}
+
+double
+munit_parameters_get_double(const MunitParameter params[], const char* key) {
+  MunitParameterValue scratch;
+
+  return munit_parameters_get_typed(params, key, MUNIT_PARAMETER_DOUBLE, "double", &scratch)->d;
+}
+
+munit_bool
+munit_parameters_get_bool(const MunitParameter params[], const char* key) {
+  MunitParameterValue scratch;
+
+  return munit_parameters_get_typed(params, key, MUNIT_PARAMETER_BOOL, "bool", &scratch)->b;
+}
+
+size_t
+munit_parameters_get_size(const MunitParameter params[], const char* key) {
+  MunitParameterValue scratch;
+  const MunitParameterValue* pv = munit_parameters_get_typed(params, key, MUNIT_PARAMETER_UINT64, "size", &scratch);
+
+  if (MUNIT_UNLIKELY(pv->u > (munit_uint64_t) ((size_t) -1)))
+    munit_parameter_error(key, pv->value, "size");
+
+  return (size_t) pv->u;
+}
+
+/*** Parameter generators ***/
+
+/* Enough for any 64-bit integer. */
+#define MUNIT_PARAMETER_VALUE_LEN 24
+
+/* How many values --list-params shows before abbreviating. */
+#if !defined(MUNIT_LIST_PARAMS_MAX)
+#  define MUNIT_LIST_PARAMS_MAX 16
+#endif
+
+/* A parameter's generator, with the bounds parsed. */
+typedef struct {
+  MunitParameterGeneratorType type;
+  munit_int64_t first;
+  munit_int64_t last;
+  munit_int64_t step;
+  /* How many values there are; 0 if the generator is invalid. */
+  size_t size;
+} MunitParameterSequence;
+
+/* If the parameter's values are generated, decode the generator and
+ * return true. */
+static munit_bool
+munit_parameter_generator(const MunitParameterEnum* pe, MunitParameterSequence* gen) {
+  MunitParameterValue first, last, step;
+  munit_uint64_t size;
+  munit_int64_t v;
+
+  if (pe->generator == NULL)
+    return 0;
+
+  gen->type = pe->generator->type;
+  gen->size = 0;
+
+  munit_parameter_value_parse(&first, pe->generator->first);
+  munit_parameter_value_parse(&last, pe->generator->last);
+  munit_parameter_value_parse(&step, pe->generator->step);
+  if (((first.types & last.types & step.types) & MUNIT_PARAMETER_INT64) == 0)
+    return 1;
+
+  gen->first = first.i;
+  gen->last = last.i;
+  gen->step = step.i;
+
+  if (gen->type == MUNIT_PARAMETER_GENERATOR_RANGE) {
+    if (gen->step > 0 && gen->last >= gen->first)
+      size = ((munit_uint64_t) gen->last - (munit_uint64_t) gen->first) / (munit_uint64_t) gen->step;
+    else if (gen->step < 0 && gen->last <= gen->first)
+      size = ((munit_uint64_t) gen->first - (munit_uint64_t) gen->last) / ((munit_uint64_t) 0 - (munit_uint64_t) gen->step);
+    else
+      return 1;
+  } else {
+    if (gen->first < 1 || gen->step < 2 || gen->last < gen->first)
+      return 1;
+    for (size = 0, v = gen->first ; v <= gen->last / gen->step ; size++)
+      v *= gen->step;
+  }
+
+  if (size < (munit_uint64_t) ((size_t) -1))
+    gen->size = (size_t) size + 1;
+
+  return 1;
+}
+
+/* How many values a parameter can have. */
+static size_t
+munit_parameter_enum_size(const MunitParameterEnum* pe) {
+  MunitParameterSequence gen;
+  size_t size = 0;
+
+  if (munit_parameter_generator(pe, &gen))
+    return gen.size;
+
+  while (pe->values != NULL && pe->values[size] != NULL)
+    size++;
+
+  return size;
+}
+
+/* The idx-th value of a parameter.  Generated values are written to
+ * buf, so they're only valid until it's reused. */
+static char*
+munit_parameter_enum_value(const MunitParameterEnum* pe, size_t idx, char buf[MUNIT_PARAMETER_VALUE_LEN]) {
+  MunitParameterSequence gen;
+  munit_int64_t v;
+
+  if (!munit_parameter_generator(pe, &gen))
+    return pe->values[idx];
+
+  if (gen.type == MUNIT_PARAMETER_GENERATOR_RANGE) {
+    v = (munit_int64_t) ((munit_uint64_t) gen.first + (munit_uint64_t) idx * (munit_uint64_t) gen.step);
+  } else {
+    for (v = gen.first ; idx > 0 ; idx--)
+      v *= gen.step;
+  }
+
+  sprintf(buf, "%" PRIi64, v);
+  return buf;
+}
+
+static void
+munit_splice(int from, int to) {
+  munit_uint8_t buf[1024];
+#if !defined(_WIN32)
+  ssize_t len;
+  ssize_t bytes_written;
+  ssize_t write_res;
+#else
+  int len;
+  int bytes_written;
+  int write_res;
+#endif
+
+#if defined(MUNIT_HAVE_MEMFD)
+  /* Let the kernel do the copying.  If sendfile() doesn't support
+   * the destination, fall back on read()/write() for whatever is
+   * left. */
+  do {
+    len = sendfile(to, from, NULL, 1 << 30);
+  } while (len > 0 || (len < 0 && errno == EINTR));
+  if (len == 0)
+    return;
+#endif
+
+  do {
+    len = read(from, buf, sizeof(buf));
+    if (len > 0) {
+      bytes_written = 0;
+      do {
+        write_res = write(to, buf + bytes_written, len - bytes_written);
+        if (write_res < 0)
+          break;
+        bytes_written += write_res;
+      } while (bytes_written < len);
+    }
+    else
+      break;
+  } while (1);
+}
+
+#if defined(MUNIT_HAVE_PERF_EVENTS)
+static int
+munit_perf_event_open(munit_uint32_t type, munit_uint64_t config, int group_fd) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  /* The rest of the group follows the leader. */
+  attr.disabled = (group_fd == -1);
+  /* Unprivileged users are usually only allowed to count user space. */
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  return (int) syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+/* Open as many of the counters as we can.  The leader is the
+ * task-clock software counter, which should be available anywhere
+ * perf_event_open is allowed at all; the hardware counters are often
+ * missing in virtual machines.  Returns false (with errno set) if
+ * nothing could be opened. */
+static munit_bool
+munit_perf_group_open(MunitPerfGroup* group) {
+  static const struct {
+    munit_uint32_t type;
+    munit_uint64_t config;
+  } events[MUNIT_PERF_COUNTERS] = {
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES }
+  };
+  unsigned int i;
+  int fd;
+
+  group->n = 0;
+  memset(group->overhead, 0, sizeof(group->overhead));
+  for (i = 0 ; i < MUNIT_PERF_COUNTERS ; i++) {
+    fd = munit_perf_event_open(events[i].type, events[i].config, (group->n == 0) ? -1 : group->fds[0]);
+    if (fd == -1) {
+      if (i == 0)
+        return 0;
+      continue;
+    }
+    group->fds[group->n] = fd;
+    group->counters[group->n] = i;
+    group->n++;
+  }
+
+  return 1;
+}
+
+static void
+munit_perf_group_close(MunitPerfGroup* group) {
+  unsigned int i;
+
+  for (i = 0 ; i < group->n ; i++)
+    close(group->fds[i]);
+  group->n = 0;
+}
+
+static void
+munit_perf_group_start(MunitPerfGroup* group) {
+  if (group->n == 0)
+    return;
+
+  ioctl(group->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(group->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+/* Stop the counters and add their values to the report (if there is
+ * one). */
+static void
+munit_perf_group_stop(MunitPerfGroup* group, MunitPerfReport* report) {
+  /* nr, time_enabled, time_running, then one value per counter. */
+  munit_uint64_t buf[3 + MUNIT_PERF_COUNTERS];
+  munit_uint64_t value;
+  double scale = 1.0;
+  unsigned int counter;
+  unsigned int i;
+
+  if (group->n == 0)
+    return;
+
+  ioctl(group->fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  if (report == NULL)
+    return;
+  if (read(group->fds[0], buf, sizeof(buf)) < (ssize_t) (sizeof(munit_uint64_t) * (3 + group->n)))
+    return;
+
+  /* If there are more counters in use than the PMU has, the kernel
+   * multiplexes them, so we only have counts for part of the time. */
+  if (buf[2] == 0)
+    return;
+  if (buf[2] < buf[1])
+    scale = ((double) buf[1]) / ((double) buf[2]);
+
+  for (i = 0 ; i < group->n && i < buf[0] ; i++) {
+    value = (munit_uint64_t) (((double) buf[3 + i]) * scale);
+    counter = group->counters[i];
+    report->available |= 1U << counter;
+    report->values[counter] += (value > group->overhead[counter]) ? value - group->overhead[counter] : 0;
+  }
+}
+
+/* Figure out how much starting and stopping the counters, and
+ * reading the clocks in between, costs. */
+static void
+munit_perf_group_calibrate(MunitPerfGroup* group) {
+  MunitPerfReport empty;
+  munit_uint64_t overhead[MUNIT_PERF_COUNTERS];
+  struct PsnipClockTimespec ts;
+  unsigned int round;
+  unsigned int i;
+
+  for (round = 0 ; round < 16 ; round++) {
+    memset(&empty, 0, sizeof(empty));
+    munit_perf_group_start(group);
+    psnip_clock_get_time(PSNIP_CLOCK_TYPE_CPU, &ts);
+    psnip_clock_get_time(PSNIP_CLOCK_TYPE_WALL, &ts);
+    psnip_clock_get_time(PSNIP_CLOCK_TYPE_WALL, &ts);
+    psnip_clock_get_time(PSNIP_CLOCK_TYPE_CPU, &ts);
+    munit_perf_group_stop(group, &empty);
+    for (i = 0 ; i < MUNIT_PERF_COUNTERS ; i++) {
+      if (round == 0 || empty.values[i] < overhead[i])
+        overhead[i] = empty.values[i];
+    }
+  }
+
+  memcpy(group->overhead, overhead, sizeof(overhead));
+}
+#endif
+
+/* Run a test n times in a row between a single setup and tear down,
+ * timing the whole batch at once so the cost of reading the clocks is
+ * spread across all of the iterations, and add the result to the
+ * report.  Anything the test allocates from the arena stays allocated
+ * until the batch is done. */
+static MunitResult
+munit_test_runner_exec_batch(MunitTestRunner* runner, const MunitTest* test, const MunitParameter params[], MunitReport* report, unsigned int n) {
+  MunitResult result = MUNIT_OK;
+  unsigned int i;
+#if defined(MUNIT_ENABLE_TIMING)
+  struct PsnipClockTimespec wall_clock_begin = { 0, }, wall_clock_end = { 0, };
+  struct PsnipClockTimespec cpu_clock_begin = { 0, }, cpu_clock_end = { 0, };
+#endif
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+  MunitAllocReport allocs_begin = { 0, 0, 0 };
+#endif
+  void* data;
+
+  munit_arena_reset(1);
+  data = (test->setup == NULL) ? runner->user_data : test->setup(params, runner->user_data);
+
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+  /* Only the test itself, not setup or tear_down. */
+  if (runner->count_allocs)
+    munit_alloc_counting_start(&allocs_begin);
+#endif
+#if !defined(MUNIT_NO_FORK)
+  if (munit_fail_alloc.at != 0)
+    munit_fail_alloc_start();
+#endif
+
+#if defined(MUNIT_ENABLE_TIMING)
+#if defined(MUNIT_HAVE_PERF_EVENTS)
+  /* Outside of the clock reads so the ioctl()s and read() don't show
+   * up in the times; calibration subtracts the clock reads from the
+   * counters instead. */
+  munit_perf_group_start(&(runner->perf));
+#endif
+  /* The CPU clock is a system call on most platforms, so keep it
+   * outside of the wall clock reads. */
+  psnip_clock_get_time(PSNIP_CLOCK_TYPE_CPU, &cpu_clock_begin);
+  psnip_clock_get_time(PSNIP_CLOCK_TYPE_WALL, &wall_clock_begin);
+#endif
+
+  for (i = 0 ; i < n ; i++) {
+    result = test->test(params, data);
+    if (result != MUNIT_OK)
+      break;
+  }
+
+#if defined(MUNIT_ENABLE_TIMING)
+  psnip_clock_get_time(PSNIP_CLOCK_TYPE_WALL, &wall_clock_end);
+  psnip_clock_get_time(PSNIP_CLOCK_TYPE_CPU, &cpu_clock_end);
+#if defined(MUNIT_HAVE_PERF_EVENTS)
+  munit_perf_group_stop(&(runner->perf), (result == MUNIT_OK) ? &(report->perf) : NULL);
+#endif
+#endif
+
+#if !defined(MUNIT_NO_FORK)
+  if (munit_fail_alloc.at != 0)
+    munit_fail_alloc_stop();
+#endif
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+  if (runner->count_allocs)
+    munit_alloc_counting_stop(&allocs_begin, (result == MUNIT_OK) ? &(report->allocs) : NULL);
+#endif
+
+  if (test->tear_down != NULL)
+    test->tear_down(data);
+
+  munit_arena_reset(0);
+
+  report->successful += i;
+  if (MUNIT_LIKELY(result == MUNIT_OK)) {
+#if defined(MUNIT_ENABLE_TIMING)
+    report->wall_clock += munit_clock_get_elapsed(&wall_clock_begin, &wall_clock_end);
+    report->cpu_clock += munit_clock_get_elapsed(&cpu_clock_begin, &cpu_clock_end);
+#endif
+  } else {
+    switch ((int) result) {
+      case MUNIT_SKIP:
+        report->skipped++;
+        break;
+      case MUNIT_FAIL:
+        report->failed++;
+        break;
+      case MUNIT_ERROR:
+        report->errored++;
+        break;
+      default:
+        break;
+    }
+  }
+
+  return result;
+}
+
+/* Run a single iteration of a test (including the setup and tear
+ * down), and add the result to the report. */
+static MunitResult
+munit_test_runner_exec_once(MunitTestRunner* runner, const MunitTest* test, const MunitParameter params[], MunitReport* report) {
+  return munit_test_runner_exec_batch(runner, test, params, report, 1);
+}
+
+#if defined(MUNIT_ENABLE_TIMING)
+static int
+munit_double_compare(const void* a, const void* b) {
+  const double x = *((const double*) a);
+  const double y = *((const double*) b);
+
+  return (x > y) - (x < y);
+}
+
+/* Square root by Newton's method, so we don't need libm just for
+ * this. */
+static double
+munit_sqrt(double x) {
+  double r = x;
+  double prev = 0;
+  int i;
+
+  if (!(x > 0))
+    return 0;
+
+  for (i = 0 ; i < 100 && r != prev ; i++) {
+    prev = r;
+    r = (r + x / r) / 2;
+  }
+
+  return r;
+}
+
+/* Value at quantile q (0 to 1) of a sorted array, using the
+ * nearest-rank method. */
+static double
+munit_quantile(const double sorted[], size_t n, double q) {
+  size_t rank = (size_t) (q * (double) n + 0.999999);
+
+  if (rank < 1)
+    rank = 1;
+  else if (rank > n)
+    rank = n;
+
+  return sorted[rank - 1];
+}
+
+static double
+munit_median(const double sorted[], size_t n) {
+  return (n % 2 == 1) ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+}
+
+/* Summarize the samples.  Note that this sorts (and then clobbers)
+ * the samples array. */
+static void
+munit_bench_stats_compute(MunitBenchStats* stats, double samples[], size_t n) {
+  double mean = 0;
+  double variance = 0;
+  size_t i;
+
+  stats->samples = (unsigned int) n;
+  if (n == 0)
+    return;
+
+  for (i = 0 ; i < n ; i++)
+    mean += samples[i];
+  mean /= (double) n;
+  for (i = 0 ; i < n ; i++)
+    variance += (samples[i] - mean) * (samples[i] - mean);
+  stats->stddev = (n > 1) ? munit_sqrt(variance / (double) (n - 1)) : 0;
+
+  qsort(samples, n, sizeof(double), munit_double_compare);
+  stats->min = samples[0];
+  stats->median = munit_median(samples, n);
+  stats->p90 = munit_quantile(samples, n, 0.90);
+  stats->p99 = munit_quantile(samples, n, 0.99);
+
+  for (i = 0 ; i < n ; i++)
+    samples[i] = (samples[i] > stats->median) ? samples[i] - stats->median : stats->median - samples[i];
+  qsort(samples, n, sizeof(double), munit_double_compare);
+  stats->mad = munit_median(samples, n);
+}
+
+/* Benchmark mode.  The test is first warmed up, doubling the number of
+ * iterations per sample until a sample takes long enough to be
+ * measured reliably, then the samples are taken.  Each sample is one
+ * batch timed as a whole, so only the time spent in the test function
+ * itself counts, not the setup or tear down (which run once per
+ * sample) or reading the clocks. */
+static MunitResult
+munit_test_runner_benchmark(MunitTestRunner* runner, const MunitTest* test, const MunitParameter params[], MunitReport* report, double samples_out[]) {
+  const munit_uint64_t min_time = (munit_uint64_t) (runner->bench_min_time * PSNIP_CLOCK_NSEC_PER_SEC);
+  const munit_uint64_t warmup_time = (munit_uint64_t) (runner->bench_warmup * PSNIP_CLOCK_NSEC_PER_SEC);
+  MunitResult result = MUNIT_OK;
+  unsigned int batch = 1;
+  unsigned int sample;
+  munit_uint64_t before;
+  double* samples;
+
+  samples = malloc(sizeof(double) * runner->bench_samples);
+  if (samples == NULL) {
+    munit_log_internal(MUNIT_LOG_ERROR, stderr, "failed to allocate memory");
+    report->errored++;
+    return MUNIT_ERROR;
+  }
+
+  while (1) {
+    before = report->wall_clock;
+    result = munit_test_runner_exec_batch(runner, test, params, report, batch);
+    if (result != MUNIT_OK)
+      goto cleanup;
+
+    if (report->wall_clock - before < min_time && batch <= UINT_MAX / 2)
+      batch *= 2;
+    else if (report->wall_clock >= warmup_time)
+      break;
+  }
+
+  /* Forget about the warmup. */
+  memset(report, 0, sizeof(*report));
+
+  for (sample = 0 ; sample < runner->bench_samples ; sample++) {
+    before = report->wall_clock;
+    result = munit_test_runner_exec_batch(runner, test, params, report, batch);
+    if (result != MUNIT_OK)
+      goto cleanup;
+    samples[sample] = ((double) (report->wall_clock - before)) / ((double) batch);
+  }
+
+  if (samples_out != NULL)
+    memcpy(samples_out, samples, sizeof(double) * sample);
+  munit_bench_stats_compute(&(report->bench), samples, sample);
+  report->bench.iterations = batch;
+
+ cleanup:
+  free(samples);
+
+  return result;
+}
+#endif
+
+/* This is the part that should be handled in the child process.  In
+ * benchmark mode, if samples isn't NULL the samples are copied there;
+ * it must have room for runner->bench_samples values. */
+static MunitResult
+munit_test_runner_exec(MunitTestRunner* runner, const MunitTest* test, const MunitParameter params[], MunitReport* report, double samples[]) {
+  unsigned int iterations = runner->iterations;
+  MunitResult result = MUNIT_FAIL;
+  unsigned int i = 0;
+#if defined(MUNIT_HAVE_RUSAGE)
+  struct rusage usage_before;
+  struct rusage usage_after;
+#endif
+
+  if ((test->options & MUNIT_TEST_OPTION_SINGLE_ITERATION) == MUNIT_TEST_OPTION_SINGLE_ITERATION)
+    iterations = 1;
+  else if (iterations == 0)
+    iterations = runner->suite->iterations;
+
+  munit_rand_seed(runner->seed);
+  munit_parameters_index(params);
+
+#if defined(MUNIT_HAVE_RUSAGE)
+  /* If this is a child process of its own the parent will replace
+   * this with the child's totals from wait4(). */
+  if (runner->show_usage && getrusage(RUSAGE_SELF, &usage_before) != 0)
+    memset(&usage_before, 0, sizeof(usage_before));
+#endif
+
+#if defined(MUNIT_HAVE_PERF_EVENTS)
+  /* The runner has already checked that we're allowed to do this, so
+   * if it fails now we just won't have any counters to report. */
+  if (runner->perf_counters && munit_perf_group_open(&(runner->perf)))
+    munit_perf_group_calibrate(&(runner->perf));
+#endif
+
+#if defined(MUNIT_ENABLE_TIMING)
+  /* Tests which can only be run once can't be benchmarked. */
+  if (runner->benchmark && (test->options & MUNIT_TEST_OPTION_SINGLE_ITERATION) == 0) {
+    result = munit_test_runner_benchmark(runner, test, params, report, samples);
+  } else
+#else
+  (void) samples;
+#endif
+  {
+    do {
+      result = munit_test_runner_exec_once(runner, test, params, report);
+    } while (result == MUNIT_OK && ++i < iterations);
+  }
+
+#if defined(MUNIT_HAVE_PERF_EVENTS)
+  munit_perf_group_close(&(runner->perf));
+#endif
+
+#if defined(MUNIT_HAVE_RUSAGE)
+  if (runner->show_usage && getrusage(RUSAGE_SELF, &usage_after) == 0)
+    munit_usage_set_delta(&(report->usage), &usage_before, &usage_after);
+#endif
+
+  return result;
+}
+
+#if defined(MUNIT_EMOTICON)
+#  define MUNIT_RESULT_STRING_OK    ":)"
+#  define MUNIT_RESULT_STRING_SKIP  ":|"
+#  define MUNIT_RESULT_STRING_FAIL  ":("
+#  define MUNIT_RESULT_STRING_ERROR ":o"
+#  define MUNIT_RESULT_STRING_TODO  ":/"
+#else
+#  define MUNIT_RESULT_STRING_OK    "OK   "
+#  define MUNIT_RESULT_STRING_SKIP  "SKIP "
+#  define MUNIT_RESULT_STRING_FAIL  "FAIL "
+#  define MUNIT_RESULT_STRING_ERROR "ERROR"
+#  define MUNIT_RESULT_STRING_TODO  "TODO "
+#endif
+
+static void
+munit_test_runner_print_color(const MunitTestRunner* runner, const char* string, char color) {
+  if (runner->colorize)
+    fprintf(MUNIT_OUTPUT_FILE, "\x1b[3%cm%s\x1b[39m", color, string);
+  else
+    fputs(string, MUNIT_OUTPUT_FILE);
+}
+
+#if !defined(MUNIT_NO_BUFFER)
+static int
+munit_replace_stderr(FILE* stderr_buf) {
+  if (stderr_buf != NULL) {
+    const int orig_stderr = dup(STDERR_FILENO);
+
+    int errfd = fileno(stderr_buf);
+    if (MUNIT_UNLIKELY(errfd == -1)) {
+      exit(EXIT_FAILURE);
+    }
+
+    dup2(errfd, STDERR_FILENO);
+
+    return orig_stderr;
+  }
+
+  return -1;
+}
+
+static void
+munit_restore_stderr(int orig_stderr) {
+  if (orig_stderr != -1) {
+    dup2(orig_stderr, STDERR_FILENO);
+    close(orig_stderr);
+  }
+}
+#endif /* !defined(MUNIT_NO_BUFFER) */
+
+#if !defined(MUNIT_NO_FORK)
+/* Copy an array of parameters (including the names and values) into
+ * a single allocation which can be released with free(). */
+static MunitParameter*
+munit_parameters_copy(const MunitParameter params[]) {
+  const MunitParameter* param;
+  MunitParameter* res;
+  size_t params_l = 0;
+  size_t strings_l = 0;
+  size_t name_l, value_l;
+  char* str;
+  size_t i;
+
+  if (params == NULL)
+    return NULL;
+
+  for (param = params ; param->name != NULL ; param++) {
+    params_l++;
+    strings_l += strlen(param->name) + 1;
+    if (param->value != NULL)
+      strings_l += strlen(param->value) + 1;
+  }
+
+  res = malloc(sizeof(MunitParameter) * (params_l + 1) + strings_l);
+  if (res == NULL)
+    return NULL;
+
+  str = (char*) (res + params_l + 1);
+  for (i = 0 ; i < params_l ; i++) {
+    name_l = strlen(params[i].name) + 1;
+    memcpy(str, params[i].name, name_l);
+    res[i].name = str;
+    str += name_l;
+
+    if (params[i].value != NULL) {
+      value_l = strlen(params[i].value) + 1;
+      memcpy(str, params[i].value, value_l);
+      res[i].value = str;
+      str += value_l;
+    } else {
+      res[i].value = NULL;
+    }
+  }
+  res[params_l].name = NULL;
+  res[params_l].value = NULL;
+
+  return res;
+}
+#endif
+
+static void
+munit_test_runner_print_params(const MunitParameter params[]) {
+  unsigned int output_l;
+  munit_bool first;
+  const MunitParameter* param;
+
+  output_l = 2;
+  fputs("  ", MUNIT_OUTPUT_FILE);
+  first = 1;
+  for (param = params ; param != NULL && param->name != NULL ; param++) {
+    if (!first) {
+      fputs(", ", MUNIT_OUTPUT_FILE);
+      output_l += 2;
+    } else {
+      first = 0;
+    }
+
+    output_l += fprintf(MUNIT_OUTPUT_FILE, "%s=%s", param->name, param->value);
+  }
+  while (output_l++ < MUNIT_TEST_NAME_LEN) {
+    fputc(' ', MUNIT_OUTPUT_FILE);
+  }
+}
+
+static FILE*
+munit_stderr_buf_new(void) {
+  FILE* stderr_buf = NULL;
+#if defined(MUNIT_HAVE_MEMFD)
+  const int fd = memfd_create("munit-stderr", 0);
+
+  if (fd != -1) {
+    stderr_buf = fdopen(fd, "w+");
+    if (stderr_buf != NULL)
+      return stderr_buf;
+    close(fd);
+  }
+#endif
+
+  /* memfd_create() may also fail on old kernels, so fall back on a
+   * temporary file. */
+#if !defined(_WIN32) || defined(__MINGW32__)
+  stderr_buf = tmpfile();
+#else
+  tmpfile_s(&stderr_buf);
+#endif
+  if (stderr_buf == NULL)
+    munit_log_errno(MUNIT_LOG_ERROR, stderr, "unable to create buffer for stderr");
+
+  return stderr_buf;
+}
+
+#if defined(MUNIT_ENABLE_TIMING)
+static void
+munit_test_runner_print_bench(const MunitBenchStats* stats) {
+  fprintf(MUNIT_OUTPUT_FILE, " ]\n  %-" MUNIT_XSTRINGIFY(MUNIT_TEST_NAME_LEN) "s Stats: [ %u x %u iterations, min ",
+          "", stats->samples, stats->iterations);
+  munit_print_time(MUNIT_OUTPUT_FILE, stats->min);
+  fputs(" / median ", MUNIT_OUTPUT_FILE);
+  munit_print_time(MUNIT_OUTPUT_FILE, stats->median);
+  fputs(" / p90 ", MUNIT_OUTPUT_FILE);
+  munit_print_time(MUNIT_OUTPUT_FILE, stats->p90);
+  fputs(" / p99 ", MUNIT_OUTPUT_FILE);
+  munit_print_time(MUNIT_OUTPUT_FILE, stats->p99);
+  fputs(" / stddev ", MUNIT_OUTPUT_FILE);
+  munit_print_time(MUNIT_OUTPUT_FILE, stats->stddev);
+  fputs(" / MAD ", MUNIT_OUTPUT_FILE);
+  munit_print_time(MUNIT_OUTPUT_FILE, stats->mad);
+}
+#endif
+
+#if defined(MUNIT_HAVE_PERF_EVENTS)
+static void
+munit_test_runner_print_perf(const MunitPerfReport* perf, unsigned int iterations) {
+  static const char* const names[MUNIT_PERF_COUNTERS] = {
+    NULL, "cycles", "instructions", "cache misses", "branch misses"
+  };
+  const unsigned int cycles_instructions = (1U << MUNIT_PERF_CYCLES) | (1U << MUNIT_PERF_INSTRUCTIONS);
+  const char* sep = "";
+  unsigned int i;
+
+  if (perf->available == 0)
+    return;
+
+  fprintf(MUNIT_OUTPUT_FILE, " ]\n  %-" MUNIT_XSTRINGIFY(MUNIT_TEST_NAME_LEN) "s  Perf: [ ", "");
+  if (perf->available & (1U << MUNIT_PERF_TASK_CLOCK)) {
+    munit_print_time(MUNIT_OUTPUT_FILE, ((double) perf->values[MUNIT_PERF_TASK_CLOCK]) / iterations);
+    fputs(" task-clock", MUNIT_OUTPUT_FILE);
+    sep = " / ";
+  }
+  for (i = MUNIT_PERF_CYCLES ; i < MUNIT_PERF_COUNTERS ; i++) {
+    if (perf->available & (1U << i)) {
+      fprintf(MUNIT_OUTPUT_FILE, "%s%.1f %s", sep, ((double) perf->values[i]) / iterations, names[i]);
+      sep = " / ";
+    }
+  }
+  if ((perf->available & cycles_instructions) == cycles_instructions && perf->values[MUNIT_PERF_CYCLES] != 0) {
+    fprintf(MUNIT_OUTPUT_FILE, "%s%.2f IPC", sep,
+            ((double) perf->values[MUNIT_PERF_INSTRUCTIONS]) / ((double) perf->values[MUNIT_PERF_CYCLES]));
+  }
+}
+#endif
+
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+static void
+munit_test_runner_print_allocs(const MunitTestRunner* runner, const MunitAllocReport* allocs, unsigned int iterations) {
+  if (!runner->count_allocs)
+    return;
+
+  fprintf(MUNIT_OUTPUT_FILE, " ]\n  %-" MUNIT_XSTRINGIFY(MUNIT_TEST_NAME_LEN) "sAllocs: [ ", "");
+  fprintf(MUNIT_OUTPUT_FILE, "%.1f allocations / %.1f bytes / %.1f frees",
+          ((double) allocs->allocations) / iterations,
+          ((double) allocs->bytes) / iterations,
+          ((double) allocs->frees) / iterations);
+}
+#endif
+
+#if defined(MUNIT_HAVE_RUSAGE)
+static void
+munit_test_runner_print_usage(const MunitTestRunner* runner, const MunitUsage* usage) {
+  if (!runner->show_usage || !usage->valid)
+    return;
+
+  fprintf(MUNIT_OUTPUT_FILE, " ]\n  %-" MUNIT_XSTRINGIFY(MUNIT_TEST_NAME_LEN) "s Usage: [ ", "");
+  fprintf(MUNIT_OUTPUT_FILE, "%.2f MiB max RSS / %" PRIu64 " minor, %" PRIu64 " major faults / %" PRIu64 " voluntary, %" PRIu64 " involuntary switches",
+          ((double) usage->max_rss) / (1024.0 * 1024.0),
+          usage->minor_faults, usage->major_faults,
+          usage->voluntary_switches, usage->involuntary_switches);
+}
+#endif
+
+#if defined(MUNIT_ENABLE_TIMING)
+/* What to write after a backslash for c when it appears in part of a
+ * baseline key, or 0 if it can be written as-is.  Escaping the
+ * separators means a name or value containing " x=" can't be mistaken
+ * for another parameter, and escaping tabs and newlines keeps every
+ * key on one line of the baseline file. */
+static char
+munit_baseline_escape_char(char c) {
+  switch (c) {
+    case '\\': return '\\';
+    case ' ': return ' ';
+    case '=': return '=';
+    case '\t': return 't';
+    case '\n': return 'n';
+    case '\r': return 'r';
+    default: return 0;
+  }
+}
+
+/* Escape s into dest (if it isn't NULL), returning the length. */
+static size_t
+munit_baseline_escape(char* dest, const char* s) {
+  size_t l = 0;
+  char e;
+
+  for ( ; *s != '\0' ; s++) {
+    e = munit_baseline_escape_char(*s);
+    if (dest != NULL) {
+      if (e != 0) {
+        dest[l] = '\\';
+        dest[l + 1] = e;
+      } else {
+        dest[l] = *s;
+      }
+    }
+    l += (e != 0) ? 2 : 1;
+  }
+
+  return l;
+}
+
+/* The name a test case's samples are stored under in a baseline file:
+ * the full name of the test followed by the parameters, each part
+ * escaped with munit_baseline_escape(). */
+static char*
+munit_baseline_key(const char* test_name, const MunitParameter params[]) {
+  const MunitParameter* param;
+  size_t key_l = munit_baseline_escape(NULL, test_name) + 1;
+  char* key;
+  char* p;
+
+  for (param = params ; param != NULL && param->name != NULL ; param++)
+    key_l += munit_baseline_escape(NULL, param->name) + munit_baseline_escape(NULL, param->value) + 2;
+
+  key = malloc(key_l);
+  if (key == NULL)
+    return NULL;
+
+  p = key + munit_baseline_escape(key, test_name);
+  for (param = params ; param != NULL && param->name != NULL ; param++) {
+    *(p++) = ' ';
+    p += munit_baseline_escape(p, param->name);
+    *(p++) = '=';
+    p += munit_baseline_escape(p, param->value);
+  }
+  *p = '\0';
+
+  return key;
+}
+
+/* Check that every escape in a key read from a baseline file is one
+ * munit_baseline_escape() could have written, so keys can be compared
+ * in their escaped form. */
+static munit_bool
+munit_baseline_key_valid(const char* key) {
+  for ( ; *key != '\0' ; key++) {
+    if (*key != '\\')
+      continue;
+
+    key++;
+    if (*key != '\\' && *key != ' ' && *key != '=' && *key != 't' && *key != 'n' && *key != 'r')
+      return 0;
+  }
+
+  return 1;
+}
+
+static int
+munit_baseline_entry_compare(const void* a, const void* b) {
+  return strcmp(((const MunitBaselineEntry*) a)->key, ((const MunitBaselineEntry*) b)->key);
+}
+
+/* Load a baseline file written by --save-baseline.  Each line is the
+ * key, a tab, then the samples (in nanoseconds per iteration)
+ * separated by spaces. */
+static munit_bool
+munit_baseline_load(MunitBaselineEntry** baseline, size_t* baseline_l, const char* filename) {
+  FILE* fp;
+  char* line = NULL;
+  size_t line_size = 0;
+  size_t line_l;
+  int c;
+  char* tab;
+  char* p;
+  char* endptr;
+  MunitBaselineEntry* entry;
+  MunitBaselineEntry* entries;
+  double value;
+  double* samples;
+  munit_bool ok = 0;
+
+  fp = fopen(filename, "r");
+  if (fp == NULL) {
+    munit_logf_internal(MUNIT_LOG_ERROR, stderr, "unable to open baseline file '%s': %s", filename, strerror(errno));
+    return 0;
+  }
+
+  while (1) {
+    line_l = 0;
+    while ((c = fgetc(fp)) != EOF && c != '\n') {
+      if (line_l + 1 >= line_size) {
+        line_size = (line_size == 0) ? 256 : line_size * 2;
+        p = realloc(line, line_size);
+        if (p == NULL)
+          goto oom;
+        line = p;
+      }
+      line[line_l++] = (char) c;
+    }
+    if (line_l == 0) {
+      if (c == EOF)
+        break;
+      continue;
+    }
+    line[line_l] = '\0';
+
+    tab = strchr(line, '\t');
+    if (tab != NULL)
+      *tab = '\0';
+    if (tab == NULL || !munit_baseline_key_valid(line)) {
+      munit_logf_internal(MUNIT_LOG_ERROR, stderr, "invalid line in baseline file '%s'", filename);
+      goto cleanup;
+    }
+
+    entries = realloc(*baseline, sizeof(MunitBaselineEntry) * (*baseline_l + 1));
+    if (entries == NULL)
+      goto oom;
+    *baseline = entries;
+    entry = &(entries[*baseline_l]);
+    entry->key = strdup(line);
+    entry->samples = NULL;
+    entry->samples_l = 0;
+    (*baseline_l)++;
+    if (entry->key == NULL)
+      goto oom;
+
+    p = tab + 1;
+    while (1) {
+      value = strtod(p, &endptr);
+      if (endptr == p)
+        break;
+      p = endptr;
+
+      samples = realloc(entry->samples, sizeof(double) * (entry->samples_l + 1));
+      if (samples == NULL)
+        goto oom;
+      entry->samples = samples;
+      entry->samples[entry->samples_l++] = value;
+    }
+
+    if (entry->samples_l != 0)
+      qsort(entry->samples, entry->samples_l, sizeof(double), munit_double_compare);
+
+    if (c == EOF)
+      break;
+  }
+
+  if (*baseline_l != 0)
+    qsort(*baseline, *baseline_l, sizeof(MunitBaselineEntry), munit_baseline_entry_compare);
+  else
+    munit_logf_internal(MUNIT_LOG_WARNING, stderr, "baseline file '%s' is empty", filename);
+
+  ok = 1;
+  goto cleanup;
+
+ oom:
+  munit_log_internal(MUNIT_LOG_ERROR, stderr, "failed to allocate memory");
+
+ cleanup:
+  free(line);
+  fclose(fp);
+
+  return ok;
+}
+
+static void
+munit_baseline_free(MunitBaselineEntry** baseline, size_t* baseline_l) {
+  size_t i;
+
+  for (i = 0 ; i < *baseline_l ; i++) {
+    free((*baseline)[i].key);
+    free((*baseline)[i].samples);
+  }
+  free(*baseline);
+  *baseline = NULL;
+  *baseline_l = 0;
+}
+
+static const MunitBaselineEntry*
+munit_baseline_find(const MunitBaselineEntry* baseline, size_t baseline_l, const char* key) {
+  MunitBaselineEntry needle;
+
+  if (baseline_l == 0)
+    return NULL;
+
+  needle.key = (char*) key;
+  return bsearch(&needle, baseline, baseline_l, sizeof(MunitBaselineEntry), munit_baseline_entry_compare);
+}
+
+typedef struct {
+  double value;
+  munit_bool current;
+} MunitRankedSample;
+
+static int
+munit_ranked_sample_compare(const void* a, const void* b) {
+  return munit_double_compare(&(((const MunitRankedSample*) a)->value), &(((const MunitRankedSample*) b)->value));
+}
+
+/* Mann-Whitney U test, using the normal approximation (with
+ * corrections for ties and continuity).  Returns the z score, which
+ * is positive if the current samples tend to be larger (slower) than
+ * the baseline. */
+static double
+munit_mann_whitney_z(const double current[], size_t current_l, const double baseline[], size_t baseline_l) {
+  const size_t n = current_l + baseline_l;
+  MunitRankedSample* ranked;
+  double rank_sum = 0;
+  double ties = 0;
+  double u, mean, sigma, diff;
+  size_t i, j, k;
+
+  ranked = malloc(sizeof(MunitRankedSample) * n);
+  if (ranked == NULL)
+    return 0;
+
+  for (i = 0 ; i < current_l ; i++) {
+    ranked[i].value = current[i];
+    ranked[i].current = 1;
+  }
+  for (i = 0 ; i < baseline_l ; i++) {
+    ranked[current_l + i].value = baseline[i];
+    ranked[current_l + i].current = 0;
+  }
+  qsort(ranked, n, sizeof(MunitRankedSample), munit_ranked_sample_compare);
+
+  /* Tied values all get the average of their ranks. */
+  for (i = 0 ; i < n ; i = j) {
+    for (j = i + 1 ; j < n && ranked[j].value == ranked[i].value ; j++) { }
+    for (k = i ; k < j ; k++) {
+      if (ranked[k].current)
+        rank_sum += ((double) (i + j + 1)) / 2;
+    }
+    ties += (double) ((j - i) * (j - i) * (j - i) - (j - i));
+  }
+  free(ranked);
+
+  u = rank_sum - ((double) current_l * (double) (current_l + 1)) / 2;
+  mean = ((double) current_l * (double) baseline_l) / 2;
+  sigma = munit_sqrt(((double) current_l * (double) baseline_l / 12) *
+                     (((double) n + 1) - ties / ((double) n * (double) (n - 1))));
+  if (sigma == 0)
+    return 0;
+
+  diff = u - mean;
+  if (diff > 0.5)
+    diff -= 0.5;
+  else if (diff < -0.5)
+    diff += 0.5;
+  else
+    diff = 0;
+
+  return diff / sigma;
+}
+
+/* Add a benchmarked test case to the new baseline, and compare it
+ * against the old one, counting it if it got slower. */
+static void
+munit_test_runner_compare_baseline(MunitTestRunner* runner, MunitReporterCase* tc, const char* key, const double samples[]) {
+  const MunitBaselineEntry* entry;
+  const unsigned int samples_l = tc->report->bench.samples;
+  double baseline_median;
+  unsigned int i;
+
+  if (key == NULL || samples == NULL || samples_l == 0)
+    return;
+
+  if (runner->baseline_out != NULL) {
+    fprintf(runner->baseline_out, "%s\t", key);
+    for (i = 0 ; i < samples_l ; i++)
+      fprintf(runner->baseline_out, (i == 0) ? "%.3f" : " %.3f", samples[i]);
+    fputc('\n', runner->baseline_out);
+  }
+
+  if (runner->baseline == NULL)
+    return;
+
+  entry = munit_baseline_find(runner->baseline, runner->baseline_l, key);
+  if (entry == NULL || entry->samples_l < 2 || samples_l < 2) {
+    tc->baseline = MUNIT_BASELINE_MISSING;
+    return;
+  }
+
+  baseline_median = munit_median(entry->samples, entry->samples_l);
+  tc->baseline_change = (baseline_median > 0) ? ((tc->report->bench.median - baseline_median) / baseline_median) * 100.0 : 0;
+  tc->baseline_z = munit_mann_whitney_z(samples, samples_l, entry->samples, entry->samples_l);
+
+  if (tc->baseline_z > MUNIT_BASELINE_Z_CRITICAL && tc->baseline_change > runner->regression_threshold) {
+    tc->baseline = MUNIT_BASELINE_SLOWER;
+    runner->regressions++;
+  } else if (tc->baseline_z < -MUNIT_BASELINE_Z_CRITICAL && tc->baseline_change < -runner->regression_threshold) {
+    tc->baseline = MUNIT_BASELINE_FASTER;
+  } else {
+    tc->baseline = MUNIT_BASELINE_UNCHANGED;
+  }
+}
+
+/*** Scaling analysis ***/
+
+#define MUNIT_SCALING_MODELS 5
+
+static const char* const munit_scaling_names[MUNIT_SCALING_MODELS] = {
+  "O(1)", "O(log n)", "O(n)", "O(n log n)", "O(n^2)"
+};
+
+/* log2(x) for x > 0, one bit of the fraction at a time, so we don't
+ * need libm. */
+static double
+munit_log2(double x) {
+  double r = 0;
+  double bit = 1;
+  int i;
+
+  while (x >= 2) {
+    x /= 2;
+    r += 1;
+  }
+  while (x < 1) {
+    x *= 2;
+    r -= 1;
+  }
+
+  for (i = 0 ; i < 32 ; i++) {
+    x *= x;
+    bit /= 2;
+    if (x >= 2) {
+      x /= 2;
+      r += bit;
+    }
+  }
+
+  return r;
+}
+
+static double
+munit_scaling_f(int model, double n) {
+  switch (model) {
+    case 0: return 1;
+    case 1: return munit_log2(n);
+    case 2: return n;
+    case 3: return n * munit_log2(n);
+    default: return n * n;
+  }
+}
+
+/* Remember a successful test case if it has a numeric value for the
+ * --scaling parameter. */
+static void
+munit_test_runner_scaling_add(MunitTestRunner* runner, const MunitParameter params[], const MunitReport* report) {
+  MunitScalingPoint* point;
+  MunitParameterValue n;
+  const MunitParameter* param;
+  size_t group_l = 1;
+  char* p;
+
+  if (runner->scaling == NULL || params == NULL || report->successful == 0 ||
+      report->failed != 0 || report->errored != 0 || report->skipped != 0)
+    return;
+
+  munit_parameter_value_parse(&n, munit_parameters_get(params, runner->scaling));
+  if ((n.types & MUNIT_PARAMETER_DOUBLE) == 0 || !(n.d > 0))
+    return;
+
+  if (runner->scaling_points_l == runner->scaling_points_size) {
+    point = realloc(runner->scaling_points, sizeof(MunitScalingPoint) * (runner->scaling_points_size + 32));
+    if (point == NULL)
+      return;
+    runner->scaling_points = point;
+    runner->scaling_points_size += 32;
+  }
+
+  for (param = params ; param->name != NULL ; param++) {
+    if (strcmp(param->name, runner->scaling) != 0)
+      group_l += strlen(param->name) + strlen(param->value) + 3;
+  }
+
+  point = &(runner->scaling_points[runner->scaling_points_l]);
+  point->group = p = malloc(group_l);
+  if (p == NULL)
+    return;
+  *p = '\0';
+  for (param = params ; param->name != NULL ; param++) {
+    if (strcmp(param->name, runner->scaling) != 0)
+      p += sprintf(p, (p == point->group) ? "%s=%s" : ", %s=%s", param->name, param->value);
+  }
+
+  point->n = n.d;
+  point->ns = (report->bench.samples > 0) ?
+    report->bench.median :
+    ((double) report->wall_clock) / ((double) report->successful);
+  runner->scaling_points_l++;
+}
+
+static int
+munit_scaling_point_compare(const void* a, const void* b) {
+  const MunitScalingPoint* x = (const MunitScalingPoint*) a;
+  const MunitScalingPoint* y = (const MunitScalingPoint*) b;
+  const int r = strcmp(x->group, y->group);
+
+  return (r != 0) ? r : (x->n > y->n) - (x->n < y->n);
+}
+
+static void
+munit_test_runner_scaling_reset(MunitTestRunner* runner) {
+  size_t i;
+
+  for (i = 0 ; i < runner->scaling_points_l ; i++)
+    free(runner->scaling_points[i].group);
+  runner->scaling_points_l = 0;
+}
+#endif
+
+#if defined(MUNIT_HAVE_TIMING_DB)
+/*** Timing database ***/
+
+#define MUNIT_TIMING_DB_MAGIC "MUNITTDB"
+#define MUNIT_TIMING_DB_VERSION 1
+#define MUNIT_TIMING_DB_MIN_CAPACITY 256
+
+#define MUNIT_TIMING_DB_SIZE(capacity) \
+  (sizeof(MunitTimingDbHeader) + sizeof(MunitTimingDbEntry) * (size_t) (capacity))
+#define MUNIT_TIMING_DB_ENTRIES(header) ((MunitTimingDbEntry*) ((header) + 1))
+
+static munit_uint64_t
+munit_fnv1a(munit_uint64_t h, unsigned char c) {
+  return (h ^ c) * 0x100000001B3ULL;
+}
+
+/* Hash s the way munit_baseline_escape() would write it. */
+static munit_uint64_t
+munit_fnv1a_escaped(munit_uint64_t h, const char* s) {
+  char e;
+
+  for ( ; *s != '\0' ; s++) {
+    e = munit_baseline_escape_char(*s);
+    if (e != 0) {
+      h = munit_fnv1a(h, '\\');
+      h = munit_fnv1a(h, (unsigned char) e);
+    } else {
+      h = munit_fnv1a(h, (unsigned char) *s);
+    }
+  }
+  return h;
+}
+
+/* 64-bit FNV-1a of the same string munit_baseline_key() would
+ * produce, without building it. */
+static munit_uint64_t
+munit_timing_db_hash(const char* test_name, const MunitParameter params[]) {
+  const MunitParameter* param;
+  munit_uint64_t h = munit_fnv1a_escaped(0xCBF29CE484222325ULL, test_name);
+
+  for (param = params ; param != NULL && param->name != NULL ; param++) {
+    h = munit_fnv1a(h, ' ');
+    h = munit_fnv1a_escaped(h, param->name);
+    h = munit_fnv1a(h, '=');
+    h = munit_fnv1a_escaped(h, param->value);
+  }
+
+  return (h == 0) ? 1 : h;
+}
+
+/* The entry for hash, or the empty one where it would go.  Returns
+ * NULL if the table is full, which it should never be (we grow it
+ * when it's half full), but the file could have been damaged while we
+ * had it open. */
+static MunitTimingDbEntry*
+munit_timing_db_find(MunitTimingDbHeader* header, munit_uint64_t hash) {
+  MunitTimingDbEntry* entries = MUNIT_TIMING_DB_ENTRIES(header);
+  const munit_uint32_t mask = header->capacity - 1;
+  munit_uint32_t i = (munit_uint32_t) (hash >> 32) & mask;
+  munit_uint32_t probes;
+
+  for (probes = 0 ; probes < header->capacity ; probes++) {
+    if (entries[i].hash == 0 || entries[i].hash == hash)
+      return &(entries[i]);
+    i = (i + 1) & mask;
+  }
+
+  return NULL;
+}
+
+static munit_bool
+munit_timing_db_map(MunitTimingDb* db, size_t size) {
+  void* map = mmap(NULL, size, db->writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, db->fd, 0);
+
+  if (map == MAP_FAILED) {
+    munit_log_errno(MUNIT_LOG_ERROR, stderr, "unable to map timing database");
+    db->header = NULL;
+    return 0;
+  }
+
+  db->header = map;
+  db->size = size;
+  return 1;
+}
+
+/* Double the size of the table.  The bigger table is built in a new
+ * file which then replaces the old one, so if we're killed part way
+ * through the old one is still intact.  We lock the new file before
+ * it appears under the database's name, so nobody else can start
+ * writing to it. */
+static munit_bool
+munit_timing_db_grow(MunitTimingDb* db) {
+  const munit_uint32_t capacity = db->header->capacity;
+  const size_t size = MUNIT_TIMING_DB_SIZE((size_t) capacity * 2);
+  const MunitTimingDbEntry* old = MUNIT_TIMING_DB_ENTRIES(db->header);
+  MunitTimingDbHeader* header;
+  MunitTimingDbEntry* entry;
+  struct flock lock;
+  struct stat st;
+  char* tmp_name;
+  void* map;
+  int fd;
+  munit_uint32_t i;
+
+  if (capacity > UINT32_MAX / 2)
+    return 0;
+
+  tmp_name = malloc(strlen(db->filename) + sizeof(".tmp"));
+  if (tmp_name == NULL)
+    return 0;
+  sprintf(tmp_name, "%s.tmp", db->filename);
+
+  fd = open(tmp_name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    goto error;
+
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  if (fcntl(fd, F_SETLK, &lock) != 0 || ftruncate(fd, (off_t) size) != 0)
+    goto error;
+  if (fstat(db->fd, &st) == 0)
+    fchmod(fd, st.st_mode & 07777);
+
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    goto error;
+
+  header = (MunitTimingDbHeader*) map;
+  memcpy(header, db->header, sizeof(MunitTimingDbHeader));
+  header->capacity = capacity * 2;
+  for (i = 0 ; i < capacity ; i++) {
+    if (old[i].hash != 0) {
+      entry = munit_timing_db_find(header, old[i].hash);
+      *entry = old[i];
+    }
+  }
+
+  if (rename(tmp_name, db->filename) != 0) {
+    munmap(map, size);
+    goto error;
+  }
+
+  munmap((void*) db->header, db->size);
+  close(db->fd);
+  db->fd = fd;
+  db->header = header;
+  db->size = size;
+  free(tmp_name);
+  return 1;
+
+ error:
+  munit_log_errno(MUNIT_LOG_ERROR, stderr, "unable to grow timing database");
+  if (fd >= 0) {
+    close(fd);
+    unlink(tmp_name);
+  }
+  free(tmp_name);
+  db->writable = 0;
+  return 0;
+}
+
+/* Start an empty database, replacing whatever was in the file. */
+static munit_bool
+munit_timing_db_create(MunitTimingDb* db) {
+  if (!db->writable)
+    return 1;
+
+  if (ftruncate(db->fd, 0) != 0 ||
+      ftruncate(db->fd, (off_t) MUNIT_TIMING_DB_SIZE(MUNIT_TIMING_DB_MIN_CAPACITY)) != 0) {
+    munit_logf_internal(MUNIT_LOG_ERROR, stderr, "unable to write timing database '%s': %s", db->filename, strerror(errno));
+    return 0;
+  }
+  if (!munit_timing_db_map(db, MUNIT_TIMING_DB_SIZE(MUNIT_TIMING_DB_MIN_CAPACITY)))
+    return 0;
+
+  memcpy(db->header->magic, MUNIT_TIMING_DB_MAGIC, sizeof(db->header->magic));
+  db->header->version = MUNIT_TIMING_DB_VERSION;
+  db->header->capacity = MUNIT_TIMING_DB_MIN_CAPACITY;
+  return 1;
+}
+
+/* Open (or create) the timing database.  If another process is
+ * already using it we still read it, but leave updating it to them.
+ * A database which is damaged, or from another version of munit, is
+ * started again from scratch; a file which isn't a database at all is
+ * an error, so we don't overwrite it. */
+static munit_bool
+munit_timing_db_open(MunitTimingDb* db, const char* filename) {
+  struct flock lock;
+  struct stat st;
+  const MunitTimingDbHeader* header;
+  const MunitTimingDbEntry* entries;
+  munit_uint64_t total = 0;
+  munit_uint32_t used = 0;
+  munit_bool damaged;
+  munit_uint32_t i;
+
+  db->filename = filename;
+  db->fd = open(filename, O_RDWR | O_CREAT, 0666);
+  if (db->fd < 0) {
+    munit_logf_internal(MUNIT_LOG_ERROR, stderr, "unable to open timing database '%s': %s", filename, strerror(errno));
+    return 0;
+  }
+
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  db->writable = fcntl(db->fd, F_SETLK, &lock) == 0;
+  if (!db->writable)
+    munit_logf_internal(MUNIT_LOG_WARNING, stderr, "timing database '%s' is in use, it will not be updated", filename);
+
+  if (fstat(db->fd, &st) != 0) {
+    munit_logf_internal(MUNIT_LOG_ERROR, stderr, "unable to open timing database '%s': %s", filename, strerror(errno));
+    return 0;
+  }
+
+  if (st.st_size == 0)
+    return munit_timing_db_create(db);
+
+  if ((size_t) st.st_size < sizeof(MunitTimingDbHeader) || !munit_timing_db_map(db, (size_t) st.st_size) ||
+      memcmp(db->header->magic, MUNIT_TIMING_DB_MAGIC, sizeof(db->header->magic)) != 0) {
+    munit_logf_internal(MUNIT_LOG_ERROR, stderr, "'%s' is not a munit timing database", filename);
+    return 0;
+  }
+
+  header = db->header;
+  damaged = header->version != MUNIT_TIMING_DB_VERSION ||
+    header->capacity == 0 || (header->capacity & (header->capacity - 1)) != 0 ||
+    (size_t) st.st_size != MUNIT_TIMING_DB_SIZE(header->capacity);
+
+  /* The table is never more than half full, and lookups rely on that
+   * to find an empty entry, so check the entries really match the
+   * count. */
+  if (!damaged) {
+    entries = MUNIT_TIMING_DB_ENTRIES(header);
+    for (i = 0 ; i < header->capacity ; i++) {
+      if (entries[i].hash != 0) {
+        total += entries[i].wall_clock;
+        used++;
+      }
+    }
+    damaged = used != header->count || used > header->capacity / 2;
+  }
+
+  if (damaged) {
+    munit_logf_internal(MUNIT_LOG_WARNING, stderr, "timing database '%s' is damaged or from another version of munit, %s",
+                        filename, db->writable ? "starting a new one" : "ignoring it");
+    munmap((void*) db->header, db->size);
+    db->header = NULL;
+    return munit_timing_db_create(db);
+  }
+
+  if (header->count != 0)
+    db->fallback = total / header->count;
+
+  return 1;
+}
+
+static void
+munit_timing_db_close(MunitTimingDb* db) {
+  if (db->header != NULL)
+    munmap((void*) db->header, db->size);
+  if (db->fd >= 0)
+    close(db->fd);
+  db->header = NULL;
+  db->fd = -1;
+}
+
+/* How long a test case is expected to take, in nanoseconds, or 0 if
+ * we have no idea. */
+static munit_uint64_t
+munit_timing_db_expected(const MunitTimingDb* db, munit_uint64_t hash) {
+  const MunitTimingDbEntry* entry;
+
+  if (db->header == NULL)
+    return 0;
+
+  entry = munit_timing_db_find(db->header, hash);
+  return (entry != NULL && entry->hash != 0) ? entry->wall_clock : db->fallback;
+}
+
+/* Fold the time a test case took into its entry.  The average is
+ * weighted towards recent runs (each one counts for a quarter) so a
+ * test which gets faster or slower is noticed after a few runs. */
+static void
+munit_timing_db_record(MunitTimingDb* db, munit_uint64_t hash, const MunitReport* report) {
+  MunitTimingDbEntry* entry;
+
+  if (db->header == NULL || !db->writable || report->skipped != 0 || report->wall_clock == 0)
+    return;
+
+  entry = munit_timing_db_find(db->header, hash);
+  if (entry == NULL)
+    return;
+  if (entry->hash == 0) {
+    if ((db->header->count + 1) * 2 > db->header->capacity) {
+      if (!munit_timing_db_grow(db))
+        return;
+      entry = munit_timing_db_find(db->header, hash);
+    }
+    entry->hash = hash;
+    entry->wall_clock = report->wall_clock;
+    entry->runs = 1;
+    db->header->count++;
+  } else {
+    entry->wall_clock = (entry->wall_clock / 4) * 3 + report->wall_clock / 4;
+    if (entry->runs != UINT32_MAX)
+      entry->runs++;
+  }
+}
+#endif
+
+/*** Reporters ***/
+
+/* The text reporter writes straight to MUNIT_OUTPUT_FILE, so it has
+ * no fp of its own. */
+
+#if defined(MUNIT_ENABLE_TIMING)
+static void
+munit_text_print_baseline(const MunitTestRunner* runner, const MunitReporterCase* tc) {
+  if (tc->baseline == MUNIT_BASELINE_NONE)
+    return;
+
+  fprintf(MUNIT_OUTPUT_FILE, " ]\n  %-" MUNIT_XSTRINGIFY(MUNIT_TEST_NAME_LEN) "s  Base: [ ", "");
+  switch (tc->baseline) {
+    case MUNIT_BASELINE_MISSING:
+      fputs("no baseline", MUNIT_OUTPUT_FILE);
+      return;
+    case MUNIT_BASELINE_SLOWER:
+      munit_test_runner_print_color(runner, "slower", '1');
+      break;
+    case MUNIT_BASELINE_FASTER:
+      munit_test_runner_print_color(runner, "faster", '2');
+      break;
+    case MUNIT_BASELINE_UNCHANGED:
+    case MUNIT_BASELINE_NONE:
+    default:
+      fputs("unchanged", MUNIT_OUTPUT_FILE);
+      break;
+  }
+  fprintf(MUNIT_OUTPUT_FILE, ", median %+.1f%%, z = %.2f", tc->baseline_change, tc->baseline_z);
+}
+#endif
+
+static void
+munit_text_suite_start(MunitReporter* reporter, MunitTestRunner* runner) {
+  (void) reporter;
+
+  fprintf(MUNIT_OUTPUT_FILE, "Running test suite with seed 0x%08" PRIx32 "...\n", runner->seed);
+}
+
+static void
+munit_text_plan(MunitReporter* reporter, MunitTestRunner* runner, const MunitReporterPlan* plan) {
+  (void) reporter;
+  (void) runner;
+
+  if (plan->shard_count != 0) {
+    fprintf(MUNIT_OUTPUT_FILE, "Running shard %u/%u (%lu of %lu test cases)...\n",
+            plan->shard_index + 1, plan->shard_count, (unsigned long) plan->cases, (unsigned long) plan->total_cases);
+  }
+#if defined(MUNIT_ENABLE_TIMING)
+  if (plan->eta > 0) {
+    fputs("Estimated time: ", MUNIT_OUTPUT_FILE);
+    munit_print_duration(MUNIT_OUTPUT_FILE, plan->eta);
+    fputc('\n', MUNIT_OUTPUT_FILE);
+  }
+#endif
+}
+
+static void
+munit_text_test_start(MunitReporter* reporter, MunitTestRunner* runner, const char* test_name, munit_bool parameterized) {
+  (void) reporter;
+  (void) runner;
+
+  fprintf(MUNIT_OUTPUT_FILE, "%-" MUNIT_XSTRINGIFY(MUNIT_TEST_NAME_LEN) "s", test_name);
+  if (parameterized)
+    fputc('\n', MUNIT_OUTPUT_FILE);
+}
+
+static void
+munit_text_case_start(MunitReporter* reporter, MunitTestRunner* runner, const char* test_name, const MunitParameter params[]) {
+  (void) reporter;
+  (void) runner;
+  (void) test_name;
+
+  if (params != NULL)
+    munit_test_runner_print_params(params);
+}
+
+/* Print the result of a test case, and replay anything the test wrote
+ * to stderr if appropriate. */
+static void
+munit_text_case_result(MunitReporter* reporter, MunitTestRunner* runner, const MunitReporterCase* tc) {
+  const MunitReport* report = tc->report;
+
+  (void) reporter;
+
+  fputs("[ ", MUNIT_OUTPUT_FILE);
+  if (tc->todo && tc->result == MUNIT_OK) {
+    munit_test_runner_print_color(runner, MUNIT_RESULT_STRING_TODO, '3');
+  } else if (tc->result == MUNIT_FAIL) {
+    munit_test_runner_print_color(runner, MUNIT_RESULT_STRING_FAIL, '1');
+  } else if (tc->result == MUNIT_ERROR) {
+    munit_test_runner_print_color(runner, MUNIT_RESULT_STRING_ERROR, '1');
+  } else if (tc->result == MUNIT_SKIP) {
+    munit_test_runner_print_color(runner, MUNIT_RESULT_STRING_SKIP, '3');
+  } else if (report->successful > 1) {
+    munit_test_runner_print_color(runner, MUNIT_RESULT_STRING_OK, '2');
+#if defined(MUNIT_ENABLE_TIMING)
+    fputs(" ] [ ", MUNIT_OUTPUT_FILE);
+    munit_print_time(MUNIT_OUTPUT_FILE, report->wall_clock / report->successful);
+    fputs(" / ", MUNIT_OUTPUT_FILE);
+    munit_print_time(MUNIT_OUTPUT_FILE, report->cpu_clock / report->successful);
+    fprintf(MUNIT_OUTPUT_FILE, " CPU ]\n  %-" MUNIT_XSTRINGIFY(MUNIT_TEST_NAME_LEN) "s Total: [ ", "");
+    munit_print_time(MUNIT_OUTPUT_FILE, report->wall_clock);
+    fputs(" / ", MUNIT_OUTPUT_FILE);
+    munit_print_time(MUNIT_OUTPUT_FILE, report->cpu_clock);
+    fputs(" CPU", MUNIT_OUTPUT_FILE);
+    if (report->bench.samples > 0)
+      munit_test_runner_print_bench(&(report->bench));
+#endif
+#if defined(MUNIT_HAVE_PERF_EVENTS)
+    munit_test_runner_print_perf(&(report->perf), report->successful);
+#endif
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+    munit_test_runner_print_allocs(runner, &(report->allocs), report->successful);
+#endif
+#if defined(MUNIT_HAVE_RUSAGE)
+    munit_test_runner_print_usage(runner, &(report->usage));
+#endif
+#if defined(MUNIT_ENABLE_TIMING)
+    munit_text_print_baseline(runner, tc);
+#endif
+  } else if (report->successful > 0) {
+    munit_test_runner_print_color(runner, MUNIT_RESULT_STRING_OK, '2');
+#if defined(MUNIT_ENABLE_TIMING)
+    fputs(" ] [ ", MUNIT_OUTPUT_FILE);
+    munit_print_time(MUNIT_OUTPUT_FILE, report->wall_clock);
+    fputs(" / ", MUNIT_OUTPUT_FILE);
+    munit_print_time(MUNIT_OUTPUT_FILE, report->cpu_clock);
+    fputs(" CPU", MUNIT_OUTPUT_FILE);
+    if (report->bench.samples > 0)
+      munit_test_runner_print_bench(&(report->bench));
+#endif
+#if defined(MUNIT_HAVE_PERF_EVENTS)
+    munit_test_runner_print_perf(&(report->perf), report->successful);
+#endif
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+    munit_test_runner_print_allocs(runner, &(report->allocs), report->successful);
+#endif
+#if defined(MUNIT_HAVE_RUSAGE)
+    munit_test_runner_print_usage(runner, &(report->usage));
+#endif
+#if defined(MUNIT_ENABLE_TIMING)
+    munit_text_print_baseline(runner, tc);
+#endif
+  }
+  fputs(" ]\n", MUNIT_OUTPUT_FILE);
+
+  if (tc->show_stderr) {
+    fflush(MUNIT_OUTPUT_FILE);
+
+    rewind(tc->stderr_buf);
+    munit_splice(fileno(tc->stderr_buf), STDERR_FILENO);
+
+    fflush(stderr);
+  }
+}
+
+static void
+munit_text_fail_alloc(MunitReporter* reporter, MunitTestRunner* runner, const MunitReporterFailAlloc* fa) {
+  (void) reporter;
+  (void) runner;
+
+  fprintf(MUNIT_OUTPUT_FILE, "  %-" MUNIT_XSTRINGIFY(MUNIT_TEST_NAME_LEN) "s  #%lu ", "", fa->at);
+  if (fa->file != NULL)
+    fprintf(MUNIT_OUTPUT_FILE, "%s:%d", fa->file, fa->line);
+  else
+    fprintf(MUNIT_OUTPUT_FILE, "malloc() from %p", fa->caller);
+
+  if (!fa->crashed) {
+    fputs((fa->result == MUNIT_FAIL) ? "  FAIL\n" : "  ERROR\n", MUNIT_OUTPUT_FILE);
+    return;
+  }
+
+  if (fa->timed_out) {
+    fputs("  timed out\n", MUNIT_OUTPUT_FILE);
+  } else if (fa->signal != 0) {
+#if defined(_XOPEN_VERSION) && (_XOPEN_VERSION >= 700)
+    fprintf(MUNIT_OUTPUT_FILE, "  crashed (signal %d, %s)\n", fa->signal, strsignal(fa->signal));
+#else
+    fprintf(MUNIT_OUTPUT_FILE, "  crashed (signal %d)\n", fa->signal);
+#endif
+  } else {
+    fprintf(MUNIT_OUTPUT_FILE, "  crashed (exit status %d)\n", fa->exit_status);
+  }
+
+  if (fa->stderr_buf != NULL) {
+    fflush(MUNIT_OUTPUT_FILE);
+    rewind(fa->stderr_buf);
+    munit_splice(fileno(fa->stderr_buf), STDERR_FILENO);
+    fflush(stderr);
+  }
+}
+
+static void
+munit_text_fail_alloc_sweep(MunitReporter* reporter, MunitTestRunner* runner, const MunitReporterFailAllocSweep* sweep) {
+  (void) reporter;
+  (void) runner;
+
+  fprintf(MUNIT_OUTPUT_FILE, "  %-" MUNIT_XSTRINGIFY(MUNIT_TEST_NAME_LEN) "s   OOM: [ %lu allocation%s failed / %u handled / %u failed / %u crashed ]\n",
+          "", sweep->allocations, (sweep->allocations == 1) ? "" : "s", sweep->handled, sweep->failed, sweep->crashed);
+}
+
+static void
+munit_text_scaling(MunitReporter* reporter, MunitTestRunner* runner, const MunitReporterScaling* fit) {
+  (void) reporter;
+  (void) runner;
+
+  fprintf(MUNIT_OUTPUT_FILE, "  %-*s[ %s: ", MUNIT_TEST_NAME_LEN - 2,
+          (fit->group[0] != '\0') ? fit->group : "all", fit->parameter);
+  if (fit->model == NULL)
+    fputs("too few values ]\n", MUNIT_OUTPUT_FILE);
+  else
+    fprintf(MUNIT_OUTPUT_FILE, "%s, RMS %.0f%%, %.3g ns/element ]\n", fit->model, fit->rms * 100.0, fit->ns_per_element);
+}
+
+static void
+munit_text_shard_case(MunitReporter* reporter, MunitTestRunner* runner, const char* test_name, const MunitParameter params[], const MunitShardCase* shard) {
+  (void) reporter;
+  (void) test_name;
+
+  if (params != NULL)
+    munit_test_runner_print_params(params);
+  if (shard != NULL)
+    fprintf(MUNIT_OUTPUT_FILE, "[ shard %u/%u ]\n", shard->shard + 1, runner->shard.count);
+  else
+    fputs("[ ? ]\n", MUNIT_OUTPUT_FILE);
+}
+
+static void
+munit_text_summary(MunitReporter* reporter, MunitTestRunner* runner) {
+  const unsigned int tests_run = runner->report.successful + runner->report.failed + runner->report.errored;
+  const unsigned int tests_total = tests_run + runner->report.skipped;
+
+  (void) reporter;
+
+  if (tests_run == 0) {
+    fprintf(stderr, "No tests run, %d (100%%) skipped.\n", runner->report.skipped);
+  } else {
+    fprintf(MUNIT_OUTPUT_FILE, "%d of %d (%0.0f%%) tests successful, %d (%0.0f%%) test skipped.\n",
+            runner->report.successful, tests_run,
+            (((double) runner->report.successful) / ((double) tests_run)) * 100.0,
+            runner->report.skipped,
+            (((double) runner->report.skipped) / ((double) tests_total)) * 100.0);
+  }
+
+#if !defined(MUNIT_NO_FORK)
+  if (runner->fail_alloc_crashes != 0) {
+    fprintf(MUNIT_OUTPUT_FILE, "%u failed allocation%s crashed a test.\n",
+            runner->fail_alloc_crashes, (runner->fail_alloc_crashes == 1) ? "" : "s");
+  }
+#endif
+
+#if defined(MUNIT_ENABLE_TIMING)
+  if (runner->regressions != 0) {
+    fprintf(MUNIT_OUTPUT_FILE, "%u test%s got slower compared to the baseline.\n",
+            runner->regressions, (runner->regressions == 1) ? "" : "s");
+  }
+#endif
+}
+
+static const MunitReporterType munit_reporter_text = {
+  "text",
+  munit_text_suite_start,
+  munit_text_plan,
+  munit_text_test_start,
+  munit_text_case_start,
+  munit_text_case_result,
+  munit_text_fail_alloc,
+  munit_text_fail_alloc_sweep,
+  munit_text_scaling,
+  munit_text_shard_case,
+  munit_text_summary
+};
+
+static const char*
+munit_result_name(const MunitReporterCase* tc) {
+  switch (tc->result) {
+    case MUNIT_OK:
+      return tc->todo ? "todo" : "ok";
+    case MUNIT_SKIP:
+      return "skip";
+    case MUNIT_FAIL:
+      return "fail";
+    case MUNIT_ERROR:
+    default:
+      return "error";
+  }
+}
+
+/* Copy a test's stderr to fp, escaping each byte with escape(). */
+static void
+munit_write_stderr_buf(FILE* fp, FILE* stderr_buf, void (*escape)(FILE* fp, int c)) {
+  char buf[4096];
+  size_t buf_l;
+  size_t i;
+
+  rewind(stderr_buf);
+  while ((buf_l = fread(buf, 1, sizeof(buf), stderr_buf)) > 0) {
+    for (i = 0 ; i < buf_l ; i++)
+      escape(fp, (unsigned char) buf[i]);
+  }
+}
+
+/* JSON Lines (--reporter jsonl:FILE): one object per line, with a
+ * "type" of "start", "case" or "summary". */
+
+static void
+munit_json_escape(FILE* fp, int c) {
+  switch (c) {
+    case '"':  fputs("\\\"", fp); break;
+    case '\\': fputs("\\\\", fp); break;
+    case '\n': fputs("\\n", fp); break;
+    case '\r': fputs("\\r", fp); break;
+    case '\t': fputs("\\t", fp); break;
+    default:
+      if (c < 0x20)
+        fprintf(fp, "\\u%04x", c);
+      else
+        fputc(c, fp);
+      break;
+  }
+}
+
+static void
+munit_json_print_string(FILE* fp, const char* s) {
+  fputc('"', fp);
+  for ( ; s != NULL && *s != '\0' ; s++)
+    munit_json_escape(fp, (unsigned char) *s);
+  fputc('"', fp);
+}
+
+#if defined(MUNIT_ENABLE_TIMING)
+static const char* const munit_baseline_change_names[] = {
+  "none", "missing", "unchanged", "slower", "faster"
+};
+#endif
+
+static void
+munit_json_print_params(FILE* fp, const MunitParameter params[]) {
+  const MunitParameter* param;
+
+  fputs("\"params\":{", fp);
+  for (param = params ; param != NULL && param->name != NULL ; param++) {
+    if (param != params)
+      fputc(',', fp);
+    munit_json_print_string(fp, param->name);
+    fputc(':', fp);
+    munit_json_print_string(fp, param->value);
+  }
+  fputc('}', fp);
+}
+
+static void
+munit_jsonl_suite_start(MunitReporter* reporter, MunitTestRunner* runner) {
+  fputs("{\"type\":\"start\",\"suite\":", reporter->fp);
+  munit_json_print_string(reporter->fp, runner->suite->prefix);
+  fprintf(reporter->fp, ",\"seed\":%" PRIu32 "}\n", runner->seed);
+}
+
+static void
+munit_jsonl_plan(MunitReporter* reporter, MunitTestRunner* runner, const MunitReporterPlan* plan) {
+  (void) runner;
+
+  if (plan->shard_count == 0 && !(plan->eta > 0))
+    return;
+
+  fputs("{\"type\":\"plan\"", reporter->fp);
+  if (plan->shard_count != 0) {
+    fprintf(reporter->fp, ",\"shard\":%u,\"shards\":%u,\"cases\":%lu,\"total_cases\":%lu",
+            plan->shard_index + 1, plan->shard_count, (unsigned long) plan->cases, (unsigned long) plan->total_cases);
+  }
+  if (plan->eta > 0)
+    fprintf(reporter->fp, ",\"estimated_ns\":%.0f", plan->eta);
+  fputs("}\n", reporter->fp);
+}
+
+static void
+munit_jsonl_case_result(MunitReporter* reporter, MunitTestRunner* runner, const MunitReporterCase* tc) {
+  FILE* fp = reporter->fp;
+  const MunitReport* report = tc->report;
+#if defined(MUNIT_HAVE_PERF_EVENTS)
+  const char* sep = "";
+  static const char* const perf_names[MUNIT_PERF_COUNTERS] = {
+    "task_clock_ns", "cycles", "instructions", "cache_misses", "branch_misses"
+  };
+  unsigned int i;
+#endif
+
+  (void) runner;
+
+  fputs("{\"type\":\"case\",\"name\":", fp);
+  munit_json_print_string(fp, tc->test_name);
+  fputc(',', fp);
+  munit_json_print_params(fp, tc->params);
+  fprintf(fp, ",\"result\":\"%s\",\"successful\":%u,\"skipped\":%u,\"failed\":%u,\"errored\":%u",
+          munit_result_name(tc), report->successful, report->skipped, report->failed, report->errored);
+#if defined(MUNIT_ENABLE_TIMING)
+  fprintf(fp, ",\"wall_clock_ns\":%" PRIu64 ",\"cpu_clock_ns\":%" PRIu64, report->wall_clock, report->cpu_clock);
+  if (report->bench.samples > 0) {
+    fprintf(fp, ",\"bench\":{\"samples\":%u,\"iterations\":%u,\"min_ns\":%.3f,\"median_ns\":%.3f,"
+            "\"p90_ns\":%.3f,\"p99_ns\":%.3f,\"stddev_ns\":%.3f,\"mad_ns\":%.3f}",
+            report->bench.samples, report->bench.iterations, report->bench.min, report->bench.median,
+            report->bench.p90, report->bench.p99, report->bench.stddev, report->bench.mad);
+  }
+  if (tc->baseline != MUNIT_BASELINE_NONE) {
+    fprintf(fp, ",\"baseline\":{\"change\":\"%s\"", munit_baseline_change_names[tc->baseline]);
+    if (tc->baseline != MUNIT_BASELINE_MISSING)
+      fprintf(fp, ",\"median_change_pct\":%.3f,\"z\":%.3f", tc->baseline_change, tc->baseline_z);
+    fputc('}', fp);
+  }
+#endif
+#if defined(MUNIT_HAVE_PERF_EVENTS)
+  if (report->perf.available != 0) {
+    fputs(",\"perf\":{", fp);
+    for (i = 0 ; i < MUNIT_PERF_COUNTERS ; i++) {
+      if (report->perf.available & (1U << i)) {
+        fprintf(fp, "%s\"%s\":%" PRIu64, sep, perf_names[i], report->perf.values[i]);
+        sep = ",";
+      }
+    }
+    fputc('}', fp);
+  }
+#endif
+#if defined(MUNIT_HAVE_RUSAGE)
+  if (report->usage.valid) {
+    fprintf(fp, ",\"usage\":{\"max_rss\":%" PRIu64 ",\"minor_faults\":%" PRIu64 ",\"major_faults\":%" PRIu64
+            ",\"voluntary_switches\":%" PRIu64 ",\"involuntary_switches\":%" PRIu64 "}",
+            report->usage.max_rss, report->usage.minor_faults, report->usage.major_faults,
+            report->usage.voluntary_switches, report->usage.involuntary_switches);
+  }
+#endif
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+  if (runner->count_allocs) {
+    fprintf(fp, ",\"allocs\":{\"allocations\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"frees\":%" PRIu64 "}",
+            report->allocs.allocations, report->allocs.bytes, report->allocs.frees);
+  }
+#endif
+  if (tc->show_stderr) {
+    fputs(",\"stderr\":\"", fp);
+    munit_write_stderr_buf(fp, tc->stderr_buf, munit_json_escape);
+    fputc('"', fp);
+  }
+  fputs("}\n", fp);
+}
+
+static void
+munit_jsonl_fail_alloc(MunitReporter* reporter, MunitTestRunner* runner, const MunitReporterFailAlloc* fa) {
+  FILE* fp = reporter->fp;
+
+  (void) runner;
+
+  fputs("{\"type\":\"fail_alloc\",\"name\":", fp);
+  munit_json_print_string(fp, fa->test_name);
+  fputc(',', fp);
+  munit_json_print_params(fp, fa->params);
+  fprintf(fp, ",\"at\":%lu", fa->at);
+  if (fa->file != NULL) {
+    fputs(",\"file\":", fp);
+    munit_json_print_string(fp, fa->file);
+    fprintf(fp, ",\"line\":%d", fa->line);
+  } else {
+    fprintf(fp, ",\"caller\":\"%p\"", fa->caller);
+  }
+  if (!fa->crashed) {
+    fprintf(fp, ",\"result\":\"%s\"}\n", (fa->result == MUNIT_FAIL) ? "fail" : "error");
+    return;
+  }
+
+  fputs(",\"result\":\"crash\"", fp);
+  if (fa->timed_out)
+    fputs(",\"timed_out\":true", fp);
+  else if (fa->signal != 0)
+    fprintf(fp, ",\"signal\":%d", fa->signal);
+  else
+    fprintf(fp, ",\"exit_status\":%d", fa->exit_status);
+  if (fa->stderr_buf != NULL) {
+    fputs(",\"stderr\":\"", fp);
+    munit_write_stderr_buf(fp, fa->stderr_buf, munit_json_escape);
+    fputc('"', fp);
+  }
+  fputs("}\n", fp);
+}
+
+static void
+munit_jsonl_fail_alloc_sweep(MunitReporter* reporter, MunitTestRunner* runner, const MunitReporterFailAllocSweep* sweep) {
+  FILE* fp = reporter->fp;
+
+  (void) runner;
+
+  fputs("{\"type\":\"fail_alloc_sweep\",\"name\":", fp);
+  munit_json_print_string(fp, sweep->test_name);
+  fputc(',', fp);
+  munit_json_print_params(fp, sweep->params);
+  fprintf(fp, ",\"allocations\":%lu,\"handled\":%u,\"failed\":%u,\"crashed\":%u}\n",
+          sweep->allocations, sweep->handled, sweep->failed, sweep->crashed);
+}
+
+static void
+munit_jsonl_scaling(MunitReporter* reporter, MunitTestRunner* runner, const MunitReporterScaling* fit) {
+  FILE* fp = reporter->fp;
+
+  (void) runner;
+
+  fputs("{\"type\":\"scaling\",\"name\":", fp);
+  munit_json_print_string(fp, fit->test_name);
+  fputs(",\"group\":", fp);
+  munit_json_print_string(fp, fit->group);
+  fputs(",\"parameter\":", fp);
+  munit_json_print_string(fp, fit->parameter);
+  if (fit->model == NULL) {
+    fputs(",\"model\":null}\n", fp);
+  } else {
+    fputs(",\"model\":", fp);
+    munit_json_print_string(fp, fit->model);
+    fprintf(fp, ",\"rms\":%.4f,\"ns_per_element\":%.4g}\n", fit->rms, fit->ns_per_element);
+  }
+}
+
+static void
+munit_jsonl_shard_case(MunitReporter* reporter, MunitTestRunner* runner, const char* test_name, const MunitParameter params[], const MunitShardCase* shard) {
+  FILE* fp = reporter->fp;
+
+  (void) runner;
+
+  fputs("{\"type\":\"shard_case\",\"name\":", fp);
+  munit_json_print_string(fp, test_name);
+  fputc(',', fp);
+  munit_json_print_params(fp, params);
+  if (shard != NULL)
+    fprintf(fp, ",\"shard\":%u}\n", shard->shard + 1);
+  else
+    fputs(",\"shard\":null}\n", fp);
+}
+
+static void
+munit_jsonl_summary(MunitReporter* reporter, MunitTestRunner* runner) {
+  fprintf(reporter->fp, "{\"type\":\"summary\",\"successful\":%u,\"skipped\":%u,\"failed\":%u,\"errored\":%u}\n",
+          runner->report.successful, runner->report.skipped, runner->report.failed, runner->report.errored);
+}
+
+/* JUnit XML (--reporter junit:FILE).  The totals go in the
+ * <testsuite> element at the top, which we can't know until the end,
+ * so space is left for them (padded with spaces, which XML allows
+ * inside a tag) and filled in by the summary.  If the file isn't
+ * seekable (a pipe, say) they're left out. */
+
+#if defined(MUNIT_ENABLE_TIMING)
+#  define MUNIT_JUNIT_TOTALS_FORMAT "tests=\"%u\" failures=\"%u\" errors=\"%u\" skipped=\"%u\" time=\"%" PRIu64 ".%09" PRIu64 "\""
+#  define MUNIT_JUNIT_TOTALS_WIDTH \
+  (sizeof("tests=\"4294967295\" failures=\"4294967295\" errors=\"4294967295\" skipped=\"4294967295\" time=\"18446744073.709551615\"") - 1)
+#  define MUNIT_JUNIT_TOTALS(totals) \
+  (totals).successful + (totals).failed + (totals).errored + (totals).skipped, \
+  (totals).failed, (totals).errored, (totals).skipped, \
+  (totals).wall_clock / PSNIP_CLOCK_NSEC_PER_SEC, (totals).wall_clock % PSNIP_CLOCK_NSEC_PER_SEC
+#else
+#  define MUNIT_JUNIT_TOTALS_FORMAT "tests=\"%u\" failures=\"%u\" errors=\"%u\" skipped=\"%u\""
+#  define MUNIT_JUNIT_TOTALS_WIDTH \
+  (sizeof("tests=\"4294967295\" failures=\"4294967295\" errors=\"4294967295\" skipped=\"4294967295\"") - 1)
+#  define MUNIT_JUNIT_TOTALS(totals) \
+  (totals).successful + (totals).failed + (totals).errored + (totals).skipped, \
+  (totals).failed, (totals).errored, (totals).skipped
+#endif
+
+static void
+munit_xml_escape(FILE* fp, int c) {
+  switch (c) {
+    case '<':  fputs("&lt;", fp); break;
+    case '>':  fputs("&gt;", fp); break;
+    case '&':  fputs("&amp;", fp); break;
+    case '"':  fputs("&quot;", fp); break;
+    case '\n':
+    case '\r':
+    case '\t':
+      fputc(c, fp);
+      break;
+    default:
+      /* Most control characters aren't allowed in XML 1.0 at all. */
+      fputc((c < 0x20) ? '?' : c, fp);
+      break;
+  }
+}
+
+static void
+munit_xml_print_string(FILE* fp, const char* s) {
+  for ( ; s != NULL && *s != '\0' ; s++)
+    munit_xml_escape(fp, (unsigned char) *s);
+}
+
+/* Write the totals, followed by enough spaces to fill the room left
+ * for them. */
+static void
+munit_junit_print_totals(FILE* fp, const MunitReport* totals) {
+  int written = fprintf(fp, MUNIT_JUNIT_TOTALS_FORMAT, MUNIT_JUNIT_TOTALS(*totals));
+
+  for ( ; written >= 0 && (size_t) written < MUNIT_JUNIT_TOTALS_WIDTH ; written++)
+    fputc(' ', fp);
+}
+
+static void
+munit_junit_suite_start(MunitReporter* reporter, MunitTestRunner* runner) {
+  fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<testsuites>\n  <testsuite name=\"", reporter->fp);
+  munit_xml_print_string(reporter->fp, runner->suite->prefix);
+  fputc('"', reporter->fp);
+  reporter->totals_pos = ftell(reporter->fp);
+  if (reporter->totals_pos >= 0) {
+    fputc(' ', reporter->fp);
+    reporter->totals_pos++;
+    munit_junit_print_totals(reporter->fp, &(reporter->totals));
+  }
+  fputs(">\n", reporter->fp);
+}
+
+static void
+munit_junit_plan(MunitReporter* reporter, MunitTestRunner* runner, const MunitReporterPlan* plan) {
+  (void) runner;
+
+  if (plan->shard_count == 0 && !(plan->eta > 0))
+    return;
+
+  fputs("    <properties>\n", reporter->fp);
+  if (plan->shard_count != 0) {
+    fprintf(reporter->fp, "      <property name=\"shard\" value=\"%u/%u\"/>\n"
+            "      <property name=\"shard_cases\" value=\"%lu/%lu\"/>\n",
+            plan->shard_index + 1, plan->shard_count, (unsigned long) plan->cases, (unsigned long) plan->total_cases);
+  }
+  if (plan->eta > 0)
+    fprintf(reporter->fp, "      <property name=\"estimated_ns\" value=\"%.0f\"/>\n", plan->eta);
+  fputs("    </properties>\n", reporter->fp);
+}
+
+/* Start a <testcase>; the name is the parameters, if there are any. */
+static void
+munit_junit_testcase_start(FILE* fp, const char* test_name, const MunitParameter params[]) {
+  const MunitParameter* param;
+  const char* sep = "";
+
+  fputs("    <testcase classname=\"", fp);
+  munit_xml_print_string(fp, test_name);
+  fputs("\" name=\"", fp);
+  if (params == NULL || params[0].name == NULL)
+    munit_xml_print_string(fp, test_name);
+  for (param = params ; param != NULL && param->name != NULL ; param++) {
+    fputs(sep, fp);
+    munit_xml_print_string(fp, param->name);
+    fputc('=', fp);
+    munit_xml_print_string(fp, param->value);
+    sep = ", ";
+  }
+}
+
+static void
+munit_junit_case_result(MunitReporter* reporter, MunitTestRunner* runner, const MunitReporterCase* tc) {
+  FILE* fp = reporter->fp;
+
+  (void) runner;
+
+  munit_junit_testcase_start(fp, tc->test_name, tc->params);
+  fputc('"', fp);
+#if defined(MUNIT_ENABLE_TIMING)
+  reporter->totals.wall_clock += tc->report->wall_clock;
+  fprintf(fp, " time=\"%" PRIu64 ".%09" PRIu64 "\"",
+          tc->report->wall_clock / PSNIP_CLOCK_NSEC_PER_SEC, tc->report->wall_clock % PSNIP_CLOCK_NSEC_PER_SEC);
+#endif
+  fputs(">\n", fp);
+
+  switch (tc->result) {
+    case MUNIT_FAIL:
+      reporter->totals.failed++;
+      fputs("      <failure message=\"test failed\"/>\n", fp);
+      break;
+    case MUNIT_ERROR:
+      reporter->totals.errored++;
+      fprintf(fp, "      <error message=\"%s\"/>\n", tc->todo ? "test marked TODO, but was successful" : "test errored");
+      break;
+    case MUNIT_SKIP:
+      reporter->totals.skipped++;
+      fputs("      <skipped/>\n", fp);
+      break;
+    case MUNIT_OK:
+    default:
+      if (tc->todo) {
+        reporter->totals.skipped++;
+        fputs("      <skipped message=\"TODO\"/>\n", fp);
+      } else {
+        reporter->totals.successful++;
+      }
+      break;
+  }
+
+  if (tc->show_stderr) {
+    fputs("      <system-err>", fp);
+    munit_write_stderr_buf(fp, tc->stderr_buf, munit_xml_escape);
+    fputs("</system-err>\n", fp);
+  }
+  fputs("    </testcase>\n", fp);
+}
+
+/* Each --fail-alloc run which didn't cope is a test case of its own,
+ * named after the allocation which failed. */
+static void
+munit_junit_fail_alloc(MunitReporter* reporter, MunitTestRunner* runner, const MunitReporterFailAlloc* fa) {
+  FILE* fp = reporter->fp;
+
+  (void) runner;
+
+  munit_junit_testcase_start(fp, fa->test_name, fa->params);
+  fprintf(fp, " [fail-alloc #%lu]\">\n", fa->at);
+  if (fa->crashed) {
+    reporter->totals.errored++;
+    if (fa->timed_out)
+      fprintf(fp, "      <error message=\"timed out when allocation #%lu failed", fa->at);
+    else
+      fprintf(fp, "      <error message=\"crashed (%s %d) when allocation #%lu failed", (fa->signal != 0) ? "signal" : "exit status",
+              (fa->signal != 0) ? fa->signal : fa->exit_status, fa->at);
+  } else {
+    reporter->totals.failed++;
+    fprintf(fp, "      <failure message=\"%s when allocation #%lu failed", (fa->result == MUNIT_FAIL) ? "failed" : "errored", fa->at);
+  }
+  if (fa->file != NULL) {
+    fputs(" at ", fp);
+    munit_xml_print_string(fp, fa->file);
+    fprintf(fp, ":%d", fa->line);
+  }
+  fputs("\"/>\n", fp);
+
+  if (fa->stderr_buf != NULL) {
+    fputs("      <system-err>", fp);
+    munit_write_stderr_buf(fp, fa->stderr_buf, munit_xml_escape);
+    fputs("</system-err>\n", fp);
+  }
+  fputs("    </testcase>\n", fp);
+}
+
+static void
+munit_junit_summary(MunitReporter* reporter, MunitTestRunner* runner) {
+  (void) runner;
+
+  fputs("  </testsuite>\n</testsuites>\n", reporter->fp);
+  if (reporter->totals_pos >= 0 && fseek(reporter->fp, reporter->totals_pos, SEEK_SET) == 0) {
+    munit_junit_print_totals(reporter->fp, &(reporter->totals));
+    fseek(reporter->fp, 0, SEEK_END);
+  }
+}
+
+static const MunitReporterType munit_reporter_types[] = {
+  { "jsonl", munit_jsonl_suite_start, munit_jsonl_plan, NULL, NULL, munit_jsonl_case_result,
+    munit_jsonl_fail_alloc, munit_jsonl_fail_alloc_sweep, munit_jsonl_scaling, munit_jsonl_shard_case, munit_jsonl_summary },
+  { "junit", munit_junit_suite_start, munit_junit_plan, NULL, NULL, munit_junit_case_result,
+    munit_junit_fail_alloc, NULL, NULL, NULL, munit_junit_summary },
+  { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+static munit_bool
+munit_test_runner_add_reporter(MunitTestRunner* runner, const MunitReporterType* type, FILE* fp) {
+  MunitReporter* reporters;
+
+  reporters = realloc(runner->reporters, sizeof(MunitReporter) * (runner->reporters_l + 1));
+  if (reporters == NULL) {
+    munit_log_internal(MUNIT_LOG_ERROR, stderr, "failed to allocate memory");
+    return 0;
+  }
+  runner->reporters = reporters;
+
+  memset(&(reporters[runner->reporters_l]), 0, sizeof(MunitReporter));
+  reporters[runner->reporters_l].type = type;
+  reporters[runner->reporters_l].fp = fp;
+  reporters[runner->reporters_l].totals_pos = -1;
+  runner->reporters_l++;
+
+  return 1;
+}
+
+/* Parse the FORMAT:FILE argument to --reporter. */
+static munit_bool
+munit_test_runner_parse_reporter(MunitTestRunner* runner, const char* arg, const char* value) {
+  const MunitReporterType* type;
+  const char* filename = strchr(value, ':');
+  FILE* fp;
+
+  for (type = munit_reporter_types ; type->name != NULL ; type++) {
+    if (filename != NULL && strlen(type->name) == (size_t) (filename - value) &&
+        strncmp(type->name, value, (size_t) (filename - value)) == 0)
+      break;
+  }
+  if (type->name == NULL || filename[1] == '\0') {
+    munit_logf_internal(MUNIT_LOG_ERROR, stderr, "invalid value ('%s') passed to %s", value, arg);
+    return 0;
+  }
+  filename++;
+
+  fp = fopen(filename, "w");
+  if (fp == NULL) {
+    munit_logf_internal(MUNIT_LOG_ERROR, stderr, "unable to open report file '%s': %s", filename, strerror(errno));
+    return 0;
+  }
+  if (!munit_test_runner_add_reporter(runner, type, fp)) {
+    fclose(fp);
+    return 0;
+  }
+
+  return 1;
+}
+
+static void
+munit_test_runner_suite_start(MunitTestRunner* runner) {
+  MunitReporter* reporter;
+
+  for (reporter = runner->reporters ; reporter != runner->reporters + runner->reporters_l ; reporter++) {
+    if (reporter->type->suite_start != NULL)
+      reporter->type->suite_start(reporter, runner);
+  }
+}
+
+static void
+munit_test_runner_test_start(MunitTestRunner* runner, const char* test_name, munit_bool parameterized) {
+  MunitReporter* reporter;
+
+  for (reporter = runner->reporters ; reporter != runner->reporters + runner->reporters_l ; reporter++) {
+    if (reporter->type->test_start != NULL)
+      reporter->type->test_start(reporter, runner, test_name, parameterized);
+  }
+}
+
+static void
+munit_test_runner_case_start(MunitTestRunner* runner, const char* test_name, const MunitParameter params[]) {
+  MunitReporter* reporter;
+
+  for (reporter = runner->reporters ; reporter != runner->reporters + runner->reporters_l ; reporter++) {
+    if (reporter->type->case_start != NULL)
+      reporter->type->case_start(reporter, runner, test_name, params);
+  }
+}
+
+static void
+munit_test_runner_summary(MunitTestRunner* runner) {
+  MunitReporter* reporter;
+
+  for (reporter = runner->reporters ; reporter != runner->reporters + runner->reporters_l ; reporter++) {
+    if (reporter->type->summary != NULL)
+      reporter->type->summary(reporter, runner);
+  }
+}
+
+/* Work out what a test case's result counts as, add it to the
+ * runner's totals, compare it with the baseline, and pass it on to
+ * the reporters.  key and samples are only needed for the baseline,
+ * and may be NULL. */
+static void
+munit_test_runner_report(MunitTestRunner* runner, const MunitTest* test, const char* test_name, const MunitParameter params[],
+                         const MunitReport* report, FILE* stderr_buf, const char* key, const double samples[]) {
+  MunitReporterCase tc;
+  MunitReporter* reporter;
+
+  tc.test = test;
+  tc.test_name = test_name;
+  tc.params = params;
+  tc.result = MUNIT_OK;
+  tc.todo = (test->options & MUNIT_TEST_OPTION_TODO) == MUNIT_TEST_OPTION_TODO;
+  tc.report = report;
+  tc.stderr_buf = stderr_buf;
+  tc.baseline = MUNIT_BASELINE_NONE;
+  tc.baseline_change = 0;
+  tc.baseline_z = 0;
+
+  if (tc.todo) {
+    if (report->failed == 0 && report->errored == 0 && report->skipped == 0) {
+      if (MUNIT_LIKELY(stderr_buf != NULL))
+        munit_log_internal(MUNIT_LOG_ERROR, stderr_buf, "Test marked TODO, but was successful.");
+      runner->report.failed++;
+      tc.result = MUNIT_ERROR;
+    }
+  } else if (report->failed > 0) {
+    runner->report.failed++;
+    tc.result = MUNIT_FAIL;
+  } else if (report->errored > 0) {
+    runner->report.errored++;
+    tc.result = MUNIT_ERROR;
+  } else if (report->skipped > 0) {
+    runner->report.skipped++;
+    tc.result = MUNIT_SKIP;
+  } else if (report->successful > 0) {
+    runner->report.successful++;
+  }
+
+  tc.show_stderr = stderr_buf != NULL &&
+    (tc.result == MUNIT_FAIL || tc.result == MUNIT_ERROR || runner->show_stderr);
+
+#if defined(MUNIT_ENABLE_TIMING)
+  if (tc.result == MUNIT_OK && !tc.todo && report->successful > 0)
+    munit_test_runner_compare_baseline(runner, &tc, key, samples);
+#else
+  (void) key;
+  (void) samples;
+#endif
+
+  for (reporter = runner->reporters ; reporter != runner->reporters + runner->reporters_l ; reporter++) {
+    if (reporter->type->case_result != NULL)
+      reporter->type->case_result(reporter, runner, &tc);
+  }
+}
+
+static void
+munit_test_runner_plan(MunitTestRunner* runner, const MunitReporterPlan* plan) {
+  MunitReporter* reporter;
+
+  for (reporter = runner->reporters ; reporter != runner->reporters + runner->reporters_l ; reporter++) {
+    if (reporter->type->plan != NULL)
+      reporter->type->plan(reporter, runner, plan);
+  }
+}
+
+#if !defined(MUNIT_NO_FORK)
+static void
+munit_test_runner_report_fail_alloc(MunitTestRunner* runner, const MunitReporterFailAlloc* fa) {
+  MunitReporter* reporter;
+
+  for (reporter = runner->reporters ; reporter != runner->reporters + runner->reporters_l ; reporter++) {
+    if (reporter->type->fail_alloc != NULL)
+      reporter->type->fail_alloc(reporter, runner, fa);
+  }
+}
+
+static void
+munit_test_runner_report_fail_alloc_sweep(MunitTestRunner* runner, const MunitReporterFailAllocSweep* sweep) {
+  MunitReporter* reporter;
+
+  for (reporter = runner->reporters ; reporter != runner->reporters + runner->reporters_l ; reporter++) {
+    if (reporter->type->fail_alloc_sweep != NULL)
+      reporter->type->fail_alloc_sweep(reporter, runner, sweep);
+  }
+}
+#endif
+
+static void
+munit_test_runner_report_shard_case(MunitTestRunner* runner, const MunitParameter params[], const MunitShardCase* shard) {
+  MunitReporter* reporter;
+
+  for (reporter = runner->reporters ; reporter != runner->reporters + runner->reporters_l ; reporter++) {
+    if (reporter->type->shard_case != NULL)
+      reporter->type->shard_case(reporter, runner, runner->test_name, params, shard);
+  }
+}
+
+#if defined(MUNIT_ENABLE_TIMING)
+static void
+munit_test_runner_scaling(MunitTestRunner* runner, const MunitReporterScaling* fit) {
+  MunitReporter* reporter;
+
+  for (reporter = runner->reporters ; reporter != runner->reporters + runner->reporters_l ; reporter++) {
+    if (reporter->type->scaling != NULL)
+      reporter->type->scaling(reporter, runner, fit);
+  }
+}
+
+/* Fit the time taken by each group of test cases to c * f(n) for
+ * each model by least squares, like Google Benchmark does, and report
+ * whichever model fits best along with its RMS error relative to the
+ * mean time. */
+static void
+munit_test_runner_fit_scaling(MunitTestRunner* runner) {
+  const MunitScalingPoint* points = runner->scaling_points;
+  const size_t points_l = runner->scaling_points_l;
+  MunitReporterScaling fit;
+  size_t first, last, i;
+  double sum_ff, sum_tf, sum_t, sum_n;
+  double c, err, f;
+  double rms[MUNIT_SCALING_MODELS];
+  int model, best;
+
+  if (points_l == 0)
+    return;
+
+  qsort(runner->scaling_points, points_l, sizeof(MunitScalingPoint), munit_scaling_point_compare);
+
+  for (first = 0 ; first < points_l ; first = last) {
+    for (last = first + 1 ; last < points_l && strcmp(points[first].group, points[last].group) == 0 ; last++) { }
+
+    fit.test_name = runner->test_name;
+    fit.group = points[first].group;
+    fit.parameter = runner->scaling;
+    fit.model = NULL;
+    fit.rms = 0;
+    fit.ns_per_element = 0;
+
+    if (last - first < 3 || points[first].n == points[last - 1].n) {
+      munit_test_runner_scaling(runner, &fit);
+      continue;
+    }
+
+    sum_t = 0;
+    sum_n = 0;
+    for (i = first ; i < last ; i++) {
+      sum_t += points[i].ns;
+      sum_n += points[i].n;
+    }
+
+    best = 0;
+    for (model = 0 ; model < MUNIT_SCALING_MODELS ; model++) {
+      sum_ff = 0;
+      sum_tf = 0;
+      for (i = first ; i < last ; i++) {
+        f = munit_scaling_f(model, points[i].n);
+        sum_ff += f * f;
+        sum_tf += points[i].ns * f;
+      }
+      c = (sum_ff > 0) ? sum_tf / sum_ff : 0;
+
+      err = 0;
+      for (i = first ; i < last ; i++) {
+        f = points[i].ns - c * munit_scaling_f(model, points[i].n);
+        err += f * f;
+      }
+      rms[model] = (sum_t > 0) ? munit_sqrt(err / (double) (last - first)) / (sum_t / (double) (last - first)) : 0;
+
+      /* Ties go to the simpler model. */
+      if (rms[model] < rms[best])
+        best = model;
+    }
+
+    fit.model = munit_scaling_names[best];
+    fit.rms = rms[best];
+    fit.ns_per_element = sum_t / sum_n;
+    munit_test_runner_scaling(runner, &fit);
+  }
+}
+#endif
+
+#if !defined(MUNIT_NO_FORK)
+/* The SIGCHLD handler writes a byte here so munit_test_runner_wait
+ * can find out about children exiting with poll(). */
+static int munit_sigchld_fd = -1;
+
+static void
+munit_sigchld_handler(int sig) {
+  const int saved_errno = errno;
+  const char c = 0;
+  ssize_t write_res;
+
+  (void) sig;
+
+  /* If the pipe is full a wakeup is already pending. */
+  write_res = write(munit_sigchld_fd, &c, 1);
+  (void) write_res;
+
+  errno = saved_errno;
+}
+
+static munit_bool
+munit_fd_set_flags(int fd, int fd_flags, int fl_flags) {
+  const int fdfl = fcntl(fd, F_GETFD);
+  const int fl = fcntl(fd, F_GETFL);
+
+  return
+    fdfl != -1 && fl != -1 &&
+    fcntl(fd, F_SETFD, fdfl | fd_flags) != -1 &&
+    fcntl(fd, F_SETFL, fl | fl_flags) != -1;
+}
+
+/* Set up everything the runner needs before it starts forking:
+ * the result arena and the SIGCHLD self-pipe. */
+static munit_bool
+munit_test_runner_fork_init(MunitTestRunner* runner) {
+  size_t results_size;
+  struct sigaction sa;
+  void* results;
+  unsigned int i;
+  MunitResultSlot* slot;
+#if !defined(MAP_ANONYMOUS)
+  int zero_fd;
+#endif
+
+#if defined(MUNIT_ENABLE_TIMING)
+  if (runner->benchmark)
+    runner->slot_samples = runner->bench_samples;
+#endif
+  results_size = MUNIT_RESULT_SLOT_SIZE(runner) * runner->jobs;
+
+#if defined(MAP_ANONYMOUS)
+  results = mmap(NULL, results_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+#else
+  zero_fd = open("/dev/zero", O_RDWR);
+  if (zero_fd == -1) {
+    munit_log_errno(MUNIT_LOG_ERROR, stderr, "unable to open /dev/zero");
+    return 0;
+  }
+  results = mmap(NULL, results_size, PROT_READ | PROT_WRITE, MAP_SHARED, zero_fd, 0);
+  close(zero_fd);
+#endif
+  if (results == MAP_FAILED) {
+    munit_log_errno(MUNIT_LOG_ERROR, stderr, "unable to map result arena");
+    return 0;
+  }
+  runner->results = (MunitResultSlot*) results;
+  for (i = 0 ; i < runner->jobs ; i++) {
+    slot = MUNIT_RESULT_SLOT(runner, i);
+    slot->busy = 0;
+    slot->index = i;
+  }
+
+  if (pipe(runner->sigchld_pipe) != 0) {
+    munit_log_errno(MUNIT_LOG_ERROR, stderr, "unable to create pipe");
+    runner->sigchld_pipe[0] = -1;
+    runner->sigchld_pipe[1] = -1;
+    return 0;
+  }
+  if (!munit_fd_set_flags(runner->sigchld_pipe[0], FD_CLOEXEC, O_NONBLOCK) ||
+      !munit_fd_set_flags(runner->sigchld_pipe[1], FD_CLOEXEC, O_NONBLOCK)) {
+    munit_log_errno(MUNIT_LOG_ERROR, stderr, "unable to configure pipe");
+    return 0;
+  }
+  munit_sigchld_fd = runner->sigchld_pipe[1];
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = munit_sigchld_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  if (sigaction(SIGCHLD, &sa, &(runner->sigchld_old)) != 0) {
+    munit_log_errno(MUNIT_LOG_ERROR, stderr, "unable to install SIGCHLD handler");
+    return 0;
+  }
+  runner->sigchld_installed = 1;
+
+  return 1;
+}
+
+static void
+munit_test_runner_fork_fini(MunitTestRunner* runner) {
+  if (runner->sigchld_installed) {
+    sigaction(SIGCHLD, &(runner->sigchld_old), NULL);
+    runner->sigchld_installed = 0;
+  }
+  munit_sigchld_fd = -1;
+
+  if (runner->sigchld_pipe[0] != -1) {
+    close(runner->sigchld_pipe[0]);
+    close(runner->sigchld_pipe[1]);
+    runner->sigchld_pipe[0] = -1;
+    runner->sigchld_pipe[1] = -1;
+  }
+
+  if (runner->results != NULL) {
+    munmap((void*) runner->results, MUNIT_RESULT_SLOT_SIZE(runner) * runner->jobs);
+    runner->results = NULL;
+  }
+}
+
+/* Undo munit_test_runner_fork_init in a freshly forked child, so the
+ * test gets the SIGCHLD disposition it would normally have. */
+static void
+munit_test_runner_child_init(MunitTestRunner* runner) {
+  if (runner->sigchld_installed)
+    sigaction(SIGCHLD, &(runner->sigchld_old), NULL);
+  close(runner->sigchld_pipe[0]);
+  close(runner->sigchld_pipe[1]);
+}
+
+/* Anything still sitting in our buffers would be written a second
+ * time when a child exits. */
+static void
+munit_test_runner_flush_streams(MunitTestRunner* runner) {
+  size_t i;
+
+  fflush(MUNIT_OUTPUT_FILE);
+  fflush(stderr);
+#if defined(MUNIT_ENABLE_TIMING)
+  if (runner->baseline_out != NULL)
+    fflush(runner->baseline_out);
+#endif
+  for (i = 0 ; i < runner->reporters_l ; i++) {
+    if (runner->reporters[i].fp != NULL)
+      fflush(runner->reporters[i].fp);
+  }
+}
+
+static MunitResultSlot*
+munit_test_runner_acquire_slot(MunitTestRunner* runner) {
+  MunitResultSlot* slot;
+  unsigned int i;
+
+  for (i = 0 ; i < runner->jobs ; i++) {
+    slot = MUNIT_RESULT_SLOT(runner, i);
+    if (!slot->busy) {
+      slot->busy = 1;
+      slot->status = MUNIT_RESULT_EMPTY;
+      memset(&(slot->report), 0, sizeof(slot->report));
+      return slot;
+    }
+  }
+
+  return NULL;
+}
+
+static void
+munit_test_case_release_slot(MunitTestCase* tc) {
+  if (tc->slot != NULL) {
+    tc->slot->busy = 0;
+    tc->slot = NULL;
+  }
+}
+
+/* Fork a child process to run the test case.  The child writes its
+ * report straight into the case's slot in the result arena, and we
+ * find out it's done from SIGCHLD. */
+static void
+munit_test_runner_spawn(MunitTestRunner* runner, MunitTestCase* tc) {
+  pid_t fork_pid;
+  int orig_stderr;
+
+  munit_test_runner_flush_streams(runner);
 
-/* Set the provided timespec to the requested time.  Returns 0 on
- * success, or a negative value on failure. */
-PSNIP_CLOCK__FUNCTION int
-psnip_clock_get_time (enum PsnipClockType clock_type, struct PsnipClockTimespec* res) {
-  assert(res != NULL);
+  fork_pid = fork();
+  if (fork_pid == 0) {
+    munit_test_runner_child_init(runner);
 
-  switch (clock_type) {
-    case PSNIP_CLOCK_TYPE_MONOTONIC:
-      return psnip_clock_monotonic_get_time (res);
-    case PSNIP_CLOCK_TYPE_CPU:
-      return psnip_clock_cpu_get_time (res);
-    case PSNIP_CLOCK_TYPE_WALL:
-      return psnip_clock_wall_get_time (res);
-  }
+    orig_stderr = munit_replace_stderr(tc->stderr_buf);
+    munit_test_runner_exec(runner, tc->test, tc->params, &(tc->slot->report), MUNIT_RESULT_SLOT_SAMPLES(tc->slot));
+    tc->slot->status = MUNIT_RESULT_DONE;
 
-  return -1;
-}
+    /* Note that we don't restore stderr.  This is so we can buffer
+     * things written to stderr later on (such as by
+     * asan/tsan/ubsan, valgrind, etc.) */
+    close(orig_stderr);
 
-#endif /* !defined(PSNIP_CLOCK_H) */
+    if (tc->stderr_buf != NULL)
+      fclose(tc->stderr_buf);
 
-static psnip_uint64_t
-munit_clock_get_elapsed(struct PsnipClockTimespec* start, struct PsnipClockTimespec* end) {
-  psnip_uint64_t r = (end->seconds - start->seconds) * PSNIP_CLOCK_NSEC_PER_SEC;
-  if (end->nanoseconds < start->nanoseconds) {
-    r -= (start->nanoseconds - end->nanoseconds);
+    exit(EXIT_SUCCESS);
+  } else if (fork_pid == -1) {
+    if (tc->stderr_buf != NULL) {
+      munit_log_errno(MUNIT_LOG_ERROR, stderr, "unable to fork");
+    }
+    tc->report.errored++;
+    tc->done = 1;
   } else {
-    r += (end->nanoseconds - start->nanoseconds);
+    tc->pid = fork_pid;
   }
-  return r;
 }
 
-#else
-#  include <time.h>
-#endif /* defined(MUNIT_ENABLE_TIMING) */
+static munit_bool
+munit_write_all(int fd, const void* buf, size_t len) {
+  const munit_uint8_t* p = (const munit_uint8_t*) buf;
+  ssize_t write_res;
 
-/*** PRNG stuff ***/
+  while (len > 0) {
+    write_res = write(fd, p, len);
+    if (write_res < 0) {
+      if (errno == EINTR)
+        continue;
+      return 0;
+    }
+    p += write_res;
+    len -= (size_t) write_res;
+  }
 
-/* This is (unless I screwed up, which is entirely possible) the
- * version of PCG with 32-bit state.  It was chosen because it has a
- * small enough state that we should reliably be able to use CAS
- * instead of requiring a lock for thread-safety.
- *
- * If I did screw up, I probably will not bother changing it unless
- * there is a significant bias.  It's really not important this be
- * particularly strong, as long as it is fairly random it's much more
- * important that it be reproducible, so bug reports have a better
- * chance of being reproducible. */
+  return 1;
+}
 
-#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L) && !defined(__STDC_NO_ATOMICS__) && !defined(__EMSCRIPTEN__) && (!defined(__GNUC_MINOR__) || (__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ > 8))
-#  define HAVE_STDATOMIC
-#elif defined(__clang__)
-#  if __has_extension(c_atomic)
-#    define HAVE_CLANG_ATOMICS
-#  endif
-#endif
+static munit_bool
+munit_read_all(int fd, void* buf, size_t len) {
+  munit_uint8_t* p = (munit_uint8_t*) buf;
+  ssize_t read_res;
 
-/* Workaround for http://llvm.org/bugs/show_bug.cgi?id=26911 */
-#if defined(__clang__) && defined(_WIN32)
-#  undef HAVE_STDATOMIC
-#  if defined(__c2__)
-#    undef HAVE_CLANG_ATOMICS
-#  endif
-#endif
+  while (len > 0) {
+    read_res = read(fd, p, len);
+    if (read_res < 0 && errno == EINTR)
+      continue;
+    if (read_res < 1)
+      return 0;
+    p += read_res;
+    len -= (size_t) read_res;
+  }
 
-#if defined(_OPENMP)
-#  define ATOMIC_UINT32_T uint32_t
-#  define ATOMIC_UINT32_INIT(x) (x)
-#elif defined(HAVE_STDATOMIC)
-#  include <stdatomic.h>
-#  define ATOMIC_UINT32_T _Atomic uint32_t
-#  define ATOMIC_UINT32_INIT(x) ATOMIC_VAR_INIT(x)
-#elif defined(HAVE_CLANG_ATOMICS)
-#  define ATOMIC_UINT32_T _Atomic uint32_t
-#  define ATOMIC_UINT32_INIT(x) (x)
-#elif defined(_WIN32)
-#  define ATOMIC_UINT32_T volatile LONG
-#  define ATOMIC_UINT32_INIT(x) (x)
-#else
-#  define ATOMIC_UINT32_T volatile uint32_t
-#  define ATOMIC_UINT32_INIT(x) (x)
-#endif
+  return 1;
+}
 
-static ATOMIC_UINT32_T munit_rand_state = ATOMIC_UINT32_INIT(42);
+/* Receive a request from the runner.  Returns false when the runner
+ * has hung up, which means there are no more tests to run. */
+static munit_bool
+munit_worker_receive(int sock, MunitWorkerRequest* req, int* errfd) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } ctl;
+  ssize_t recv_res;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = req;
+  iov.iov_len = sizeof(*req);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
 
-#if defined(_OPENMP)
-static inline void
-munit_atomic_store(ATOMIC_UINT32_T* dest, ATOMIC_UINT32_T value) {
-#pragma omp critical (munit_atomics)
-  *dest = value;
-}
+  do {
+    recv_res = recvmsg(sock, &msg, 0);
+  } while (recv_res < 0 && errno == EINTR);
+  if (recv_res < 1)
+    return 0;
 
-static inline uint32_t
-munit_atomic_load(ATOMIC_UINT32_T* src) {
-  int ret;
-#pragma omp critical (munit_atomics)
-  ret = *src;
-  return ret;
+  *errfd = -1;
+  for (cmsg = CMSG_FIRSTHDR(&msg) ; cmsg != NULL ; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(errfd, CMSG_DATA(cmsg), sizeof(int));
+  }
+
+  if ((size_t) recv_res < sizeof(*req))
+    return munit_read_all(sock, ((munit_uint8_t*) req) + recv_res, sizeof(*req) - (size_t) recv_res);
+
+  return 1;
 }
 
-static inline uint32_t
-munit_atomic_cas(ATOMIC_UINT32_T* dest, ATOMIC_UINT32_T* expected, ATOMIC_UINT32_T desired) {
-  munit_bool ret;
+/* Main loop of a worker process: run test cases until the runner
+ * hangs up.  If a test crashes it takes the worker with it, and the
+ * runner will start a new one. */
+MUNIT_NO_RETURN static void
+munit_worker_main(MunitTestRunner* runner, int sock) {
+  MunitWorkerRequest req;
+  MunitResultSlot* slot;
+  const char c = 0;
+  char* data = NULL;
+  size_t data_size = 0;
+  MunitParameter* params = NULL;
+  size_t params_size = 0;
+  char* p;
+  size_t i;
+  int errfd;
+  const int orig_stderr = dup(STDERR_FILENO);
+
+  while (munit_worker_receive(sock, &req, &errfd)) {
+    if (req.data_l > data_size) {
+      data = realloc(data, req.data_l);
+      if (data == NULL)
+        break;
+      data_size = req.data_l;
+    }
+    if (req.params_l + 1 > params_size) {
+      params = realloc(params, sizeof(MunitParameter) * (req.params_l + 1));
+      if (params == NULL)
+        break;
+      params_size = req.params_l + 1;
+    }
+    if (!munit_read_all(sock, data, req.data_l))
+      break;
 
-#pragma omp critical (munit_atomics)
-  {
-    if (*dest == *expected) {
-      *dest = desired;
-      ret = 1;
-    } else {
-      ret = 0;
+    p = data;
+    for (i = 0 ; i < req.params_l ; i++) {
+      params[i].name = p;
+      p += strlen(p) + 1;
+      params[i].value = p;
+      p += strlen(p) + 1;
+    }
+    params[req.params_l].name = NULL;
+    params[req.params_l].value = NULL;
+
+    if (errfd != -1) {
+      dup2(errfd, STDERR_FILENO);
+      close(errfd);
     }
+
+    slot = MUNIT_RESULT_SLOT(runner, req.slot);
+    munit_test_runner_exec(runner, req.test, req.has_params ? params : NULL, &(slot->report), MUNIT_RESULT_SLOT_SAMPLES(slot));
+    slot->status = MUNIT_RESULT_DONE;
+
+    fflush(stdout);
+    dup2(orig_stderr, STDERR_FILENO);
+
+    /* The report is already in the arena; just let the runner know. */
+    if (!munit_write_all(sock, &c, 1))
+      break;
   }
 
-  return ret;
+  exit(EXIT_SUCCESS);
 }
-#elif defined(HAVE_STDATOMIC)
-#  define munit_atomic_store(dest, value)         atomic_store(dest, value)
-#  define munit_atomic_load(src)                  atomic_load(src)
-#  define munit_atomic_cas(dest, expected, value) atomic_compare_exchange_weak(dest, expected, value)
-#elif defined(HAVE_CLANG_ATOMICS)
-#  define munit_atomic_store(dest, value)         __c11_atomic_store(dest, value, __ATOMIC_SEQ_CST)
-#  define munit_atomic_load(src)                  __c11_atomic_load(src, __ATOMIC_SEQ_CST)
-#  define munit_atomic_cas(dest, expected, value) __c11_atomic_compare_exchange_weak(dest, expected, value, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
-#elif defined(__GNUC__) && (__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7)
-#  define munit_atomic_store(dest, value)         __atomic_store_n(dest, value, __ATOMIC_SEQ_CST)
-#  define munit_atomic_load(src)                  __atomic_load_n(src, __ATOMIC_SEQ_CST)
-#  define munit_atomic_cas(dest, expected, value) __atomic_compare_exchange_n(dest, expected, value, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
-#elif defined(__GNUC__) && (__GNUC__ >= 4)
-#  define munit_atomic_store(dest,value)          do { *(dest) = (value); } while (0)
-#  define munit_atomic_load(src)                  (*(src))
-#  define munit_atomic_cas(dest, expected, value) __sync_bool_compare_and_swap(dest, *expected, value)
-#elif defined(_WIN32) /* Untested */
-#  define munit_atomic_store(dest,value)          do { *(dest) = (value); } while (0)
-#  define munit_atomic_load(src)                  (*(src))
-#  define munit_atomic_cas(dest, expected, value) InterlockedCompareExchange((dest), (value), *(expected))
-#else
-#  warning No atomic implementation, PRNG will not be thread-safe
-#  define munit_atomic_store(dest, value)         do { *(dest) = (value); } while (0)
-#  define munit_atomic_load(src)                  (*(src))
-static inline munit_bool
-munit_atomic_cas(ATOMIC_UINT32_T* dest, ATOMIC_UINT32_T* expected, ATOMIC_UINT32_T desired) {
-  if (*dest == *expected) {
-    *dest = desired;
-    return 1;
-  } else {
+
+static munit_bool
+munit_test_runner_start_worker(MunitTestRunner* runner, MunitWorker* worker) {
+  int sv[2];
+  pid_t fork_pid;
+  unsigned int i;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+    munit_log_errno(MUNIT_LOG_ERROR, stderr, "unable to create socket");
     return 0;
   }
-}
-#endif
 
-#define MUNIT_PRNG_MULTIPLIER (747796405U)
-#define MUNIT_PRNG_INCREMENT  (1729U)
+  munit_test_runner_flush_streams(runner);
+
+  fork_pid = fork();
+  if (fork_pid == 0) {
+    close(sv[0]);
+    munit_test_runner_child_init(runner);
+    /* If we kept these open the other workers would never see the
+     * runner hang up. */
+    for (i = 0 ; i < runner->workers_l ; i++) {
+      if (runner->workers[i].sock != -1)
+        close(runner->workers[i].sock);
+    }
+    munit_worker_main(runner, sv[1]);
+  } else if (fork_pid == -1) {
+    munit_log_errno(MUNIT_LOG_ERROR, stderr, "unable to fork");
+    close(sv[0]);
+    close(sv[1]);
+    return 0;
+  }
 
-static munit_uint32_t
-munit_rand_next_state(munit_uint32_t state) {
-  return state * MUNIT_PRNG_MULTIPLIER + MUNIT_PRNG_INCREMENT;
+  close(sv[1]);
+  worker->pid = fork_pid;
+  worker->sock = sv[0];
+
+  return 1;
 }
 
-static munit_uint32_t
-munit_rand_from_state(munit_uint32_t state) {
-  munit_uint32_t res = ((state >> ((state >> 28) + 4)) ^ state) * (277803737U);
-  res ^= res >> 22;
-  return res;
+static void
+munit_worker_stop(MunitWorker* worker, munit_bool force) {
+  if (worker->pid == 0)
+    return;
+
+  if (force)
+    kill(worker->pid, SIGKILL);
+  close(worker->sock);
+  waitpid(worker->pid, NULL, 0);
+
+  worker->pid = 0;
+  worker->sock = -1;
+  worker->tc = NULL;
 }
 
-void
-munit_rand_seed(munit_uint32_t seed) {
-  munit_uint32_t state = munit_rand_next_state(seed + MUNIT_PRNG_INCREMENT);
-  munit_atomic_store(&munit_rand_state, state);
+static void
+munit_test_runner_stop_workers(MunitTestRunner* runner) {
+  unsigned int i;
+
+  for (i = 0 ; i < runner->workers_l ; i++)
+    munit_worker_stop(&(runner->workers[i]), 0);
 }
 
-static munit_uint32_t
-munit_rand_generate_seed(void) {
-  munit_uint32_t seed, state;
-#if defined(MUNIT_ENABLE_TIMING)
-  struct PsnipClockTimespec wc = { 0, };
+static munit_bool
+munit_worker_send(MunitWorker* worker, MunitTestCase* tc) {
+  MunitWorkerRequest req;
+  const MunitParameter* param;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } ctl;
+  const int errfd = fileno(tc->stderr_buf);
+  int flags = 0;
+  ssize_t send_res;
+
+  memset(&req, 0, sizeof(req));
+  req.test = tc->test;
+  req.has_params = (tc->params != NULL);
+  req.slot = tc->slot->index;
+  for (param = tc->params ; param != NULL && param->name != NULL ; param++) {
+    req.params_l++;
+    req.data_l += strlen(param->name) + strlen(param->value) + 2;
+  }
 
-  psnip_clock_get_time(PSNIP_CLOCK_TYPE_WALL, &wc);
-  seed = (munit_uint32_t) wc.nanoseconds;
-#else
-  seed = (munit_uint32_t) time(NULL);
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &req;
+  iov.iov_len = sizeof(req);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &errfd, sizeof(int));
+
+#if defined(MSG_NOSIGNAL)
+  /* Don't die if the worker has gone away while idle. */
+  flags = MSG_NOSIGNAL;
 #endif
 
-  state = munit_rand_next_state(seed + MUNIT_PRNG_INCREMENT);
-  return munit_rand_from_state(state);
-}
+  do {
+    send_res = sendmsg(worker->sock, &msg, flags);
+  } while (send_res < 0 && errno == EINTR);
+  if (send_res < 0)
+    return 0;
+  if ((size_t) send_res < sizeof(req) &&
+      !munit_write_all(worker->sock, ((munit_uint8_t*) &req) + send_res, sizeof(req) - (size_t) send_res))
+    return 0;
 
-static munit_uint32_t
-munit_rand_state_uint32(munit_uint32_t* state) {
-  const munit_uint32_t old = *state;
-  *state = munit_rand_next_state(old);
-  return munit_rand_from_state(old);
+  for (param = tc->params ; param != NULL && param->name != NULL ; param++) {
+    if (!munit_write_all(worker->sock, param->name, strlen(param->name) + 1) ||
+        !munit_write_all(worker->sock, param->value, strlen(param->value) + 1))
+      return 0;
+  }
+
+  return 1;
 }
 
-munit_uint32_t
-munit_rand_uint32(void) {
-  munit_uint32_t old, state;
+/* Hand the test case to an idle worker, starting a new worker if
+ * necessary. */
+static void
+munit_test_runner_dispatch(MunitTestRunner* runner, MunitTestCase* tc) {
+  MunitWorker* worker = NULL;
+  unsigned int i;
+  int attempt;
+
+  for (i = 0 ; i < runner->workers_l ; i++) {
+    if (runner->workers[i].tc == NULL) {
+      worker = &(runner->workers[i]);
+      break;
+    }
+  }
 
-  do {
-    old = munit_atomic_load(&munit_rand_state);
-    state = munit_rand_next_state(old);
-  } while (!munit_atomic_cas(&munit_rand_state, &old, state));
+  if (MUNIT_LIKELY(worker != NULL)) {
+    /* If an idle worker died, we'll only find out when we try to send
+     * it something, so give it one more try with a fresh worker. */
+    for (attempt = 0 ; attempt < 2 ; attempt++) {
+      if (worker->pid == 0 && !munit_test_runner_start_worker(runner, worker))
+        break;
+
+      if (munit_worker_send(worker, tc)) {
+        worker->tc = tc;
+        tc->worker = worker;
+        tc->pid = worker->pid;
+        return;
+      }
 
-  return munit_rand_from_state(old);
+      munit_worker_stop(worker, 1);
+    }
+  }
+
+  tc->report.errored++;
+  tc->done = 1;
 }
 
+/* Copy the report (and any benchmark samples) out of the arena. */
 static void
-munit_rand_state_memory(munit_uint32_t* state, size_t size, munit_uint8_t data[MUNIT_ARRAY_PARAM(size)]) {
-  size_t members_remaining = size / sizeof(munit_uint32_t);
-  size_t bytes_remaining = size % sizeof(munit_uint32_t);
-  munit_uint8_t* b = data;
-  munit_uint32_t rv;
-  while (members_remaining-- > 0) {
-    rv = munit_rand_state_uint32(state);
-    memcpy(b, &rv, sizeof(munit_uint32_t));
-    b += sizeof(munit_uint32_t);
+munit_test_case_take_report(MunitTestCase* tc) {
+  tc->report = tc->slot->report;
+
+#if defined(MUNIT_ENABLE_TIMING)
+  if (tc->report.bench.samples > 0) {
+    tc->samples = malloc(sizeof(double) * tc->report.bench.samples);
+    if (tc->samples != NULL)
+      memcpy(tc->samples, MUNIT_RESULT_SLOT_SAMPLES(tc->slot), sizeof(double) * tc->report.bench.samples);
   }
-  if (bytes_remaining != 0) {
-    rv = munit_rand_state_uint32(state);
-    memcpy(b, &rv, bytes_remaining);
+#endif
+}
+
+/* Record what happened to a test case whose process has exited (or,
+ * for a worker, died).  status is from waitpid. */
+static void
+munit_test_case_finish(MunitTestCase* tc, int status) {
+  const munit_bool reported = (tc->slot->status == MUNIT_RESULT_DONE);
+
+  if (reported) {
+#if defined(MUNIT_ENABLE_TIMING)
+    const munit_uint64_t wall_clock = tc->report.wall_clock;
+#endif
+    munit_test_case_take_report(tc);
+#if defined(MUNIT_ENABLE_TIMING)
+    if (tc->timed_out)
+      tc->report.wall_clock = wall_clock;
+#endif
+  }
+  munit_test_case_release_slot(tc);
+
+  if (MUNIT_LIKELY(WIFEXITED(status))) {
+    if (!reported) {
+      munit_logf_internal(MUNIT_LOG_ERROR, tc->stderr_buf, "child exited unexpectedly with status %d", WEXITSTATUS(status));
+      tc->report.errored++;
+    } else if (WEXITSTATUS(status) != EXIT_SUCCESS) {
+      munit_logf_internal(MUNIT_LOG_ERROR, tc->stderr_buf, "child exited with status %d", WEXITSTATUS(status));
+      tc->report.errored++;
+    }
+  } else {
+    if (tc->timed_out) {
+#if defined(MUNIT_ENABLE_TIMING)
+      munit_logf_internal(MUNIT_LOG_ERROR, tc->stderr_buf, "test timed out after %0.3f seconds",
+                          ((double) tc->report.wall_clock) / ((double) PSNIP_CLOCK_NSEC_PER_SEC));
+#endif
+    } else if (WIFSIGNALED(status)) {
+#if defined(_XOPEN_VERSION) && (_XOPEN_VERSION >= 700)
+      munit_logf_internal(MUNIT_LOG_ERROR, tc->stderr_buf, "child killed by signal %d (%s)", WTERMSIG(status), strsignal(WTERMSIG(status)));
+#else
+      munit_logf_internal(MUNIT_LOG_ERROR, tc->stderr_buf, "child killed by signal %d", WTERMSIG(status));
+#endif
+    } else if (WIFSTOPPED(status)) {
+      munit_logf_internal(MUNIT_LOG_ERROR, tc->stderr_buf, "child stopped by signal %d", WSTOPSIG(status));
+    }
+    tc->report.errored++;
   }
+
+  /* Otherwise the next child would inherit (and flush) our buffer. */
+  fflush(tc->stderr_buf);
+  tc->done = 1;
 }
 
-void
-munit_rand_memory(size_t size, munit_uint8_t data[MUNIT_ARRAY_PARAM(size)]) {
-  munit_uint32_t old, state;
+/* The worker running the test case has something to say: either the
+ * case is finished, or the worker is gone. */
+static void
+munit_test_case_reap_worker(MunitTestCase* tc) {
+  MunitWorker* worker = tc->worker;
+  char c;
+  ssize_t read_res;
+  int status = 0;
 
   do {
-    state = old = munit_atomic_load(&munit_rand_state);
-    munit_rand_state_memory(&state, size, data);
-  } while (!munit_atomic_cas(&munit_rand_state, &old, state));
-}
+    read_res = read(worker->sock, &c, 1);
+  } while (read_res < 0 && errno == EINTR);
+
+  worker->tc = NULL;
+  if (read_res == 1 && tc->slot->status == MUNIT_RESULT_DONE) {
+    munit_test_case_take_report(tc);
+    munit_test_case_release_slot(tc);
+    tc->done = 1;
+    return;
+  }
 
-static munit_uint32_t
-munit_rand_state_at_most(munit_uint32_t* state, munit_uint32_t salt, munit_uint32_t max) {
-  /* We want (UINT32_MAX + 1) % max, which in unsigned arithmetic is the same
-   * as (UINT32_MAX + 1 - max) % max = -max % max. We compute -max using not
-   * to avoid compiler warnings.
-   */
-  const munit_uint32_t min = (~max + 1U) % max;
-  munit_uint32_t x;
+  /* The test took the worker down with it; a new one will be started
+   * for the next test. */
+  close(worker->sock);
+  waitpid(worker->pid, &status, 0);
+  worker->pid = 0;
+  worker->sock = -1;
 
-  if (max == (~((munit_uint32_t) 0U)))
-    return munit_rand_state_uint32(state) ^ salt;
+  munit_test_case_finish(tc, status);
+}
 
-  max++;
+static void
+munit_test_case_free(MunitTestCase* tc) {
+  munit_test_case_release_slot(tc);
+  if (tc->stderr_buf != NULL)
+    fclose(tc->stderr_buf);
+  free(tc->params);
+  free(tc->test_name);
+  free(tc->name);
+  free(tc->samples);
+  free(tc->key);
+  free(tc);
+}
 
-  do {
-    x = munit_rand_state_uint32(state) ^ salt;
-  } while (x < min);
+/* Kill any running test cases, and forget about the ones which
+ * haven't been reported yet.  Used for --fatal-failures. */
+static void
+munit_test_runner_cancel(MunitTestRunner* runner) {
+  MunitTestCase* tc;
+
+  while (runner->cases != NULL) {
+    tc = runner->cases;
+    runner->cases = tc->next;
+    if (tc->done || tc->pending) {
+      /* Nothing to do */
+    } else if (tc->worker != NULL) {
+      munit_worker_stop(tc->worker, 1);
+    } else {
+      kill(tc->pid, SIGKILL);
+      waitpid(tc->pid, NULL, 0);
+    }
+    munit_test_case_free(tc);
+  }
 
-  return x % max;
+  runner->cases_tail = NULL;
+  runner->cases_running = 0;
+  runner->cases_queued = 0;
 }
 
-static munit_uint32_t
-munit_rand_at_most(munit_uint32_t salt, munit_uint32_t max) {
-  munit_uint32_t old, state;
-  munit_uint32_t retval;
+/* Report every finished test case at the head of the queue. */
+static void
+munit_test_runner_flush(MunitTestRunner* runner) {
+  MunitTestCase* tc;
+
+  while (runner->cases != NULL && runner->cases->done) {
+    tc = runner->cases;
+    runner->cases = tc->next;
+    if (runner->cases == NULL)
+      runner->cases_tail = NULL;
+    runner->cases_queued--;
+
+    if (tc->name != NULL)
+      munit_test_runner_test_start(runner, tc->name, tc->parameterized);
+    if (MUNIT_TEST_RUNNER_PARALLEL(runner))
+      munit_test_runner_case_start(runner, tc->test_name, tc->params);
+    munit_test_runner_report(runner, tc->test, tc->test_name, tc->params, &tc->report, tc->stderr_buf, tc->key, tc->samples);
+#if defined(MUNIT_ENABLE_TIMING)
+    munit_test_runner_scaling_add(runner, tc->params, &tc->report);
+#endif
+#if defined(MUNIT_HAVE_TIMING_DB)
+    munit_timing_db_record(&(runner->timing_db), tc->hash, &tc->report);
+#endif
+    fflush(MUNIT_OUTPUT_FILE);
 
-  do {
-    state = old = munit_atomic_load(&munit_rand_state);
-    retval = munit_rand_state_at_most(&state, salt, max);
-  } while (!munit_atomic_cas(&munit_rand_state, &old, state));
+    munit_test_case_free(tc);
 
-  return retval;
+    if (runner->fatal_failures && (runner->report.failed != 0 || runner->report.errored != 0))
+      munit_test_runner_cancel(runner);
+  }
 }
 
-int
-munit_rand_int_range(int min, int max) {
-  munit_uint64_t range = (munit_uint64_t) max - (munit_uint64_t) min;
+#if defined(MUNIT_ENABLE_TIMING)
+static void
+munit_test_runner_start_clock(MunitTestRunner* runner, MunitTestCase* tc) {
+  const double timeout = (tc->test->timeout > 0) ? tc->test->timeout : runner->timeout;
 
-  if (min > max)
-    return munit_rand_int_range(max, min);
+  tc->started = munit_clock_monotonic_ns();
+  if (timeout > 0)
+    tc->deadline = tc->started + (munit_uint64_t) (timeout * PSNIP_CLOCK_NSEC_PER_SEC);
+}
 
-  if (range > (~((munit_uint32_t) 0U)))
-    range = (~((munit_uint32_t) 0U));
+/* Kill any test cases which have passed their deadline.  Returns how
+ * long poll() should wait for the next deadline, in milliseconds, or
+ * -1 if there is no deadline. */
+static int
+munit_test_runner_check_deadlines(MunitTestRunner* runner) {
+  MunitTestCase* tc;
+  const munit_uint64_t now = munit_clock_monotonic_ns();
+  munit_uint64_t next = 0;
+  munit_uint64_t ms;
+
+  for (tc = runner->cases ; tc != NULL ; tc = tc->next) {
+    if (tc->done || tc->deadline == 0 || tc->timed_out)
+      continue;
+
+    if (now >= tc->deadline) {
+      /* We'll hear about it from SIGCHLD (or the worker's socket
+       * closing) once the child is dead. */
+      kill(tc->pid, SIGKILL);
+      tc->timed_out = 1;
+      tc->report.wall_clock = now - tc->started;
+    } else if (next == 0 || tc->deadline < next) {
+      next = tc->deadline;
+    }
+  }
 
-  return min + munit_rand_at_most(0, (munit_uint32_t) range);
-}
+  if (next == 0)
+    return -1;
 
-double
-munit_rand_double(void) {
-  munit_uint32_t old, state;
-  double retval = 0.0;
+  ms = (next - now + 999999) / 1000000;
+  return (ms > INT_MAX) ? INT_MAX : (int) ms;
+}
+#endif
 
-  do {
-    state = old = munit_atomic_load(&munit_rand_state);
+/* Check whether any test cases running in their own process have
+ * exited.  Returns true if any have. */
+static munit_bool
+munit_test_runner_collect(MunitTestRunner* runner) {
+  MunitTestCase* tc;
+  char buf[64];
+  int status;
+  pid_t changed_pid;
+  munit_bool finished = 0;
+#if defined(MUNIT_HAVE_RUSAGE)
+  struct rusage usage;
+#endif
 
-    /* See http://mumble.net/~campbell/tmp/random_real.c for how to do
-     * this right.  Patches welcome if you feel that this is too
-     * biased. */
-    retval = munit_rand_state_uint32(&state) / ((~((munit_uint32_t) 0U)) + 1.0);
-  } while (!munit_atomic_cas(&munit_rand_state, &old, state));
+  while (read(runner->sigchld_pipe[0], buf, sizeof(buf)) > 0) { }
 
-  return retval;
-}
+  for (tc = runner->cases ; tc != NULL ; tc = tc->next) {
+    if (tc->done || tc->pending || tc->worker != NULL)
+      continue;
 
-/*** Test suite handling ***/
+    status = 0;
+    do {
+#if defined(MUNIT_HAVE_RUSAGE)
+      changed_pid = wait4(tc->pid, &status, WNOHANG, &usage);
+#else
+      changed_pid = waitpid(tc->pid, &status, WNOHANG);
+#endif
+    } while (changed_pid < 0 && errno == EINTR);
 
-typedef struct {
-  unsigned int successful;
-  unsigned int skipped;
-  unsigned int failed;
-  unsigned int errored;
-#if defined(MUNIT_ENABLE_TIMING)
-  munit_uint64_t cpu_clock;
-  munit_uint64_t wall_clock;
+    if (changed_pid == tc->pid) {
+      munit_test_case_finish(tc, status);
+#if defined(MUNIT_HAVE_RUSAGE)
+      munit_usage_set(&(tc->report.usage), &usage);
 #endif
-} MunitReport;
+      runner->cases_running--;
+      finished = 1;
+    }
+  }
 
-typedef struct {
-  const char* prefix;
-  const MunitSuite* suite;
-  const char** tests;
-  munit_uint32_t seed;
-  unsigned int iterations;
-  MunitParameter* parameters;
-  munit_bool single_parameter_mode;
-  void* user_data;
-  MunitReport report;
-  munit_bool colorize;
-  munit_bool fork;
-  munit_bool show_stderr;
-  munit_bool fatal_failures;
-} MunitTestRunner;
+  return finished;
+}
 
-const char*
-munit_parameters_get(const MunitParameter params[], const char* key) {
-  const MunitParameter* param;
+/* Block until at least one running test case finishes. */
+static void
+munit_test_runner_wait(MunitTestRunner* runner) {
+  MunitTestCase* tc;
+  nfds_t nfds;
+  nfds_t i;
+  int poll_res;
+  int poll_timeout = -1;
+  munit_bool finished = 0;
+
+  if (runner->pollfds == NULL) {
+    runner->pollfds = malloc(sizeof(struct pollfd) * (runner->jobs + 1));
+    if (runner->pollfds == NULL) {
+      munit_log_internal(MUNIT_LOG_ERROR, stderr, "failed to allocate memory");
+      exit(EXIT_FAILURE);
+    }
+  }
 
-  for (param = params ; param != NULL && param->name != NULL ; param++)
-    if (strcmp(param->name, key) == 0)
-      return param->value;
-  return NULL;
-}
+  while (!finished && runner->cases_running > 0) {
+    runner->pollfds[0].fd = runner->sigchld_pipe[0];
+    runner->pollfds[0].events = POLLIN;
+    runner->pollfds[0].revents = 0;
+    nfds = 1;
+    for (tc = runner->cases ; tc != NULL ; tc = tc->next) {
+      if (!tc->done && tc->worker != NULL) {
+        runner->pollfds[nfds].fd = tc->worker->sock;
+        runner->pollfds[nfds].events = POLLIN;
+        runner->pollfds[nfds].revents = 0;
+        nfds++;
+      }
+    }
 
 #if defined(MUNIT_ENABLE_TIMING)
-static void
-munit_print_time(FILE* fp, munit_uint64_t nanoseconds) {
-  fprintf(fp, "%" MUNIT_TEST_TIME_FORMAT, ((double) nanoseconds) / ((double) PSNIP_CLOCK_NSEC_PER_SEC));
-}
+    poll_timeout = munit_test_runner_check_deadlines(runner);
 #endif
 
-/* Add a paramter to an array of parameters. */
-static MunitResult
-munit_parameters_add(size_t* params_size, MunitParameter* params[MUNIT_ARRAY_PARAM(*params_size)], char* name, char* value) {
-  *params = realloc(*params, sizeof(MunitParameter) * (*params_size + 2));
-  if (*params == NULL)
-    return MUNIT_ERROR;
+    poll_res = poll(runner->pollfds, nfds, poll_timeout);
+    if (poll_res < 0) {
+      if (errno == EINTR)
+        continue;
+      munit_log_errno(MUNIT_LOG_ERROR, stderr, "unable to wait for child processes");
+      exit(EXIT_FAILURE);
+    }
 
-  (*params)[*params_size].name = name;
-  (*params)[*params_size].value = value;
-  (*params_size)++;
-  (*params)[*params_size].name = NULL;
-  (*params)[*params_size].value = NULL;
+    if (runner->pollfds[0].revents != 0 && munit_test_runner_collect(runner))
+      finished = 1;
 
-  return MUNIT_OK;
+    i = 1;
+    for (tc = runner->cases ; tc != NULL && i < nfds ; tc = tc->next) {
+      if (tc->done || tc->worker == NULL)
+        continue;
+      if (runner->pollfds[i++].revents != 0) {
+        munit_test_case_reap_worker(tc);
+        runner->cases_running--;
+        finished = 1;
+      }
+    }
+  }
 }
 
-/* Concatenate two strings, but just return one of the components
- * unaltered if the other is NULL or "". */
-static char*
-munit_maybe_concat(size_t* len, char* prefix, char* suffix) {
-  char* res;
-  size_t res_l;
-  const size_t prefix_l = prefix != NULL ? strlen(prefix) : 0;
-  const size_t suffix_l = suffix != NULL ? strlen(suffix) : 0;
-  if (prefix_l == 0 && suffix_l == 0) {
-    res = NULL;
-    res_l = 0;
-  } else if (prefix_l == 0 && suffix_l != 0) {
-    res = suffix;
-    res_l = suffix_l;
-  } else if (prefix_l != 0 && suffix_l == 0) {
-    res = prefix;
-    res_l = prefix_l;
+/* Start a queued test case. */
+static void
+munit_test_runner_start(MunitTestRunner* runner, MunitTestCase* tc) {
+  tc->pending = 0;
+  tc->stderr_buf = munit_stderr_buf_new();
+  tc->slot = munit_test_runner_acquire_slot(runner);
+  if (tc->stderr_buf == NULL || tc->slot == NULL) {
+    tc->report.errored++;
+    tc->done = 1;
+    return;
+  }
+
+  if (runner->fork_server)
+    munit_test_runner_dispatch(runner, tc);
+  else
+    munit_test_runner_spawn(runner, tc);
+  if (tc->done) {
+    munit_test_case_release_slot(tc);
   } else {
-    res_l = prefix_l + suffix_l;
-    res = malloc(res_l + 1);
-    memcpy(res, prefix, prefix_l);
-    memcpy(res + prefix_l, suffix, suffix_l);
-    res[res_l] = 0;
+    runner->cases_running++;
+#if defined(MUNIT_ENABLE_TIMING)
+    munit_test_runner_start_clock(runner, tc);
+#endif
   }
+}
 
-  if (len != NULL)
-    *len = res_l;
+/* Start queued test cases until every job is busy.  They're started
+ * in order, unless we have a timing database, in which case the
+ * slowest go first so we aren't left waiting on one long test at the
+ * end. */
+static void
+munit_test_runner_start_pending(MunitTestRunner* runner) {
+  MunitTestCase* tc;
+  MunitTestCase* next;
+
+  while (runner->cases_running < runner->jobs) {
+    next = NULL;
+    for (tc = runner->cases ; tc != NULL ; tc = tc->next) {
+      if (!tc->pending)
+        continue;
+#if defined(MUNIT_HAVE_TIMING_DB)
+      if (next == NULL || tc->expected > next->expected)
+        next = tc;
+#else
+      next = tc;
+      break;
+#endif
+    }
 
-  return res;
+    if (next == NULL)
+      break;
+    munit_test_runner_start(runner, next);
+  }
 }
 
-/* Possbily free a string returned by munit_maybe_concat. */
+/* Wait for all running test cases, and report them. */
 static void
-munit_maybe_free_concat(char* s, const char* prefix, const char* suffix) {
-  if (prefix != s && suffix != s)
-    free(s);
+munit_test_runner_drain(MunitTestRunner* runner) {
+  while (runner->cases != NULL) {
+    munit_test_runner_start_pending(runner);
+    munit_test_runner_wait(runner);
+    munit_test_runner_flush(runner);
+  }
 }
 
-/* Cheap string hash function, just used to salt the PRNG. */
-static munit_uint32_t
-munit_str_hash(const char* name) {
-  const char *p;
-  munit_uint32_t h = 5381U;
+/* Add a test case to the queue, first waiting for room if necessary,
+ * and start it if there's a free job slot. */
+static void
+munit_test_runner_queue(MunitTestRunner* runner, const MunitTest* test, const MunitParameter params[]) {
+  MunitTestCase* tc;
+  unsigned int backlog = MUNIT_JOBS_BACKLOG;
 
-  for (p = name; *p != '\0'; p++)
-    h = (h << 5) + h + *p;
+#if defined(MUNIT_HAVE_TIMING_DB)
+  if (runner->timing_db.header != NULL)
+    backlog = MUNIT_JOBS_LOOKAHEAD;
+#endif
 
-  return h;
-}
+  while (runner->cases_queued >= runner->jobs * backlog) {
+    munit_test_runner_start_pending(runner);
+    munit_test_runner_wait(runner);
+    munit_test_runner_flush(runner);
+  }
 
-static void
-munit_splice(int from, int to) {
-  munit_uint8_t buf[1024];
-#if !defined(_WIN32)
-  ssize_t len;
-  ssize_t bytes_written;
-  ssize_t write_res;
-#else
-  int len;
-  int bytes_written;
-  int write_res;
+  if (runner->fatal_failures && (runner->report.failed != 0 || runner->report.errored != 0))
+    return;
+
+  tc = calloc(1, sizeof(MunitTestCase));
+  if (tc == NULL) {
+    munit_log_internal(MUNIT_LOG_ERROR, stderr, "failed to allocate memory");
+    exit(EXIT_FAILURE);
+  }
+  tc->test = test;
+
+  if (runner->pending_name != NULL) {
+    tc->name = strdup(runner->pending_name);
+    tc->parameterized = runner->pending_name_parameterized;
+    runner->pending_name = NULL;
+  }
+
+  tc->test_name = strdup(runner->test_name);
+  tc->params = munit_parameters_copy(params);
+#if defined(MUNIT_ENABLE_TIMING)
+  if (runner->baseline != NULL || runner->baseline_out != NULL)
+    tc->key = munit_baseline_key(runner->test_name, params);
 #endif
-  do {
-    len = read(from, buf, sizeof(buf));
-    if (len > 0) {
-      bytes_written = 0;
-      do {
-        write_res = write(to, buf + bytes_written, len - bytes_written);
-        if (write_res < 0)
-          break;
-        bytes_written += write_res;
-      } while (bytes_written < len);
-    }
-    else
-      break;
-  } while (1);
+#if defined(MUNIT_HAVE_TIMING_DB)
+  if (runner->timing_db.fd >= 0) {
+    tc->hash = munit_timing_db_hash(runner->test_name, params);
+    tc->expected = munit_timing_db_expected(&(runner->timing_db), tc->hash);
+  }
+#endif
+  if ((params != NULL && tc->params == NULL) || tc->test_name == NULL) {
+    tc->report.errored++;
+    tc->done = 1;
+  } else {
+    tc->pending = 1;
+  }
+
+  if (runner->cases_tail != NULL)
+    runner->cases_tail->next = tc;
+  else
+    runner->cases = tc;
+  runner->cases_tail = tc;
+  runner->cases_queued++;
+
+  munit_test_runner_start_pending(runner);
+  munit_test_runner_flush(runner);
 }
 
-/* This is the part that should be handled in the child process */
-static MunitResult
-munit_test_runner_exec(MunitTestRunner* runner, const MunitTest* test, const MunitParameter params[], MunitReport* report) {
-  unsigned int iterations = runner->iterations;
-  MunitResult result = MUNIT_FAIL;
+/* Run a test case once, in a child process, with its at-th allocation
+ * failing.  Returns false if we didn't hear back from the child, in
+ * which case status says why; if the child ran past the test's
+ * timeout it is killed and timed_out is set. */
+static munit_bool
+munit_test_runner_fail_alloc_run(MunitTestRunner* runner, const MunitTest* test, const MunitParameter params[],
+                                 unsigned long at, FILE* stderr_buf, MunitFailAllocRun* run, int* status, munit_bool* timed_out) {
+  int fds[2];
+  pid_t fork_pid;
+  pid_t changed_pid;
+  MunitFailAllocRun msg;
 #if defined(MUNIT_ENABLE_TIMING)
-  struct PsnipClockTimespec wall_clock_begin = { 0, }, wall_clock_end = { 0, };
-  struct PsnipClockTimespec cpu_clock_begin = { 0, }, cpu_clock_end = { 0, };
+  const double timeout = (test->timeout > 0) ? test->timeout : runner->timeout;
+  munit_uint64_t deadline = 0;
+  munit_uint64_t now;
+  munit_uint64_t ms;
+  struct pollfd pfd;
+  int poll_res;
 #endif
-  unsigned int i = 0;
 
-  if ((test->options & MUNIT_TEST_OPTION_SINGLE_ITERATION) == MUNIT_TEST_OPTION_SINGLE_ITERATION)
-    iterations = 1;
-  else if (iterations == 0)
-    iterations = runner->suite->iterations;
+  if (pipe(fds) != 0) {
+    munit_log_errno(MUNIT_LOG_ERROR, stderr, "unable to create pipe");
+    return 0;
+  }
 
-  munit_rand_seed(runner->seed);
+  munit_test_runner_flush_streams(runner);
 
-  do {
-    void* data = (test->setup == NULL) ? runner->user_data : test->setup(params, runner->user_data);
+  fork_pid = fork();
+  if (fork_pid == 0) {
+    MunitReport report;
+    volatile MunitResult result = MUNIT_ERROR;
+    volatile int orig_stderr;
 
-#if defined(MUNIT_ENABLE_TIMING)
-    psnip_clock_get_time(PSNIP_CLOCK_TYPE_WALL, &wall_clock_begin);
-    psnip_clock_get_time(PSNIP_CLOCK_TYPE_CPU, &cpu_clock_begin);
-#endif
+    munit_test_runner_child_init(runner);
+    close(fds[0]);
 
-    result = test->test(params, data);
+    orig_stderr = munit_replace_stderr(stderr_buf);
+    memset(&report, 0, sizeof(report));
+    munit_rand_seed(runner->seed);
+    munit_fail_alloc.at = at;
+    munit_fail_alloc.fd = fds[1];
+    munit_parameters_index(params);
 
-#if defined(MUNIT_ENABLE_TIMING)
-    psnip_clock_get_time(PSNIP_CLOCK_TYPE_WALL, &wall_clock_end);
-    psnip_clock_get_time(PSNIP_CLOCK_TYPE_CPU, &cpu_clock_end);
+    /* Failed assertions would otherwise abort(), which we couldn't
+     * tell apart from a crash. */
+#if defined(MUNIT_THREAD_LOCAL)
+    switch (setjmp(munit_error_jmp_buf)) {
+      case 0:
+        munit_error_jmp_buf_valid = 1;
+        result = munit_test_runner_exec_once(runner, test, params, &report);
+        break;
+      case MUNIT_ERROR_JMP_ERROR:
+        result = MUNIT_ERROR;
+        break;
+      default:
+        result = MUNIT_FAIL;
+        break;
+    }
+    munit_error_jmp_buf_valid = 0;
+    munit_fail_alloc.active = 0;
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+    munit_alloc_active_reset(0);
+#endif
+#else
+    result = munit_test_runner_exec_once(runner, test, params, &report);
 #endif
 
-    if (test->tear_down != NULL)
-      test->tear_down(data);
+    munit_fail_alloc.run.done = 1;
+    munit_fail_alloc.run.result = result;
+    munit_write_all(fds[1], &(munit_fail_alloc.run), sizeof(MunitFailAllocRun));
+
+    close(orig_stderr);
+    if (stderr_buf != NULL)
+      fclose(stderr_buf);
+
+    exit(EXIT_SUCCESS);
+  }
+
+  close(fds[1]);
+  if (fork_pid == -1) {
+    munit_log_errno(MUNIT_LOG_ERROR, stderr, "unable to fork");
+    close(fds[0]);
+    *status = 0;
+    return 0;
+  }
 
-    if (MUNIT_LIKELY(result == MUNIT_OK)) {
-      report->successful++;
 #if defined(MUNIT_ENABLE_TIMING)
-      report->wall_clock += munit_clock_get_elapsed(&wall_clock_begin, &wall_clock_end);
-      report->cpu_clock += munit_clock_get_elapsed(&cpu_clock_begin, &cpu_clock_end);
+  if (timeout > 0)
+    deadline = munit_clock_monotonic_ns() + (munit_uint64_t) (timeout * PSNIP_CLOCK_NSEC_PER_SEC);
+#else
+  (void) timed_out;
 #endif
-    } else {
-      switch ((int) result) {
-        case MUNIT_SKIP:
-          report->skipped++;
-          break;
-        case MUNIT_FAIL:
-          report->failed++;
-          break;
-        case MUNIT_ERROR:
-          report->errored++;
-          break;
-        default:
-          break;
+
+  while (1) {
+#if defined(MUNIT_ENABLE_TIMING)
+    /* The child writes each message with a single write() smaller
+     * than PIPE_BUF, so once the pipe is readable the whole message
+     * is there. */
+    if (deadline != 0) {
+      now = munit_clock_monotonic_ns();
+      if (now >= deadline) {
+        kill(fork_pid, SIGKILL);
+        *timed_out = 1;
+        break;
       }
-      break;
+
+      ms = (deadline - now + 999999) / 1000000;
+      pfd.fd = fds[0];
+      pfd.events = POLLIN;
+      poll_res = poll(&pfd, 1, (ms > INT_MAX) ? INT_MAX : (int) ms);
+      if (poll_res == 0 || (poll_res < 0 && errno == EINTR))
+        continue;
     }
-  } while (++i < iterations);
+#endif
+    if (!munit_read_all(fds[0], &msg, sizeof(MunitFailAllocRun)))
+      break;
+    *run = msg;
+  }
+  close(fds[0]);
 
-  return result;
-}
+  do {
+    changed_pid = waitpid(fork_pid, status, 0);
+  } while (changed_pid < 0 && errno == EINTR);
 
-#if defined(MUNIT_EMOTICON)
-#  define MUNIT_RESULT_STRING_OK    ":)"
-#  define MUNIT_RESULT_STRING_SKIP  ":|"
-#  define MUNIT_RESULT_STRING_FAIL  ":("
-#  define MUNIT_RESULT_STRING_ERROR ":o"
-#  define MUNIT_RESULT_STRING_TODO  ":/"
-#else
-#  define MUNIT_RESULT_STRING_OK    "OK   "
-#  define MUNIT_RESULT_STRING_SKIP  "SKIP "
-#  define MUNIT_RESULT_STRING_FAIL  "FAIL "
-#  define MUNIT_RESULT_STRING_ERROR "ERROR"
-#  define MUNIT_RESULT_STRING_TODO  "TODO "
-#endif
+  return run->done && WIFEXITED(*status) && WEXITSTATUS(*status) == EXIT_SUCCESS;
+}
 
 static void
-munit_test_runner_print_color(const MunitTestRunner* runner, const char* string, char color) {
-  if (runner->colorize)
-    fprintf(MUNIT_OUTPUT_FILE, "\x1b[3%cm%s\x1b[39m", color, string);
-  else
-    fputs(string, MUNIT_OUTPUT_FILE);
+munit_fail_alloc_site_init(MunitReporterFailAlloc* fa, const MunitTestRunner* runner, const MunitParameter params[],
+                           unsigned long at, const MunitFailAllocRun* run) {
+  memset(fa, 0, sizeof(*fa));
+  fa->test_name = runner->test_name;
+  fa->params = params;
+  fa->at = at;
+  fa->file = run->file;
+  fa->line = run->line;
+  fa->caller = run->caller;
+  fa->result = (MunitResult) run->result;
 }
 
-#if !defined(MUNIT_NO_BUFFER)
-static int
-munit_replace_stderr(FILE* stderr_buf) {
-  if (stderr_buf != NULL) {
-    const int orig_stderr = dup(STDERR_FILENO);
+/* Rerun a test case with its first allocation failing, then its
+ * second, and so on until it gets through without making that many
+ * allocations (--fail-alloc).  Runs which fail or crash are reported,
+ * followed by a summary. */
+static void
+munit_test_runner_fail_alloc_sweep(MunitTestRunner* runner, const MunitTest* test, const MunitParameter params[]) {
+  MunitFailAllocRun run;
+  MunitReporterFailAlloc fa;
+  MunitReporterFailAllocSweep sweep;
+  FILE* stderr_buf;
+  unsigned long at;
+  unsigned int handled = 0;
+  unsigned int failed = 0;
+  unsigned int crashed = 0;
+  munit_bool timed_out;
+  int status;
+
+  stderr_buf = munit_stderr_buf_new();
+  if (stderr_buf == NULL)
+    return;
 
-    int errfd = fileno(stderr_buf);
-    if (MUNIT_UNLIKELY(errfd == -1)) {
-      exit(EXIT_FAILURE);
+  for (at = 1 ; at <= MUNIT_FAIL_ALLOC_LIMIT ; at++) {
+    memset(&run, 0, sizeof(run));
+    status = 0;
+    timed_out = 0;
+    rewind(stderr_buf);
+    if (ftruncate(fileno(stderr_buf), 0) != 0)
+      break;
+
+    if (!munit_test_runner_fail_alloc_run(runner, test, params, at, stderr_buf, &run, &status, &timed_out)) {
+      if (status == 0)
+        break;
+
+      /* A crash before reaching the allocation isn't our doing; the
+       * test would have crashed anyway. */
+      if (!run.hit)
+        break;
+
+      munit_fail_alloc_site_init(&fa, runner, params, at, &run);
+      fa.crashed = 1;
+      fa.timed_out = timed_out;
+      if (WIFSIGNALED(status))
+        fa.signal = WTERMSIG(status);
+      else
+        fa.exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+      fa.result = MUNIT_ERROR;
+      fa.stderr_buf = stderr_buf;
+      munit_test_runner_report_fail_alloc(runner, &fa);
+      crashed++;
+      continue;
     }
 
-    dup2(errfd, STDERR_FILENO);
+    if (!run.hit)
+      break;
 
-    return orig_stderr;
+    if (run.result == MUNIT_OK || run.result == MUNIT_SKIP) {
+      handled++;
+    } else {
+      munit_fail_alloc_site_init(&fa, runner, params, at, &run);
+      if (fa.result != MUNIT_FAIL)
+        fa.result = MUNIT_ERROR;
+      munit_test_runner_report_fail_alloc(runner, &fa);
+      failed++;
+    }
   }
 
-  return -1;
+  sweep.test_name = runner->test_name;
+  sweep.params = params;
+  sweep.allocations = at - 1;
+  sweep.handled = handled;
+  sweep.failed = failed;
+  sweep.crashed = crashed;
+  munit_test_runner_report_fail_alloc_sweep(runner, &sweep);
+
+  runner->fail_alloc_crashes += crashed;
+  fclose(stderr_buf);
 }
+#endif /* !defined(MUNIT_NO_FORK) */
 
-static void
-munit_restore_stderr(int orig_stderr) {
-  if (orig_stderr != -1) {
-    dup2(orig_stderr, STDERR_FILENO);
-    close(orig_stderr);
+/* Decide what to do with the next test case when sharding.  While
+ * counting it is recorded, while listing its shard is printed, and
+ * while running this returns whether it belongs to our shard. */
+static munit_bool
+munit_test_runner_shard_case(MunitTestRunner* runner, const MunitParameter params[]) {
+  MunitShardPlan* shard = &(runner->shard);
+  MunitShardCase* cases;
+#if defined(MUNIT_ENABLE_TIMING)
+  const MunitBaselineEntry* entry;
+  char* key;
+#endif
+
+  switch (shard->mode) {
+    case MUNIT_SHARD_COUNT:
+      if (shard->cases_l == shard->cases_size) {
+        cases = realloc(shard->cases, sizeof(MunitShardCase) * (shard->cases_size + 256));
+        if (cases == NULL)
+          return 0;
+        shard->cases = cases;
+        shard->cases_size += 256;
+      }
+      shard->cases[shard->cases_l].test = shard->next_test - 1;
+      shard->cases[shard->cases_l].shard = 0;
+      shard->cases[shard->cases_l].weight = -1;
+#if defined(MUNIT_ENABLE_TIMING)
+      if (shard->timings_l != 0) {
+        key = munit_baseline_key(runner->test_name, params);
+        entry = (key != NULL) ? munit_baseline_find(shard->timings, shard->timings_l, key) : NULL;
+        if (entry != NULL && entry->samples_l != 0)
+          shard->cases[shard->cases_l].weight = munit_median(entry->samples, entry->samples_l);
+        free(key);
+      }
+#endif
+#if defined(MUNIT_HAVE_TIMING_DB)
+      shard->cases[shard->cases_l].expected = 0;
+      if (runner->timing_db.header != NULL) {
+        shard->cases[shard->cases_l].expected =
+          munit_timing_db_expected(&(runner->timing_db), munit_timing_db_hash(runner->test_name, params));
+        /* --shard-timings wins, if it was given. */
+        if (shard->timings_l == 0 && shard->cases[shard->cases_l].expected != 0)
+          shard->cases[shard->cases_l].weight = (double) shard->cases[shard->cases_l].expected;
+      }
+#endif
+      shard->cases_l++;
+      return 0;
+    case MUNIT_SHARD_LIST:
+      munit_test_runner_report_shard_case(runner, params, (shard->next_case < shard->cases_l) ? &(shard->cases[shard->next_case++]) : NULL);
+      return 0;
+    case MUNIT_SHARD_RUN:
+      return shard->next_case < shard->cases_l && shard->cases[shard->next_case++].shard == shard->index;
+    case MUNIT_SHARD_NONE:
+    default:
+      return 1;
   }
 }
-#endif /* !defined(MUNIT_NO_BUFFER) */
+
+/* Whether any of the cases of the next test are in our shard.  If
+ * not, skip past them.  Tests which turned out to have no cases at
+ * all (because their parameters are broken, for example) are left to
+ * the first shard, so they're still reported once. */
+static munit_bool
+munit_test_runner_shard_test(MunitTestRunner* runner) {
+  MunitShardPlan* shard = &(runner->shard);
+  const size_t test = shard->next_test++;
+  size_t i;
+
+  if (shard->mode != MUNIT_SHARD_RUN)
+    return 1;
+
+  if (shard->next_case >= shard->cases_l || shard->cases[shard->next_case].test != test)
+    return shard->index == 0;
+
+  for (i = shard->next_case ; i < shard->cases_l && shard->cases[i].test == test ; i++) {
+    if (shard->cases[i].shard == shard->index)
+      return 1;
+  }
+
+  shard->next_case = i;
+  return 0;
+}
 
 /* Run a test with the specified parameters. */
 static void
 munit_test_runner_run_test_with_params(MunitTestRunner* runner, const MunitTest* test, const MunitParameter params[]) {
-  MunitResult result = MUNIT_OK;
   MunitReport report = {
     0, 0, 0, 0,
 #if defined(MUNIT_ENABLE_TIMING)
-    0, 0
+    0, 0, { 0, 0, 0, 0, 0, 0, 0, 0 },
 #endif
-  };
-  unsigned int output_l;
-  munit_bool first;
-  const MunitParameter* param;
-  FILE* stderr_buf;
-#if !defined(MUNIT_NO_FORK)
-  int pipefd[2];
-  pid_t fork_pid;
-  int orig_stderr;
-  ssize_t bytes_written = 0;
-  ssize_t write_res;
-  ssize_t bytes_read = 0;
-  ssize_t read_res;
-  int status = 0;
-  pid_t changed_pid;
+#if defined(MUNIT_HAVE_PERF_EVENTS)
+    { 0, { 0, 0, 0, 0, 0 } },
+#endif
+#if defined(MUNIT_HAVE_RUSAGE)
+    { 0, 0, 0, 0, 0, 0 },
 #endif
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+    { 0, 0, 0 },
+#endif
+  };
+  FILE* volatile stderr_buf;
+  double* volatile samples = NULL;
+  char* volatile key = NULL;
 
-  if (params != NULL) {
-    output_l = 2;
-    fputs("  ", MUNIT_OUTPUT_FILE);
-    first = 1;
-    for (param = params ; param != NULL && param->name != NULL ; param++) {
-      if (!first) {
-        fputs(", ", MUNIT_OUTPUT_FILE);
-        output_l += 2;
-      } else {
-        first = 0;
-      }
+  if (runner->shard.mode != MUNIT_SHARD_NONE && !munit_test_runner_shard_case(runner, params))
+    return;
 
-      output_l += fprintf(MUNIT_OUTPUT_FILE, "%s=%s", param->name, param->value);
-    }
-    while (output_l++ < MUNIT_TEST_NAME_LEN) {
-      fputc(' ', MUNIT_OUTPUT_FILE);
-    }
-  }
+  if (!MUNIT_TEST_RUNNER_PARALLEL(runner))
+    munit_test_runner_case_start(runner, runner->test_name, params);
 
   fflush(MUNIT_OUTPUT_FILE);
 
-  stderr_buf = NULL;
-#if !defined(_WIN32) || defined(__MINGW32__)
-  stderr_buf = tmpfile();
-#else
-  tmpfile_s(&stderr_buf);
-#endif
-  if (stderr_buf == NULL) {
-    munit_log_errno(MUNIT_LOG_ERROR, stderr, "unable to create buffer for stderr");
-    result = MUNIT_ERROR;
-    goto print_result;
-  }
-
 #if !defined(MUNIT_NO_FORK)
   if (runner->fork) {
-    pipefd[0] = -1;
-    pipefd[1] = -1;
-    if (pipe(pipefd) != 0) {
-      munit_log_errno(MUNIT_LOG_ERROR, stderr, "unable to create pipe");
-      result = MUNIT_ERROR;
-      goto print_result;
-    }
-
-    fork_pid = fork();
-    if (fork_pid == 0) {
-      close(pipefd[0]);
-
-      orig_stderr = munit_replace_stderr(stderr_buf);
-      munit_test_runner_exec(runner, test, params, &report);
-
-      /* Note that we don't restore stderr.  This is so we can buffer
-       * things written to stderr later on (such as by
-       * asan/tsan/ubsan, valgrind, etc.) */
-      close(orig_stderr);
-
-      do {
-        write_res = write(pipefd[1], ((munit_uint8_t*) (&report)) + bytes_written, sizeof(report) - bytes_written);
-        if (write_res < 0) {
-          if (stderr_buf != NULL) {
-            munit_log_errno(MUNIT_LOG_ERROR, stderr, "unable to write to pipe");
-          }
-          exit(EXIT_FAILURE);
-        }
-        bytes_written += write_res;
-      } while ((size_t) bytes_written < sizeof(report));
-
-      if (stderr_buf != NULL)
-        fclose(stderr_buf);
-      close(pipefd[1]);
-
-      exit(EXIT_SUCCESS);
-    } else if (fork_pid == -1) {
-      close(pipefd[0]);
-      close(pipefd[1]);
-      if (stderr_buf != NULL) {
-        munit_log_errno(MUNIT_LOG_ERROR, stderr, "unable to fork");
-      }
-      report.errored++;
-      result = MUNIT_ERROR;
-    } else {
-      close(pipefd[1]);
-      do {
-        read_res = read(pipefd[0], ((munit_uint8_t*) (&report)) + bytes_read, sizeof(report) - bytes_read);
-        if (read_res < 1)
-          break;
-        bytes_read += read_res;
-      } while (bytes_read < (ssize_t) sizeof(report));
-
-      changed_pid = waitpid(fork_pid, &status, 0);
-
-      if (MUNIT_LIKELY(changed_pid == fork_pid) && MUNIT_LIKELY(WIFEXITED(status))) {
-        if (bytes_read != sizeof(report)) {
-          munit_logf_internal(MUNIT_LOG_ERROR, stderr_buf, "child exited unexpectedly with status %d", WEXITSTATUS(status));
-          report.errored++;
-        } else if (WEXITSTATUS(status) != EXIT_SUCCESS) {
-          munit_logf_internal(MUNIT_LOG_ERROR, stderr_buf, "child exited with status %d", WEXITSTATUS(status));
-          report.errored++;
-        }
-      } else {
-        if (WIFSIGNALED(status)) {
-#if defined(_XOPEN_VERSION) && (_XOPEN_VERSION >= 700)
-          munit_logf_internal(MUNIT_LOG_ERROR, stderr_buf, "child killed by signal %d (%s)", WTERMSIG(status), strsignal(WTERMSIG(status)));
-#else
-          munit_logf_internal(MUNIT_LOG_ERROR, stderr_buf, "child killed by signal %d", WTERMSIG(status));
+    munit_test_runner_queue(runner, test, params);
+    if (!MUNIT_TEST_RUNNER_PARALLEL(runner))
+      munit_test_runner_drain(runner);
+    if (munit_fail_alloc.mode != MUNIT_FAIL_ALLOC_NONE)
+      munit_test_runner_fail_alloc_sweep(runner, test, params);
+    return;
+  }
 #endif
-        } else if (WIFSTOPPED(status)) {
-          munit_logf_internal(MUNIT_LOG_ERROR, stderr_buf, "child stopped by signal %d", WSTOPSIG(status));
-        }
-        report.errored++;
-      }
 
-      close(pipefd[0]);
-      waitpid(fork_pid, NULL, 0);
-    }
-  } else
+#if defined(MUNIT_ENABLE_TIMING)
+  if (runner->benchmark)
+    samples = malloc(sizeof(double) * runner->bench_samples);
+  if (runner->baseline != NULL || runner->baseline_out != NULL)
+    key = munit_baseline_key(runner->test_name, params);
 #endif
+
+  stderr_buf = munit_stderr_buf_new();
+  if (stderr_buf == NULL)
+    goto print_result;
+
   {
 #if !defined(MUNIT_NO_BUFFER)
     const volatile int orig_stderr = munit_replace_stderr(stderr_buf);
 #endif
 
 #if defined(MUNIT_THREAD_LOCAL)
-    if (MUNIT_UNLIKELY(setjmp(munit_error_jmp_buf) != 0)) {
-      result = MUNIT_FAIL;
-      report.failed++;
-    } else {
-      munit_error_jmp_buf_valid = 1;
-      result = munit_test_runner_exec(runner, test, params, &report);
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+    const int alloc_active = munit_alloc_active_get();
+#endif
+
+    switch (setjmp(munit_error_jmp_buf)) {
+      case 0:
+        munit_error_jmp_buf_valid = 1;
+        munit_test_runner_exec(runner, test, params, &report, samples);
+        break;
+      case MUNIT_ERROR_JMP_ERROR:
+        report.errored++;
+        break;
+      default:
+        report.failed++;
+        break;
     }
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+    munit_alloc_active_reset(alloc_active);
+#endif
 #else
-    result = munit_test_runner_exec(runner, test, params, &report);
+    munit_test_runner_exec(runner, test, params, &report, samples);
 #endif
 
 #if !defined(MUNIT_NO_BUFFER)
     munit_restore_stderr(orig_stderr);
 #endif
-
-    /* Here just so that the label is used on Windows and we don't get
-     * a warning */
-    goto print_result;
   }
 
  print_result:
 
-  fputs("[ ", MUNIT_OUTPUT_FILE);
-  if ((test->options & MUNIT_TEST_OPTION_TODO) == MUNIT_TEST_OPTION_TODO) {
-    if (report.failed != 0 || report.errored != 0 || report.skipped != 0) {
-      munit_test_runner_print_color(runner, MUNIT_RESULT_STRING_TODO, '3');
-      result = MUNIT_OK;
-    } else {
-      munit_test_runner_print_color(runner, MUNIT_RESULT_STRING_ERROR, '1');
-      if (MUNIT_LIKELY(stderr_buf != NULL))
-        munit_log_internal(MUNIT_LOG_ERROR, stderr_buf, "Test marked TODO, but was successful.");
-      runner->report.failed++;
-      result = MUNIT_ERROR;
-    }
-  } else if (report.failed > 0) {
-    munit_test_runner_print_color(runner, MUNIT_RESULT_STRING_FAIL, '1');
-    runner->report.failed++;
-    result = MUNIT_FAIL;
-  } else if (report.errored > 0) {
-    munit_test_runner_print_color(runner, MUNIT_RESULT_STRING_ERROR, '1');
-    runner->report.errored++;
-    result = MUNIT_ERROR;
-  } else if (report.skipped > 0) {
-    munit_test_runner_print_color(runner, MUNIT_RESULT_STRING_SKIP, '3');
-    runner->report.skipped++;
-    result = MUNIT_SKIP;
-  } else if (report.successful > 1) {
-    munit_test_runner_print_color(runner, MUNIT_RESULT_STRING_OK, '2');
+  munit_test_runner_report(runner, test, runner->test_name, params, &report, stderr_buf, key, samples);
 #if defined(MUNIT_ENABLE_TIMING)
-    fputs(" ] [ ", MUNIT_OUTPUT_FILE);
-    munit_print_time(MUNIT_OUTPUT_FILE, report.wall_clock / report.successful);
-    fputs(" / ", MUNIT_OUTPUT_FILE);
-    munit_print_time(MUNIT_OUTPUT_FILE, report.cpu_clock / report.successful);
-    fprintf(MUNIT_OUTPUT_FILE, " CPU ]\n  %-" MUNIT_XSTRINGIFY(MUNIT_TEST_NAME_LEN) "s Total: [ ", "");
-    munit_print_time(MUNIT_OUTPUT_FILE, report.wall_clock);
-    fputs(" / ", MUNIT_OUTPUT_FILE);
-    munit_print_time(MUNIT_OUTPUT_FILE, report.cpu_clock);
-    fputs(" CPU", MUNIT_OUTPUT_FILE);
+  munit_test_runner_scaling_add(runner, params, &report);
 #endif
-    runner->report.successful++;
-    result = MUNIT_OK;
-  } else if (report.successful > 0) {
-    munit_test_runner_print_color(runner, MUNIT_RESULT_STRING_OK, '2');
-#if defined(MUNIT_ENABLE_TIMING)
-    fputs(" ] [ ", MUNIT_OUTPUT_FILE);
-    munit_print_time(MUNIT_OUTPUT_FILE, report.wall_clock);
-    fputs(" / ", MUNIT_OUTPUT_FILE);
-    munit_print_time(MUNIT_OUTPUT_FILE, report.cpu_clock);
-    fputs(" CPU", MUNIT_OUTPUT_FILE);
+#if defined(MUNIT_HAVE_TIMING_DB)
+  if (runner->timing_db.header != NULL)
+    munit_timing_db_record(&(runner->timing_db), munit_timing_db_hash(runner->test_name, params), &report);
 #endif
-    runner->report.successful++;
-    result = MUNIT_OK;
+
+  if (stderr_buf != NULL)
+    fclose(stderr_buf);
+  free(samples);
+  free(key);
+}
+
+static void
+munit_test_runner_run_test_wild(MunitTestRunner* runner,
+                                const MunitTest* test,
+                                const char* test_name,
+                                MunitParameter* params,
+                                MunitParameter* p) {
+  const MunitParameterEnum* pe;
+  char buf[MUNIT_PARAMETER_VALUE_LEN];
+  size_t size;
+  size_t idx;
+  MunitParameter* next;
+
+  for (pe = test->parameters ; pe != NULL && pe->name != NULL ; pe++) {
+    if (p->name == pe->name)
+      break;
   }
-  fputs(" ]\n", MUNIT_OUTPUT_FILE);
 
-  if (stderr_buf != NULL) {
-    if (result == MUNIT_FAIL || result == MUNIT_ERROR || runner->show_stderr) {
-      fflush(MUNIT_OUTPUT_FILE);
+  if (pe == NULL)
+    return;
+
+  size = munit_parameter_enum_size(pe);
+  for (idx = 0 ; idx < size ; idx++) {
+    next = p + 1;
+    p->value = munit_parameter_enum_value(pe, idx, buf);
+    if (next->name == NULL) {
+      munit_test_runner_run_test_with_params(runner, test, params);
+    } else {
+      munit_test_runner_run_test_wild(runner, test, test_name, params, next);
+    }
+    if (runner->fatal_failures && (runner->report.failed != 0 || runner->report.errored != 0))
+      break;
+  }
+}
+
+/* Find the possible values of each of the k wildcard parameters, and
+ * how many there are. */
+static void
+munit_wild_parameters_values(const MunitTest* test, const MunitParameter* wild, size_t k, const MunitParameterEnum** values, size_t* sizes) {
+  const MunitParameterEnum* pe;
+  size_t i;
+
+  for (i = 0 ; i < k ; i++) {
+    for (pe = test->parameters ; pe != NULL && pe->name != NULL ; pe++) {
+      if (strcmp(wild[i].name, pe->name) == 0) {
+        values[i] = pe;
+        break;
+      }
+    }
+    sizes[i] = munit_parameter_enum_size(values[i]);
+  }
+}
+
+/* Lexicographically next combination of t out of k indices. */
+static munit_bool
+munit_combination_next(size_t* combo, size_t t, size_t k) {
+  size_t i = t;
+  size_t j;
+
+  while (i-- > 0) {
+    if (combo[i] < k - t + i) {
+      combo[i]++;
+      for (j = i + 1 ; j < t ; j++)
+        combo[j] = combo[j - 1] + 1;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+#define MUNIT_COVERING_UNSET ((size_t) -1)
+
+/* Run a test with a covering array of its wildcard parameters
+ * (--param-coverage) instead of every combination: a set of
+ * combinations in which, for any `strength` of the parameters, every
+ * combination of their values appears at least once.  The array is
+ * built greedily like AETG, but deterministically: each combination
+ * starts with the first tuple not covered yet, then every other
+ * parameter gets whichever value covers the most new tuples. */
+static void
+munit_test_runner_run_test_covering(MunitTestRunner* runner,
+                                    const MunitTest* test,
+                                    MunitParameter* params,
+                                    MunitParameter* wild) {
+  const size_t t = runner->param_coverage;
+  const MunitParameterEnum** values = NULL;
+  char* bufs = NULL;
+  size_t* sizes = NULL;
+  size_t* row = NULL;
+  size_t* combos = NULL;
+  size_t* offsets = NULL;
+  munit_uint8_t* covered = NULL;
+  size_t k = 0;
+  size_t combos_l = 1;
+  size_t uncovered;
+  size_t first;
+  size_t gain;
+  size_t best;
+  size_t best_gain;
+  size_t idx;
+  size_t c, i, p, v;
+  size_t* combo;
+
+  while (wild[k].name != NULL)
+    k++;
+
+  values = calloc(k, sizeof(MunitParameterEnum*));
+  bufs = malloc(k * MUNIT_PARAMETER_VALUE_LEN);
+  sizes = calloc(k, sizeof(size_t));
+  row = calloc(k, sizeof(size_t));
+  if (values == NULL || bufs == NULL || sizes == NULL || row == NULL)
+    goto oom;
+  munit_wild_parameters_values(test, wild, k, values, sizes);
+
+  /* Every set of t parameters, and where its tuples start in covered. */
+  for (i = 0 ; i < t ; i++)
+    combos_l = combos_l * (k - i) / (i + 1);
+  combos = malloc(sizeof(size_t) * t * combos_l);
+  offsets = malloc(sizeof(size_t) * (combos_l + 1));
+  if (combos == NULL || offsets == NULL)
+    goto oom;
+
+  for (i = 0 ; i < t ; i++)
+    combos[i] = i;
+  offsets[0] = 0;
+  for (c = 0 ; c < combos_l ; c++) {
+    combo = combos + (c * t);
+    idx = 1;
+    for (i = 0 ; i < t ; i++)
+      idx *= sizes[combo[i]];
+    offsets[c + 1] = offsets[c] + idx;
+
+    if (c + 1 < combos_l) {
+      memcpy(combo + t, combo, sizeof(size_t) * t);
+      munit_combination_next(combo + t, t, k);
+    }
+  }
+
+  uncovered = offsets[combos_l];
+  covered = calloc(uncovered, 1);
+  if (covered == NULL)
+    goto oom;
+
+  first = 0;
+  while (uncovered > 0) {
+    for (i = 0 ; i < k ; i++)
+      row[i] = MUNIT_COVERING_UNSET;
+
+    while (covered[first])
+      first++;
+    for (c = 0 ; offsets[c + 1] <= first ; c++) { }
+    combo = combos + (c * t);
+    idx = first - offsets[c];
+    for (i = t ; i-- > 0 ; ) {
+      row[combo[i]] = idx % sizes[combo[i]];
+      idx /= sizes[combo[i]];
+    }
+
+    for (p = 0 ; p < k ; p++) {
+      if (row[p] != MUNIT_COVERING_UNSET)
+        continue;
 
-      rewind(stderr_buf);
-      munit_splice(fileno(stderr_buf), STDERR_FILENO);
+      best = 0;
+      best_gain = 0;
+      for (v = 0 ; v < sizes[p] ; v++) {
+        row[p] = v;
+        gain = 0;
+        for (c = 0 ; c < combos_l ; c++) {
+          /* Only sets of parameters which include p, and which p
+           * completes. */
+          combo = combos + (c * t);
+          for (i = 0 ; i < t && combo[i] != p ; i++) { }
+          if (i == t)
+            continue;
+
+          idx = 0;
+          for (i = 0 ; i < t && row[combo[i]] != MUNIT_COVERING_UNSET ; i++)
+            idx = idx * sizes[combo[i]] + row[combo[i]];
+          if (i == t && !covered[offsets[c] + idx])
+            gain++;
+        }
+        if (gain > best_gain) {
+          best_gain = gain;
+          best = v;
+        }
+      }
+      row[p] = best;
+    }
 
-      fflush(stderr);
+    for (c = 0 ; c < combos_l ; c++) {
+      combo = combos + (c * t);
+      idx = 0;
+      for (i = 0 ; i < t ; i++)
+        idx = idx * sizes[combo[i]] + row[combo[i]];
+      if (!covered[offsets[c] + idx]) {
+        covered[offsets[c] + idx] = 1;
+        uncovered--;
+      }
     }
 
-    fclose(stderr_buf);
+    for (i = 0 ; i < k ; i++)
+      wild[i].value = munit_parameter_enum_value(values[i], row[i], bufs + (i * MUNIT_PARAMETER_VALUE_LEN));
+    munit_test_runner_run_test_with_params(runner, test, params);
+
+    if (runner->fatal_failures && (runner->report.failed != 0 || runner->report.errored != 0))
+      break;
   }
+
+  goto cleanup;
+
+ oom:
+  munit_log_internal(MUNIT_LOG_ERROR, stderr, "failed to allocate memory");
+  runner->report.errored++;
+
+ cleanup:
+  free(values);
+  free(bufs);
+  free(sizes);
+  free(row);
+  free(combos);
+  free(offsets);
+  free(covered);
 }
 
-static void
-munit_test_runner_run_test_wild(MunitTestRunner* runner,
-                                const MunitTest* test,
-                                const char* test_name,
-                                MunitParameter* params,
-                                MunitParameter* p) {
-  const MunitParameterEnum* pe;
-  char** values;
-  MunitParameter* next;
+/* Uniformly random number in [0, max]. */
+static munit_uint64_t
+munit_rand_state_uint64_at_most(munit_uint32_t* state, munit_uint64_t max) {
+  munit_uint64_t mask = max;
+  munit_uint64_t x;
 
-  for (pe = test->parameters ; pe != NULL && pe->name != NULL ; pe++) {
-    if (p->name == pe->name)
+  mask |= mask >> 1;
+  mask |= mask >> 2;
+  mask |= mask >> 4;
+  mask |= mask >> 8;
+  mask |= mask >> 16;
+  mask |= mask >> 32;
+
+  do {
+    x = ((munit_uint64_t) munit_rand_state_uint32(state)) << 32;
+    x |= munit_rand_state_uint32(state);
+    x &= mask;
+  } while (x > max);
+
+  return x;
+}
+
+static int
+munit_uint64_compare(const void* a, const void* b) {
+  const munit_uint64_t x = *((const munit_uint64_t*) a);
+  const munit_uint64_t y = *((const munit_uint64_t*) b);
+
+  return (x > y) - (x < y);
+}
+
+/* Add value to an open-addressing set with room for mask + 1 values.
+ * Returns false if it was already there.  The set can't hold
+ * ~0, which is used for empty buckets. */
+static munit_bool
+munit_uint64_set_add(munit_uint64_t* set, size_t mask, munit_uint64_t value) {
+  size_t i = (size_t) ((value * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+
+  while (set[i] != ~((munit_uint64_t) 0)) {
+    if (set[i] == value)
+      return 0;
+    i = (i + 1) & mask;
+  }
+
+  set[i] = value;
+  return 1;
+}
+
+/* Run a test with max_combinations of the combinations of its
+ * wildcard parameters, chosen uniformly at random without replacement
+ * (--max-combinations).  Combinations are numbered in mixed radix and
+ * drawn with Floyd's algorithm, so only the chosen ones are ever
+ * stored.  They're run in the same order they would be without
+ * sampling.  Returns false if there aren't more combinations than
+ * that, in which case nothing was run. */
+static munit_bool
+munit_test_runner_run_test_sample(MunitTestRunner* runner,
+                                  const MunitTest* test,
+                                  const char* test_name,
+                                  MunitParameter* params,
+                                  MunitParameter* wild) {
+  const size_t n = runner->max_combinations;
+  munit_uint32_t state = munit_rand_next_state((runner->seed ^ munit_str_hash(test_name)) + MUNIT_PRNG_INCREMENT);
+  const MunitParameterEnum** values = NULL;
+  char* bufs = NULL;
+  size_t* sizes = NULL;
+  munit_uint64_t* chosen = NULL;
+  munit_uint64_t* set = NULL;
+  munit_uint64_t total = 1;
+  munit_uint64_t j;
+  munit_uint64_t r;
+  size_t set_mask;
+  size_t chosen_l = 0;
+  size_t k = 0;
+  size_t i;
+  munit_bool sampled = 1;
+
+  while (wild[k].name != NULL)
+    k++;
+
+  values = calloc(k, sizeof(MunitParameterEnum*));
+  bufs = malloc(k * MUNIT_PARAMETER_VALUE_LEN);
+  sizes = calloc(k, sizeof(size_t));
+  if (values == NULL || bufs == NULL || sizes == NULL)
+    goto oom;
+  munit_wild_parameters_values(test, wild, k, values, sizes);
+
+  /* If there are 2^64 or more combinations, just sample from the
+   * first 2^64 - 1; nobody will notice. */
+  for (i = 0 ; i < k ; i++) {
+    if (total > (~((munit_uint64_t) 0) - 1) / sizes[i]) {
+      total = ~((munit_uint64_t) 0) - 1;
       break;
+    }
+    total *= sizes[i];
   }
 
-  if (pe == NULL)
-    return;
+  if (total <= (munit_uint64_t) n) {
+    sampled = 0;
+    goto cleanup;
+  }
 
-  for (values = pe->values ; *values != NULL ; values++) {
-    next = p + 1;
-    p->value = *values;
-    if (next->name == NULL) {
-      munit_test_runner_run_test_with_params(runner, test, params);
-    } else {
-      munit_test_runner_run_test_wild(runner, test, test_name, params, next);
+  for (set_mask = 1 ; set_mask < n * 2 ; set_mask <<= 1) { }
+  chosen = malloc(sizeof(munit_uint64_t) * n);
+  set = malloc(sizeof(munit_uint64_t) * set_mask);
+  if (chosen == NULL || set == NULL)
+    goto oom;
+  memset(set, 0xff, sizeof(munit_uint64_t) * set_mask);
+  set_mask--;
+
+  for (j = total - n ; j < total ; j++) {
+    r = munit_rand_state_uint64_at_most(&state, j);
+    if (!munit_uint64_set_add(set, set_mask, r)) {
+      r = j;
+      munit_uint64_set_add(set, set_mask, r);
     }
+    chosen[chosen_l++] = r;
+  }
+  qsort(chosen, chosen_l, sizeof(munit_uint64_t), munit_uint64_compare);
+
+  for (j = 0 ; j < chosen_l ; j++) {
+    r = chosen[j];
+    for (i = k ; i-- > 0 ; ) {
+      wild[i].value = munit_parameter_enum_value(values[i], (size_t) (r % sizes[i]), bufs + (i * MUNIT_PARAMETER_VALUE_LEN));
+      r /= sizes[i];
+    }
+    munit_test_runner_run_test_with_params(runner, test, params);
+
     if (runner->fatal_failures && (runner->report.failed != 0 || runner->report.errored != 0))
       break;
   }
+
+  goto cleanup;
+
+ oom:
+  munit_log_internal(MUNIT_LOG_ERROR, stderr, "failed to allocate memory");
+  runner->report.errored++;
+
+ cleanup:
+  free(values);
+  free(bufs);
+  free(sizes);
+  free(chosen);
+  free(set);
+  return sampled;
 }
 
 /* Run a single test, with every combination of parameters
@@ -1569,21 +7431,44 @@ munit_test_runner_run_test(MunitTestRunner* runner,
   const MunitParameterEnum* pe;
   const MunitParameter* cli_p;
   munit_bool filled;
-  unsigned int possible;
-  char** vals;
+  size_t possible;
+  /* Storage for generated values chosen by --single. */
+  char* bufs = NULL;
   size_t first_wild;
   const MunitParameter* wp;
   int pidx;
 
+  if (runner->shard.mode != MUNIT_SHARD_NONE && !munit_test_runner_shard_test(runner)) {
+    munit_maybe_free_concat(test_name, prefix, test->name);
+    return;
+  }
+
   munit_rand_seed(runner->seed);
 
-  fprintf(MUNIT_OUTPUT_FILE, "%-" MUNIT_XSTRINGIFY(MUNIT_TEST_NAME_LEN) "s", test_name);
+  runner->test_name = test_name;
+
+  if (runner->shard.mode == MUNIT_SHARD_COUNT) {
+    /* Just finding out what the test cases are. */
+  }
+#if !defined(MUNIT_NO_FORK)
+  else if (MUNIT_TEST_RUNNER_PARALLEL(runner) && runner->shard.mode != MUNIT_SHARD_LIST) {
+    /* The name is printed along with the first result. */
+    runner->pending_name = test_name;
+    runner->pending_name_parameterized = (test->parameters != NULL);
+  }
+#endif
+  else {
+    munit_test_runner_test_start(runner, test_name, test->parameters != NULL);
+  }
 
   if (test->parameters == NULL) {
     /* No parameters.  Simple, nice. */
     munit_test_runner_run_test_with_params(runner, test, NULL);
   } else {
-    fputc('\n', MUNIT_OUTPUT_FILE);
+    for (pe = test->parameters ; pe->name != NULL ; pe++) { }
+    bufs = malloc((size_t) (pe - test->parameters + 1) * MUNIT_PARAMETER_VALUE_LEN);
+    if (MUNIT_UNLIKELY(bufs == NULL))
+      goto cleanup;
 
     for (pe = test->parameters ; pe != NULL && pe->name != NULL ; pe++) {
       /* Did we received a value for this parameter from the CLI? */
@@ -1601,21 +7486,26 @@ munit_test_runner_run_test(MunitTestRunner* runner,
 
       /* Nothing from CLI, is the enum NULL/empty?  We're not a
        * fuzzer… */
-      if (pe->values == NULL || pe->values[0] == NULL)
+      possible = munit_parameter_enum_size(pe);
+      if (possible == 0) {
+        if (pe->generator != NULL) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "invalid range for parameter \"%s\"", pe->name);
+          runner->report.errored++;
+          goto cleanup;
+        }
         continue;
+      }
 
       /* If --single was passed to the CLI, choose a value from the
        * list of possibilities randomly. */
       if (runner->single_parameter_mode) {
-        possible = 0;
-        for (vals = pe->values ; *vals != NULL ; vals++)
-          possible++;
         /* We want the tests to be reproducible, even if you're only
          * running a single test, but we don't want every test with
          * the same number of parameters to choose the same parameter
          * number, so use the test name as a primitive salt. */
-        pidx = munit_rand_at_most(munit_str_hash(test_name), possible - 1);
-        if (MUNIT_UNLIKELY(munit_parameters_add(&params_l, &params, pe->name, pe->values[pidx]) != MUNIT_OK))
+        pidx = munit_rand_at_most(munit_str_hash(test_name), (munit_uint32_t) (possible - 1));
+        if (MUNIT_UNLIKELY(munit_parameters_add(&params_l, &params, pe->name,
+                                                munit_parameter_enum_value(pe, (size_t) pidx, bufs + ((size_t) (pe - test->parameters) * MUNIT_PARAMETER_VALUE_LEN))) != MUNIT_OK))
           goto cleanup;
       } else {
         /* We want to try every permutation.  Put in a placeholder
@@ -1628,15 +7518,28 @@ munit_test_runner_run_test(MunitTestRunner* runner,
     if (wild_params_l != 0) {
       first_wild = params_l;
       for (wp = wild_params ; wp != NULL && wp->name != NULL ; wp++) {
-        for (pe = test->parameters ; pe != NULL && pe->name != NULL && pe->values != NULL ; pe++) {
-          if (strcmp(wp->name, pe->name) == 0) {
-            if (MUNIT_UNLIKELY(munit_parameters_add(&params_l, &params, pe->name, pe->values[0]) != MUNIT_OK))
-              goto cleanup;
-          }
-        }
+        /* The values are filled in as we go. */
+        if (MUNIT_UNLIKELY(munit_parameters_add(&params_l, &params, wp->name, NULL) != MUNIT_OK))
+          goto cleanup;
       }
 
-      munit_test_runner_run_test_wild(runner, test, test_name, params, params + first_wild);
+      if (runner->max_combinations != 0 &&
+          munit_test_runner_run_test_sample(runner, test, test_name, params, params + first_wild))
+        ;
+      else if (runner->param_coverage != 0 && wild_params_l > runner->param_coverage)
+        munit_test_runner_run_test_covering(runner, test, params, params + first_wild);
+      else
+        munit_test_runner_run_test_wild(runner, test, test_name, params, params + first_wild);
+
+#if defined(MUNIT_ENABLE_TIMING)
+      if (runner->scaling != NULL) {
+#if !defined(MUNIT_NO_FORK)
+        munit_test_runner_drain(runner);
+#endif
+        munit_test_runner_fit_scaling(runner);
+        munit_test_runner_scaling_reset(runner);
+      }
+#endif
     } else {
       munit_test_runner_run_test_with_params(runner, test, params);
     }
@@ -1644,11 +7547,272 @@ munit_test_runner_run_test(MunitTestRunner* runner,
   cleanup:
     free(params);
     free(wild_params);
+    free(bufs);
   }
 
+#if !defined(MUNIT_NO_FORK)
+  runner->pending_name = NULL;
+#endif
+
   munit_maybe_free_concat(test_name, prefix, test->name);
 }
 
+/*** Test name filters ***/
+
+/* Move on to the next character of a name made of two strings (the
+ * suite prefix and the test name), without concatenating them. */
+static void
+munit_filter_cursor_fix(MunitFilterCursor* cursor) {
+  if (*(cursor->s) == '\0' && cursor->next != NULL) {
+    cursor->s = cursor->next;
+    cursor->next = NULL;
+  }
+}
+
+static void
+munit_filter_cursor_init(MunitFilterCursor* cursor, const char* a, const char* b) {
+  cursor->s = (a != NULL) ? a : "";
+  cursor->next = b;
+  munit_filter_cursor_fix(cursor);
+}
+
+static void
+munit_filter_cursor_advance(MunitFilterCursor* cursor) {
+  cursor->s++;
+  munit_filter_cursor_fix(cursor);
+}
+
+static munit_bool
+munit_filter_is_glob(const char* pattern) {
+  return strpbrk(pattern, "*?[") != NULL;
+}
+
+static munit_bool
+munit_filter_add(MunitFilter* filter, const char* pattern) {
+  MunitFilterNode* node = &(filter->root);
+  MunitFilterNode* child;
+  const char** globs;
+  const char* p;
+
+  if (munit_filter_is_glob(pattern)) {
+    globs = realloc((void*) filter->globs, sizeof(char*) * (filter->globs_l + 1));
+    if (globs == NULL)
+      return 0;
+    filter->globs = globs;
+    filter->globs[filter->globs_l++] = pattern;
+    return 1;
+  }
+
+  for (p = pattern ; *p != '\0' ; p++) {
+    for (child = node->child ; child != NULL && child->c != *p ; child = child->next) { }
+    if (child == NULL) {
+      child = calloc(1, sizeof(MunitFilterNode));
+      if (child == NULL)
+        return 0;
+      child->c = *p;
+      child->next = node->child;
+      node->child = child;
+    }
+    node = child;
+  }
+  node->end = 1;
+
+  return 1;
+}
+
+static void
+munit_filter_node_free(MunitFilterNode* node) {
+  MunitFilterNode* next;
+
+  for ( ; node != NULL ; node = next) {
+    next = node->next;
+    munit_filter_node_free(node->child);
+    free(node);
+  }
+}
+
+static void
+munit_filter_free(MunitFilter* filter) {
+  munit_filter_node_free(filter->root.child);
+  free((void*) filter->globs);
+  memset(filter, 0, sizeof(MunitFilter));
+}
+
+static munit_bool
+munit_filter_empty(const MunitFilter* filter) {
+  return filter->root.child == NULL && !filter->root.end && filter->globs_l == 0;
+}
+
+/* Whether one glob element (a character, ?, or [...] class) matches
+ * c.  *end is set to the next element. */
+static munit_bool
+munit_glob_char(const char* p, char c, const char** end) {
+  const char* q;
+  const char* first;
+  munit_bool negate;
+  munit_bool matched = 0;
+
+  if (*p == '?') {
+    *end = p + 1;
+    return 1;
+  } else if (*p == '[') {
+    q = p + 1;
+    negate = (*q == '!' || *q == '^');
+    if (negate)
+      q++;
+    /* A ] right after the [ is part of the class. */
+    for (first = q ; *q != '\0' && (*q != ']' || q == first) ; ) {
+      if (q[1] == '-' && q[2] != ']' && q[2] != '\0') {
+        matched |= (c >= q[0] && c <= q[2]);
+        q += 3;
+      } else {
+        matched |= (c == *q);
+        q++;
+      }
+    }
+
+    if (*q == ']') {
+      *end = q + 1;
+      return matched != negate;
+    }
+    /* No closing bracket; just a literal [. */
+  }
+
+  *end = p + 1;
+  return *p == c;
+}
+
+/* Whether the glob matches the start of the name (a followed by b).
+ * If partial is true, a name which runs out before the pattern does
+ * counts as a match, since a longer name could match. */
+static munit_bool
+munit_glob_match(const char* p, const char* a, const char* b, munit_bool partial) {
+  MunitFilterCursor s;
+  MunitFilterCursor star_s = { NULL, NULL };
+  const char* star_p = NULL;
+  const char* next_p;
+
+  munit_filter_cursor_init(&s, a, b);
+  for (;;) {
+    if (*p == '*') {
+      while (*p == '*')
+        p++;
+      star_p = p;
+      star_s = s;
+    } else if (*p == '\0') {
+      return 1;
+    } else if (*(s.s) == '\0') {
+      return partial;
+    } else if (munit_glob_char(p, *(s.s), &next_p)) {
+      p = next_p;
+      munit_filter_cursor_advance(&s);
+    } else if (star_p != NULL) {
+      /* Let the last * eat one more character. */
+      p = star_p;
+      munit_filter_cursor_advance(&star_s);
+      s = star_s;
+    } else {
+      return 0;
+    }
+  }
+}
+
+/* Same as munit_glob_match, for the literal patterns in the trie. */
+static munit_bool
+munit_filter_trie_match(const MunitFilterNode* node, const char* a, const char* b, munit_bool partial) {
+  MunitFilterCursor s;
+
+  munit_filter_cursor_init(&s, a, b);
+  for (;;) {
+    if (node->end)
+      return 1;
+    if (*(s.s) == '\0')
+      return partial && node->child != NULL;
+
+    for (node = node->child ; node != NULL && node->c != *(s.s) ; node = node->next) { }
+    if (node == NULL)
+      return 0;
+    munit_filter_cursor_advance(&s);
+  }
+}
+
+/* Whether any pattern in the filter matches the start of the name
+ * made of a followed by b. */
+static munit_bool
+munit_filter_match(const MunitFilter* filter, const char* a, const char* b, munit_bool partial) {
+  size_t i;
+
+  if (munit_filter_trie_match(&(filter->root), a, b, partial))
+    return 1;
+
+  for (i = 0 ; i < filter->globs_l ; i++) {
+    if (munit_glob_match(filter->globs[i], a, b, partial))
+      return 1;
+  }
+
+  return 0;
+}
+
+/* Whether a test was selected by the names passed on the CLI, and not
+ * excluded with --exclude. */
+static munit_bool
+munit_test_runner_test_selected(const MunitTestRunner* runner, const char* pre, const MunitTest* test) {
+  return (munit_filter_empty(&(runner->tests)) || munit_filter_match(&(runner->tests), pre, test->name, 0)) &&
+    !munit_filter_match(&(runner->exclude), pre, test->name, 0);
+}
+
+/* Whether any test whose name starts with pre could be selected, so we
+ * can skip entire suites which can't. */
+static munit_bool
+munit_test_runner_prefix_selected(const MunitTestRunner* runner, const char* pre) {
+  return (munit_filter_empty(&(runner->tests)) || munit_filter_match(&(runner->tests), pre, NULL, 1)) &&
+    !munit_filter_match(&(runner->exclude), pre, NULL, 0);
+}
+
+/* Whether any of the tests in a suite (or its child suites) would be
+ * run.  Used to avoid setting up suites we would only tear down. */
+static munit_bool
+munit_test_runner_suite_selected(MunitTestRunner* runner,
+                                 const MunitSuite* suite,
+                                 const char* prefix) {
+  char* pre;
+  const MunitTest* test;
+  const MunitSuite* child_suite;
+  munit_bool selected = 0;
+
+  if (munit_filter_empty(&(runner->tests)) && munit_filter_empty(&(runner->exclude)))
+    return 1;
+
+  pre = munit_maybe_concat(NULL, (char*) prefix, (char*) suite->prefix);
+  if (!munit_test_runner_prefix_selected(runner, pre))
+    goto cleanup;
+
+  for (test = suite->tests ; !selected && test != NULL && test->test != NULL ; test++)
+    selected = munit_test_runner_test_selected(runner, pre, test);
+
+  for (child_suite = suite->suites ; !selected && child_suite != NULL && child_suite->prefix != NULL ; child_suite++)
+    selected = munit_test_runner_suite_selected(runner, child_suite, pre);
+
+ cleanup:
+
+  munit_maybe_free_concat(pre, prefix, suite->prefix);
+
+  return selected;
+}
+
+/* The suite fixture is set up in this process, so any test cases which
+ * are still running, or workers which were forked earlier, have to be
+ * finished before it changes. */
+static void
+munit_test_runner_sync(MunitTestRunner* runner) {
+#if !defined(MUNIT_NO_FORK)
+  munit_test_runner_drain(runner);
+  munit_test_runner_stop_workers(runner);
+#else
+  (void) runner;
+#endif
+}
+
 /* Recurse through the suite and run all the tests.  If a list of
  * tests to run was provied on the command line, run only those
  * tests.  */
@@ -1656,25 +7820,32 @@ static void
 munit_test_runner_run_suite(MunitTestRunner* runner,
                             const MunitSuite* suite,
                             const char* prefix) {
-  size_t pre_l;
-  char* pre = munit_maybe_concat(&pre_l, (char*) prefix, (char*) suite->prefix);
+  char* pre = munit_maybe_concat(NULL, (char*) prefix, (char*) suite->prefix);
   const MunitTest* test;
-  const char** test_name;
   const MunitSuite* child_suite;
+  void* const user_data = runner->user_data;
+  munit_bool set_up = 0;
+
+  /* Nothing in this suite (or its children) could be selected. */
+  if (!munit_test_runner_prefix_selected(runner, pre))
+    goto cleanup;
+
+  /* Suites aren't set up just to count or list their test cases. */
+  if (suite->setup != NULL && (runner->shard.mode == MUNIT_SHARD_NONE || runner->shard.mode == MUNIT_SHARD_RUN)) {
+    if (!munit_test_runner_suite_selected(runner, suite, prefix))
+      goto cleanup;
+
+    munit_test_runner_sync(runner);
+    runner->user_data = suite->setup(user_data);
+    set_up = 1;
+  }
 
   /* Run the tests. */
   for (test = suite->tests ; test != NULL && test->test != NULL ; test++) {
-    if (runner->tests != NULL) { /* Specific tests were requested on the CLI */
-      for (test_name = runner->tests ; test_name != NULL && *test_name != NULL ; test_name++) {
-        if ((pre_l == 0 || strncmp(pre, *test_name, pre_l) == 0) &&
-            strncmp(test->name, *test_name + pre_l, strlen(*test_name + pre_l)) == 0) {
-          munit_test_runner_run_test(runner, test, pre);
-          if (runner->fatal_failures && (runner->report.failed != 0 || runner->report.errored != 0))
-            goto cleanup;
-        }
-      }
-    } else { /* Run all tests */
+    if (munit_test_runner_test_selected(runner, pre, test)) {
       munit_test_runner_run_test(runner, test, pre);
+      if (runner->fatal_failures && (runner->report.failed != 0 || runner->report.errored != 0))
+        goto cleanup;
     }
   }
 
@@ -1688,12 +7859,184 @@ munit_test_runner_run_suite(MunitTestRunner* runner,
 
  cleanup:
 
+  if (set_up) {
+    munit_test_runner_sync(runner);
+    if (suite->tear_down != NULL)
+      suite->tear_down(runner->user_data);
+    runner->user_data = user_data;
+  }
+
   munit_maybe_free_concat(pre, prefix, suite->prefix);
 }
 
+/* How many test cases are in our shard. */
+static size_t
+munit_shard_plan_size(const MunitShardPlan* shard) {
+  size_t size = 0;
+  size_t i;
+
+  for (i = 0 ; i < shard->cases_l ; i++)
+    size += (shard->cases[i].shard == shard->index);
+
+  return size;
+}
+
+#if defined(MUNIT_HAVE_TIMING_DB)
+/* Roughly how long our test cases will take, in nanoseconds, going by
+ * the timing database: their total time spread over the jobs, or the
+ * longest of them if that's longer.  0 if the database doesn't know
+ * any of them. */
+static double
+munit_test_runner_eta(const MunitTestRunner* runner) {
+  const MunitShardPlan* shard = &(runner->shard);
+  const unsigned int jobs = MUNIT_TEST_RUNNER_PARALLEL(runner) ? runner->jobs : 1;
+  double total = 0;
+  double longest = 0;
+  size_t i;
+
+  for (i = 0 ; i < shard->cases_l ; i++) {
+    if (shard->cases[i].shard != shard->index)
+      continue;
+    total += (double) shard->cases[i].expected;
+    if ((double) shard->cases[i].expected > longest)
+      longest = (double) shard->cases[i].expected;
+  }
+
+  return (total / jobs > longest) ? total / jobs : longest;
+}
+#endif
+
+static int
+munit_shard_case_compare(const void* a, const void* b) {
+  const MunitShardCase* x = *((const MunitShardCase* const*) a);
+  const MunitShardCase* y = *((const MunitShardCase* const*) b);
+
+  if (x->weight != y->weight)
+    return (x->weight < y->weight) ? 1 : -1;
+  return (x > y) - (x < y);
+}
+
+/* Work out which shard every test case belongs to (--shard).  The
+ * suite is walked once without running anything to find the cases,
+ * then they're handed out longest first, each to whichever shard has
+ * the least work so far (LPT scheduling).  Without timings from an
+ * earlier run (--shard-timings, or failing that the timing database)
+ * every case costs the same, which makes it round-robin; cases missing
+ * from the timings are assumed to take as long as the average case
+ * which isn't.  Every shard does the same thing, so they all agree on
+ * the plan. */
+static munit_bool
+munit_test_runner_shard_plan(MunitTestRunner* runner) {
+  MunitShardPlan* shard = &(runner->shard);
+  const MunitReport report = runner->report;
+  MunitShardCase** order = NULL;
+  double* load = NULL;
+  double known = 0;
+  size_t known_l = 0;
+  size_t i;
+  unsigned int s, best;
+  munit_bool ok = 0;
+
+  shard->mode = MUNIT_SHARD_COUNT;
+  shard->next_test = 0;
+  munit_test_runner_run_suite(runner, runner->suite, NULL);
+  /* Anything reported while counting will be reported again. */
+  runner->report = report;
+
+  for (i = 0 ; i < shard->cases_l ; i++) {
+    if (shard->cases[i].weight >= 0) {
+      known += shard->cases[i].weight;
+      known_l++;
+    }
+  }
+  for (i = 0 ; i < shard->cases_l ; i++) {
+    if (shard->cases[i].weight < 0)
+      shard->cases[i].weight = (known_l != 0) ? known / (double) known_l : 1;
+  }
+
+  order = malloc(sizeof(MunitShardCase*) * (shard->cases_l + 1));
+  load = calloc(shard->count, sizeof(double));
+  if (order == NULL || load == NULL) {
+    munit_log_internal(MUNIT_LOG_ERROR, stderr, "failed to allocate memory");
+    goto cleanup;
+  }
+
+  for (i = 0 ; i < shard->cases_l ; i++)
+    order[i] = &(shard->cases[i]);
+  qsort(order, shard->cases_l, sizeof(MunitShardCase*), munit_shard_case_compare);
+
+  for (i = 0 ; i < shard->cases_l ; i++) {
+    best = 0;
+    for (s = 1 ; s < shard->count ; s++) {
+      if (load[s] < load[best])
+        best = s;
+    }
+    order[i]->shard = best;
+    load[best] += order[i]->weight;
+  }
+
+  shard->mode = MUNIT_SHARD_RUN;
+  shard->next_case = 0;
+  shard->next_test = 0;
+  ok = 1;
+
+ cleanup:
+  free(order);
+  free(load);
+  return ok;
+}
+
 static void
 munit_test_runner_run(MunitTestRunner* runner) {
+#if !defined(MUNIT_NO_FORK)
+  unsigned int i;
+#endif
+
+#if defined(MUNIT_HAVE_PERF_EVENTS)
+  /* Find out now whether the kernel will let us use the counters, so
+   * we can complain once instead of silently for every test. */
+  if (runner->perf_counters) {
+    if (munit_perf_group_open(&(runner->perf))) {
+      munit_perf_group_close(&(runner->perf));
+    } else {
+      munit_log_errno(MUNIT_LOG_WARNING, stderr, "unable to open performance counters");
+      runner->perf_counters = 0;
+    }
+  }
+#endif
+
+#if !defined(MUNIT_NO_FORK)
+
+  if (runner->fork && !munit_test_runner_fork_init(runner)) {
+    munit_test_runner_fork_fini(runner);
+    runner->report.errored++;
+    return;
+  }
+
+  if (runner->fork && runner->fork_server) {
+    runner->workers_l = MUNIT_TEST_RUNNER_PARALLEL(runner) ? runner->jobs : 1;
+    runner->workers = malloc(sizeof(MunitWorker) * runner->workers_l);
+    if (runner->workers == NULL) {
+      munit_log_internal(MUNIT_LOG_ERROR, stderr, "failed to allocate memory");
+      munit_test_runner_fork_fini(runner);
+      runner->report.errored++;
+      return;
+    }
+    for (i = 0 ; i < runner->workers_l ; i++) {
+      runner->workers[i].pid = 0;
+      runner->workers[i].sock = -1;
+      runner->workers[i].tc = NULL;
+    }
+  }
+#endif
+
   munit_test_runner_run_suite(runner, runner->suite, NULL);
+
+#if !defined(MUNIT_NO_FORK)
+  munit_test_runner_drain(runner);
+  munit_test_runner_stop_workers(runner);
+  munit_test_runner_fork_fini(runner);
+#endif
 }
 
 static void
@@ -1702,38 +8045,164 @@ munit_print_help(int argc, char* const argv[MUNIT_ARRAY_PARAM(argc + 1)], void*
   (void) argc;
 
   printf("USAGE: %s [OPTIONS...] [TEST...]\n\n", argv[0]);
-  puts(" --seed SEED\n"
-       "           Value used to seed the PRNG.  Must be a 32-bit integer in decimal\n"
-       "           notation with no separators (commas, decimals, spaces, etc.), or\n"
-       "           hexidecimal prefixed by \"0x\".\n"
-       " --iterations N\n"
-       "           Run each test N times.  0 means the default number.\n"
-       " --param name value\n"
-       "           A parameter key/value pair which will be passed to any test with\n"
-       "           takes a parameter of that name.  If not provided, the test will be\n"
-       "           run once for each possible parameter value.\n"
-       " --list    Write a list of all available tests.\n"
-       " --list-params\n"
-       "           Write a list of all available tests and their possible parameters.\n"
-       " --single  Run each parameterized test in a single configuration instead of\n"
-       "           every possible combination\n"
-       " --log-visible debug|info|warning|error\n"
-       " --log-fatal debug|info|warning|error\n"
-       "           Set the level at which messages of different severities are visible,\n"
-       "           or cause the test to terminate.\n"
+  /* Split up, since C99 compilers only have to support string
+   * literals up to 4095 characters long. */
+  fputs(" --seed SEED\n"
+        "           Value used to seed the PRNG.  Must be a 32-bit integer in decimal\n"
+        "           notation with no separators (commas, decimals, spaces, etc.), or\n"
+        "           hexidecimal prefixed by \"0x\".\n"
+        " --iterations N\n"
+        "           Run each test N times.  0 means the default number.\n"
+        " --param name value\n"
+        "           A parameter key/value pair which will be passed to any test with\n"
+        "           takes a parameter of that name.  If not provided, the test will be\n"
+        "           run once for each possible parameter value.\n"
+        " --exclude PATTERN\n"
+        "           Don't run tests whose names start with PATTERN.  Like the TEST\n"
+        "           arguments, PATTERN may use the glob characters *, ? and [...].  May\n"
+        "           be passed more than once.\n"
+        " --shard INDEX/COUNT\n"
+        "           Split the test cases into COUNT shards and only run shard INDEX\n"
+        "           (counting from 1).  Every shard needs the same --seed if --single\n"
+        "           or --max-combinations is used.  With --list, show the shard of\n"
+        "           each test case.\n"
+#if defined(MUNIT_ENABLE_TIMING)
+        " --shard-timings FILE\n"
+        "           Balance the shards using the times in FILE, written by\n"
+        "           --save-baseline, so they take about as long as each other.\n"
+#endif
+        " --list    Write a list of all available tests.\n"
+        " --list-params\n"
+        "           Write a list of all available tests and their possible parameters.\n"
+        " --single  Run each parameterized test in a single configuration instead of\n"
+        "           every possible combination\n"
+        " --param-coverage all|pairwise|N-wise\n"
+        "           Instead of every possible combination, run each parameterized test\n"
+        "           with just enough combinations that every combination of values of\n"
+        "           any two (pairwise) or N parameters is tested at least once.\n"
+        " --max-combinations N\n"
+        "           Run each parameterized test with at most N combinations of parameter\n"
+        "           values, chosen at random (but reproducibly, given the seed).\n"
+        " --log-visible debug|info|warning|error\n"
+        " --log-fatal debug|info|warning|error\n"
+        "           Set the level at which messages of different severities are visible,\n"
+        "           or cause the test to terminate.\n", stdout);
 #if !defined(MUNIT_NO_FORK)
-       " --no-fork Do not execute tests in a child process.  If this option is supplied\n"
-       "           and a test crashes (including by failing an assertion), no further\n"
-       "           tests will be performed.\n"
-#endif
-       " --fatal-failures\n"
-       "           Stop executing tests as soon as a failure is found.\n"
-       " --show-stderr\n"
-       "           Show data written to stderr by the tests, even if the test succeeds.\n"
-       " --color auto|always|never\n"
-       "           Colorize (or don't) the output.\n"
-     /* 12345678901234567890123456789012345678901234567890123456789012345678901234567890 */
-       " --help    Print this help message and exit.\n");
+  fputs(" --no-fork Do not execute tests in a child process.  If this option is supplied\n"
+        "           and a test crashes (including by failing an assertion), no further\n"
+        "           tests will be performed.\n"
+        " --jobs N  Run up to N tests at once, each in its own child process.  0 means\n"
+        "           one per available CPU.  Results are still reported in order.\n"
+#if defined(MUNIT_ENABLE_TIMING)
+        " --timeout SECONDS\n"
+        "           Kill any test which runs for longer than SECONDS and report it as an\n"
+        "           error.  Tests may specify their own timeout instead.\n"
+#endif
+        " --fork-server\n"
+        "           Run tests in long-lived worker processes instead of forking a new\n"
+        "           process for every test.  A worker is only replaced if a test crashes\n"
+        "           it, so tests are not isolated from changes to global state made by\n"
+        "           earlier tests.\n"
+        " --fail-alloc munit|malloc\n"
+        "           After running each test, run it again once for every allocation it\n"
+        "           makes, each time in a new process and with that allocation failing,\n"
+        "           and list the runs which failed or crashed.  With 'munit' only\n"
+        "           munit_malloc() fails"
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+        "; with 'malloc', the other allocation functions\n"
+        "           counted by --count-allocs fail too.  Implies --jobs 1.\n", stdout);
+#else
+        ".  Implies --jobs 1.\n", stdout);
+#endif
+#endif
+#if defined(MUNIT_ENABLE_TIMING)
+  fputs(" --benchmark\n"
+        "           Warm up each test, then time it repeatedly and report the minimum,\n"
+        "           median, 90th and 99th percentile, standard deviation and median\n"
+        "           absolute deviation of the time per iteration.\n"
+        " --bench-samples N\n"
+        "           Number of samples to take in benchmark mode (default " MUNIT_XSTRINGIFY(MUNIT_BENCH_SAMPLES) ").\n"
+        " --bench-min-time SECONDS\n"
+        "           Run each test enough times that every sample takes at least SECONDS\n"
+        "           (default " MUNIT_XSTRINGIFY(MUNIT_BENCH_MIN_TIME) ").\n"
+        " --bench-warmup SECONDS\n"
+        "           Run each test for at least SECONDS before sampling (default " MUNIT_XSTRINGIFY(MUNIT_BENCH_WARMUP) ").\n"
+        " --save-baseline FILE\n"
+        "           Save the benchmark samples for every test to FILE.  Implies\n"
+        "           --benchmark.\n"
+        " --compare-baseline FILE\n"
+        "           Compare the benchmark samples for every test against those saved in\n"
+        "           FILE, using a Mann-Whitney U test, and fail if any test got\n"
+        "           significantly slower.  Implies --benchmark.\n"
+        " --regression-threshold PERCENT\n"
+        "           How much slower (or faster) the median time of a test must be before\n"
+        "           it counts as a change (default " MUNIT_XSTRINGIFY(MUNIT_REGRESSION_THRESHOLD) ").\n"
+        " --scaling PARAM\n"
+        "           After each test, fit the time taken against the numeric parameter\n"
+        "           PARAM, separately for each combination of the other parameters, and\n"
+        "           show which of O(1), O(log n), O(n), O(n log n) and O(n^2) fits best.\n", stdout);
+#endif
+#if defined(MUNIT_HAVE_TIMING_DB)
+  fputs(" --timing-db FILE\n"
+        "           Remember how long each test case takes in FILE (created if it\n"
+        "           doesn't exist), and use it to start the slowest test cases first\n"
+        "           with --jobs, to balance --shard, and to estimate how long the run\n"
+        "           will take.\n", stdout);
+#endif
+#if defined(MUNIT_HAVE_PERF_EVENTS)
+  fputs(" --perf-counters\n"
+        "           Measure task-clock, cycles, instructions, cache misses and branch\n"
+        "           misses (per iteration) with perf_event_open.  Counters the kernel\n"
+        "           or hardware doesn't provide are left out.\n", stdout);
+#endif
+#if defined(MUNIT_HAVE_RUSAGE)
+  fputs(" --show-usage\n"
+        "           Show the peak RSS, page faults and context switches of each test.\n"
+        "           With --no-fork or --fork-server the peak RSS is for the whole\n"
+        "           process, including earlier tests.\n", stdout);
+#endif
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+  fputs(" --count-allocs\n"
+        "           Count the calls to malloc, calloc, realloc, posix_memalign,\n"
+        "           aligned_alloc, memalign, valloc and free made by each test (not its\n"
+        "           setup or tear_down), and show them per iteration.\n", stdout);
+#endif
+  /* The defaults may be expressions, so they can't be stringified. */
+  printf(" --arena\n"
+         "           Allocate memory for munit_malloc() (and munit_new(), etc.) from an\n"
+         "           arena which is thrown away after each test's tear_down.  Memory from\n"
+         "           munit_malloc() must then be released with munit_free(), not free().\n"
+         " --arena-chunk-size BYTES\n"
+         "           Grow the arena by at least BYTES at a time (default %lu).\n"
+         " --arena-alignment BYTES\n"
+         "           Align memory from the arena to BYTES, which must be a power of two\n"
+         "           (default %lu).\n",
+         (unsigned long) MUNIT_ARENA_CHUNK_SIZE, (unsigned long) MUNIT_ARENA_ALIGNMENT);
+#if defined(MUNIT_HAVE_HUGE_PAGES)
+  fputs(" --arena-huge-pages\n"
+        "           Back the arena with huge pages if possible.\n", stdout);
+#endif
+#if defined(MUNIT_HAVE_GUARD_PAGES)
+  printf(" --guard-pages\n"
+         "           Put each allocation from munit_malloc() right before an inaccessible\n"
+         "           page, so writing past the end of it crashes the test immediately.\n"
+         "           The end is padded to a multiple of %lu bytes to keep pointers\n"
+         "           aligned.  Memory must then be released with munit_free(), not\n"
+         "           free().\n",
+         (unsigned long) MUNIT_GUARD_ALIGNMENT);
+#endif
+  fputs(" --fatal-failures\n"
+        "           Stop executing tests as soon as a failure is found.\n"
+        " --show-stderr\n"
+        "           Show data written to stderr by the tests, even if the test succeeds.\n"
+        " --reporter FORMAT:FILE\n"
+        "           Also write the results to FILE as each test finishes, in FORMAT,\n"
+        "           which is 'jsonl' (JSON Lines) or 'junit' (JUnit XML).  May be passed\n"
+        "           more than once.\n"
+        " --color auto|always|never\n"
+        "           Colorize (or don't) the output.\n"
+      /* 12345678901234567890123456789012345678901234567890123456789012345678901234567890 */
+        " --help    Print this help message and exit.\n\n", stdout);
 #if defined(MUNIT_NL_LANGINFO)
   setlocale(LC_ALL, "");
   fputs((strcasecmp("UTF-8", nl_langinfo(CODESET)) == 0) ? "µnit" : "munit", stdout);
@@ -1766,8 +8235,9 @@ munit_suite_list_tests(const MunitSuite* suite, munit_bool show_params, const ch
   char* pre = munit_maybe_concat(&pre_l, (char*) prefix, (char*) suite->prefix);
   const MunitTest* test;
   const MunitParameterEnum* params;
-  munit_bool first;
-  char** val;
+  char buf[MUNIT_PARAMETER_VALUE_LEN];
+  size_t size;
+  size_t idx;
   const MunitSuite* child_suite;
 
   for (test = suite->tests ;
@@ -1782,20 +8252,24 @@ munit_suite_list_tests(const MunitSuite* suite, munit_bool show_params, const ch
            params != NULL && params->name != NULL ;
            params++) {
         fprintf(stdout, " - %s: ", params->name);
-        if (params->values == NULL) {
+        size = munit_parameter_enum_size(params);
+        if (params->values == NULL && params->generator == NULL) {
           puts("Any");
+        } else if (size == 0 && params->generator != NULL) {
+          puts("(invalid range)");
         } else {
-          first = 1;
-          for (val = params->values ;
-               *val != NULL ;
-               val++ ) {
-            if(!first) {
-              fputs(", ", stdout);
-            } else {
-              first = 0;
+          for (idx = 0 ; idx < size ; idx++) {
+            /* Long ranges would just be noise. */
+            if (size > MUNIT_LIST_PARAMS_MAX && idx == MUNIT_LIST_PARAMS_MAX - 2) {
+              fputs(", ...", stdout);
+              idx = size - 1;
             }
-            fputs(*val, stdout);
+            if (idx != 0)
+              fputs(", ", stdout);
+            fputs(munit_parameter_enum_value(params, idx, buf), stdout);
           }
+          if (size > MUNIT_LIST_PARAMS_MAX)
+            fprintf(stdout, " (%lu values)", (unsigned long) size);
           putc('\n', stdout);
         }
       }
@@ -1838,26 +8312,49 @@ munit_suite_main_custom(const MunitSuite* suite, void* user_data,
   int result = EXIT_FAILURE;
   MunitTestRunner runner;
   size_t parameters_size = 0;
-  size_t tests_size = 0;
   int arg;
+  size_t i;
 
   char* envptr;
   unsigned long ts;
   char* endptr;
+#if defined(MUNIT_ENABLE_TIMING)
+  const char* save_baseline = NULL;
+  const char* compare_baseline = NULL;
+  const char* shard_timings = NULL;
+#endif
+#if defined(MUNIT_HAVE_TIMING_DB)
+  const char* timing_db = NULL;
+#endif
+  /* --list or --list-params; they're handled after everything else
+   * so they can see --shard. */
+  munit_bool list = 0;
+  munit_bool list_params = 0;
+  munit_bool sharded;
+  MunitReporterPlan plan;
   unsigned long long iterations;
+  unsigned long shard_count;
+#if !defined(MUNIT_NO_FORK)
+  unsigned long jobs;
+#endif
   MunitLogLevel level;
   const MunitArgument* argument;
-  const char** runner_tests;
-  unsigned int tests_run;
-  unsigned int tests_total;
 
   runner.prefix = NULL;
   runner.suite = NULL;
-  runner.tests = NULL;
+  runner.test_name = NULL;
+  runner.reporters = NULL;
+  runner.reporters_l = 0;
+  memset(&(runner.tests), 0, sizeof(MunitFilter));
+  memset(&(runner.exclude), 0, sizeof(MunitFilter));
+  memset(&(runner.shard), 0, sizeof(MunitShardPlan));
+  runner.shard.mode = MUNIT_SHARD_NONE;
   runner.seed = 0;
   runner.iterations = 0;
   runner.parameters = NULL;
   runner.single_parameter_mode = 0;
+  runner.param_coverage = 0;
+  runner.max_combinations = 0;
   runner.user_data = NULL;
 
   runner.report.successful = 0;
@@ -1877,11 +8374,66 @@ munit_suite_main_custom(const MunitSuite* suite, void* user_data,
 #endif
   runner.show_stderr = 0;
   runner.fatal_failures = 0;
+  runner.jobs = 1;
+  runner.timeout = 0;
+#if defined(MUNIT_ENABLE_TIMING)
+  runner.benchmark = 0;
+  runner.bench_samples = MUNIT_BENCH_SAMPLES;
+  runner.bench_min_time = MUNIT_BENCH_MIN_TIME;
+  runner.bench_warmup = MUNIT_BENCH_WARMUP;
+#endif
+#if defined(MUNIT_HAVE_PERF_EVENTS)
+  runner.perf_counters = 0;
+  runner.perf.n = 0;
+#endif
+#if defined(MUNIT_HAVE_RUSAGE)
+  runner.show_usage = 0;
+#endif
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+  runner.count_allocs = 0;
+#endif
+#if defined(MUNIT_ENABLE_TIMING)
+  runner.test_name = NULL;
+  runner.baseline = NULL;
+  runner.baseline_l = 0;
+  runner.baseline_out = NULL;
+  runner.regression_threshold = MUNIT_REGRESSION_THRESHOLD;
+  runner.regressions = 0;
+  runner.scaling = NULL;
+  runner.scaling_points = NULL;
+  runner.scaling_points_l = 0;
+  runner.scaling_points_size = 0;
+#endif
+#if defined(MUNIT_HAVE_TIMING_DB)
+  memset(&(runner.timing_db), 0, sizeof(MunitTimingDb));
+  runner.timing_db.fd = -1;
+#endif
+#if !defined(MUNIT_NO_FORK)
+  runner.fork_server = 0;
+  runner.fail_alloc_crashes = 0;
+  runner.workers = NULL;
+  runner.workers_l = 0;
+  runner.cases = NULL;
+  runner.cases_tail = NULL;
+  runner.cases_running = 0;
+  runner.cases_queued = 0;
+  runner.pollfds = NULL;
+  runner.results = NULL;
+  runner.slot_samples = 0;
+  runner.sigchld_pipe[0] = -1;
+  runner.sigchld_pipe[1] = -1;
+  runner.sigchld_installed = 0;
+  runner.pending_name = NULL;
+  runner.pending_name_parameterized = 0;
+#endif
   runner.suite = suite;
   runner.user_data = user_data;
   runner.seed = munit_rand_generate_seed();
   runner.colorize = munit_stream_supports_ansi(MUNIT_OUTPUT_FILE);
 
+  if (!munit_test_runner_add_reporter(&runner, &munit_reporter_text, NULL))
+    goto cleanup;
+
   for (arg = 1 ; arg < argc ; arg++) {
     if (strncmp("--", argv[arg], 2) == 0) {
       if (strcmp("seed", argv[arg] + 2) == 0) {
@@ -1956,11 +8508,259 @@ munit_suite_main_custom(const MunitSuite* suite, void* user_data,
         goto cleanup;
       } else if (strcmp("single", argv[arg] + 2) == 0) {
         runner.single_parameter_mode = 1;
+      } else if (strcmp("exclude", argv[arg] + 2) == 0) {
+        if (arg + 1 >= argc) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "%s requires an argument", argv[arg]);
+          goto cleanup;
+        }
+
+        if (!munit_filter_add(&(runner.exclude), argv[arg + 1])) {
+          munit_log_internal(MUNIT_LOG_ERROR, stderr, "failed to allocate memory");
+          goto cleanup;
+        }
+
+        arg++;
+      } else if (strcmp("max-combinations", argv[arg] + 2) == 0) {
+        if (arg + 1 >= argc) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "%s requires an argument", argv[arg]);
+          goto cleanup;
+        }
+
+        endptr = argv[arg + 1];
+        iterations = strtoul(argv[arg + 1], &endptr, 0);
+        if (*endptr != '\0' || iterations == 0 || iterations > UINT_MAX) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "invalid value ('%s') passed to %s", argv[arg + 1], argv[arg]);
+          goto cleanup;
+        }
+
+        runner.max_combinations = (unsigned int) iterations;
+
+        arg++;
+      } else if (strcmp("param-coverage", argv[arg] + 2) == 0) {
+        if (arg + 1 >= argc) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "%s requires an argument", argv[arg]);
+          goto cleanup;
+        }
+
+        if (strcmp(argv[arg + 1], "all") == 0) {
+          runner.param_coverage = 0;
+        } else if (strcmp(argv[arg + 1], "pairwise") == 0) {
+          runner.param_coverage = 2;
+        } else {
+          endptr = argv[arg + 1];
+          iterations = strtoul(argv[arg + 1], &endptr, 10);
+          if (endptr == argv[arg + 1] || strcmp(endptr, "-wise") != 0 || iterations == 0 || iterations > UINT_MAX) {
+            munit_logf_internal(MUNIT_LOG_ERROR, stderr, "invalid value ('%s') passed to %s", argv[arg + 1], argv[arg]);
+            goto cleanup;
+          }
+          runner.param_coverage = (unsigned int) iterations;
+        }
+
+        arg++;
       } else if (strcmp("show-stderr", argv[arg] + 2) == 0) {
         runner.show_stderr = 1;
+      } else if (strcmp("reporter", argv[arg] + 2) == 0) {
+        if (arg + 1 >= argc) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "%s requires an argument", argv[arg]);
+          goto cleanup;
+        }
+
+        if (!munit_test_runner_parse_reporter(&runner, argv[arg], argv[arg + 1]))
+          goto cleanup;
+
+        arg++;
 #if !defined(_WIN32)
       } else if (strcmp("no-fork", argv[arg] + 2) == 0) {
         runner.fork = 0;
+#endif
+#if !defined(MUNIT_NO_FORK)
+#if defined(MUNIT_ENABLE_TIMING)
+      } else if (strcmp("timeout", argv[arg] + 2) == 0) {
+        if (arg + 1 >= argc) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "%s requires an argument", argv[arg]);
+          goto cleanup;
+        }
+
+        endptr = argv[arg + 1];
+        runner.timeout = strtod(argv[arg + 1], &endptr);
+        if (*endptr != '\0' || !(runner.timeout >= 0)) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "invalid value ('%s') passed to %s", argv[arg + 1], argv[arg]);
+          goto cleanup;
+        }
+
+        arg++;
+#endif
+      } else if (strcmp("fork-server", argv[arg] + 2) == 0) {
+        runner.fork_server = 1;
+      } else if (strcmp("fail-alloc", argv[arg] + 2) == 0) {
+        if (arg + 1 >= argc) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "%s requires an argument", argv[arg]);
+          goto cleanup;
+        }
+
+        if (strcmp(argv[arg + 1], "munit") == 0) {
+          munit_fail_alloc.mode = MUNIT_FAIL_ALLOC_MUNIT;
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+        } else if (strcmp(argv[arg + 1], "malloc") == 0) {
+          munit_fail_alloc.mode = MUNIT_FAIL_ALLOC_MALLOC;
+#endif
+        } else {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "invalid value ('%s') passed to %s", argv[arg + 1], argv[arg]);
+          goto cleanup;
+        }
+
+        arg++;
+      } else if (strcmp("jobs", argv[arg] + 2) == 0) {
+        if (arg + 1 >= argc) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "%s requires an argument", argv[arg]);
+          goto cleanup;
+        }
+
+        endptr = argv[arg + 1];
+        jobs = strtoul(argv[arg + 1], &endptr, 0);
+        if (*endptr != '\0' || jobs > UINT_MAX) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "invalid value ('%s') passed to %s", argv[arg + 1], argv[arg]);
+          goto cleanup;
+        }
+
+        if (jobs == 0) {
+#if defined(_SC_NPROCESSORS_ONLN)
+          jobs = (unsigned long) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+          if (jobs == 0 || jobs > UINT_MAX)
+            jobs = 1;
+        }
+        runner.jobs = (unsigned int) jobs;
+
+        arg++;
+#endif
+#if defined(MUNIT_ENABLE_TIMING)
+      } else if (strcmp("benchmark", argv[arg] + 2) == 0) {
+        runner.benchmark = 1;
+      } else if (strcmp("bench-samples", argv[arg] + 2) == 0) {
+        if (arg + 1 >= argc) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "%s requires an argument", argv[arg]);
+          goto cleanup;
+        }
+
+        endptr = argv[arg + 1];
+        iterations = strtoul(argv[arg + 1], &endptr, 0);
+        if (*endptr != '\0' || iterations == 0 || iterations > UINT_MAX) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "invalid value ('%s') passed to %s", argv[arg + 1], argv[arg]);
+          goto cleanup;
+        }
+
+        runner.bench_samples = (unsigned int) iterations;
+
+        arg++;
+      } else if (strcmp("bench-min-time", argv[arg] + 2) == 0 ||
+                 strcmp("bench-warmup", argv[arg] + 2) == 0) {
+        double* value = (strcmp("bench-min-time", argv[arg] + 2) == 0) ? &runner.bench_min_time : &runner.bench_warmup;
+
+        if (arg + 1 >= argc) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "%s requires an argument", argv[arg]);
+          goto cleanup;
+        }
+
+        endptr = argv[arg + 1];
+        *value = strtod(argv[arg + 1], &endptr);
+        if (*endptr != '\0' || !(*value >= 0)) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "invalid value ('%s') passed to %s", argv[arg + 1], argv[arg]);
+          goto cleanup;
+        }
+
+        arg++;
+      } else if (strcmp("save-baseline", argv[arg] + 2) == 0 ||
+                 strcmp("compare-baseline", argv[arg] + 2) == 0) {
+        if (arg + 1 >= argc) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "%s requires an argument", argv[arg]);
+          goto cleanup;
+        }
+
+        if (strcmp("save-baseline", argv[arg] + 2) == 0)
+          save_baseline = argv[arg + 1];
+        else
+          compare_baseline = argv[arg + 1];
+        runner.benchmark = 1;
+
+        arg++;
+      } else if (strcmp("regression-threshold", argv[arg] + 2) == 0) {
+        if (arg + 1 >= argc) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "%s requires an argument", argv[arg]);
+          goto cleanup;
+        }
+
+        endptr = argv[arg + 1];
+        runner.regression_threshold = strtod(argv[arg + 1], &endptr);
+        if (*endptr != '\0' || !(runner.regression_threshold >= 0)) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "invalid value ('%s') passed to %s", argv[arg + 1], argv[arg]);
+          goto cleanup;
+        }
+
+        arg++;
+      } else if (strcmp("scaling", argv[arg] + 2) == 0) {
+        if (arg + 1 >= argc) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "%s requires an argument", argv[arg]);
+          goto cleanup;
+        }
+
+        runner.scaling = argv[arg + 1];
+
+        arg++;
+#endif
+#if defined(MUNIT_HAVE_TIMING_DB)
+      } else if (strcmp("timing-db", argv[arg] + 2) == 0) {
+        if (arg + 1 >= argc) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "%s requires an argument", argv[arg]);
+          goto cleanup;
+        }
+
+        timing_db = argv[arg + 1];
+
+        arg++;
+#endif
+#if defined(MUNIT_HAVE_PERF_EVENTS)
+      } else if (strcmp("perf-counters", argv[arg] + 2) == 0) {
+        runner.perf_counters = 1;
+#endif
+#if defined(MUNIT_HAVE_RUSAGE)
+      } else if (strcmp("show-usage", argv[arg] + 2) == 0) {
+        runner.show_usage = 1;
+#endif
+#if defined(MUNIT_HAVE_ALLOC_HOOKS)
+      } else if (strcmp("count-allocs", argv[arg] + 2) == 0) {
+        runner.count_allocs = 1;
+#endif
+      } else if (strcmp("arena", argv[arg] + 2) == 0) {
+        munit_arena.enabled = 1;
+      } else if (strcmp("arena-chunk-size", argv[arg] + 2) == 0 ||
+                 strcmp("arena-alignment", argv[arg] + 2) == 0) {
+        if (arg + 1 >= argc) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "%s requires an argument", argv[arg]);
+          goto cleanup;
+        }
+
+        endptr = argv[arg + 1];
+        iterations = strtoul(argv[arg + 1], &endptr, 0);
+        if (*endptr != '\0' || iterations == 0 ||
+            (strcmp("arena-alignment", argv[arg] + 2) == 0 && (iterations & (iterations - 1)) != 0)) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "invalid value ('%s') passed to %s", argv[arg + 1], argv[arg]);
+          goto cleanup;
+        }
+
+        if (strcmp("arena-alignment", argv[arg] + 2) == 0)
+          munit_arena.alignment = (size_t) iterations;
+        else
+          munit_arena.chunk_size = (size_t) iterations;
+
+        arg++;
+#if defined(MUNIT_HAVE_HUGE_PAGES)
+      } else if (strcmp("arena-huge-pages", argv[arg] + 2) == 0) {
+        munit_arena.huge_pages = 1;
+#endif
+#if defined(MUNIT_HAVE_GUARD_PAGES)
+      } else if (strcmp("guard-pages", argv[arg] + 2) == 0) {
+        munit_guard_pages = 1;
 #endif
       } else if (strcmp("fatal-failures", argv[arg] + 2) == 0) {
         runner.fatal_failures = 1;
@@ -1991,13 +8791,39 @@ munit_suite_main_custom(const MunitSuite* suite, void* user_data,
 
         arg++;
       } else if (strcmp("list", argv[arg] + 2) == 0) {
-        munit_suite_list_tests(suite, 0, NULL);
-        result = EXIT_SUCCESS;
-        goto cleanup;
+        list = 1;
       } else if (strcmp("list-params", argv[arg] + 2) == 0) {
-        munit_suite_list_tests(suite, 1, NULL);
-        result = EXIT_SUCCESS;
-        goto cleanup;
+        list = 1;
+        list_params = 1;
+      } else if (strcmp("shard", argv[arg] + 2) == 0) {
+        if (arg + 1 >= argc) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "%s requires an argument", argv[arg]);
+          goto cleanup;
+        }
+
+        endptr = argv[arg + 1];
+        iterations = strtoul(argv[arg + 1], &endptr, 10);
+        shard_count = (*endptr == '/') ? strtoul(endptr + 1, &endptr, 10) : 0;
+        if (*endptr != '\0' || iterations == 0 || shard_count == 0 || iterations > shard_count || shard_count > UINT_MAX) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "invalid value ('%s') passed to %s", argv[arg + 1], argv[arg]);
+          goto cleanup;
+        }
+
+        runner.shard.index = (unsigned int) iterations - 1;
+        runner.shard.count = (unsigned int) shard_count;
+
+        arg++;
+#if defined(MUNIT_ENABLE_TIMING)
+      } else if (strcmp("shard-timings", argv[arg] + 2) == 0) {
+        if (arg + 1 >= argc) {
+          munit_logf_internal(MUNIT_LOG_ERROR, stderr, "%s requires an argument", argv[arg]);
+          goto cleanup;
+        }
+
+        shard_timings = argv[arg + 1];
+
+        arg++;
+#endif
       } else {
         argument = munit_arguments_find(arguments, argv[arg] + 2);
         if (argument == NULL) {
@@ -2009,41 +8835,134 @@ munit_suite_main_custom(const MunitSuite* suite, void* user_data,
           goto cleanup;
       }
     } else {
-      runner_tests = realloc((void*) runner.tests, sizeof(char*) * (tests_size + 2));
-      if (runner_tests == NULL) {
+      if (!munit_filter_add(&(runner.tests), argv[arg])) {
         munit_log_internal(MUNIT_LOG_ERROR, stderr, "failed to allocate memory");
         goto cleanup;
       }
-      runner.tests = runner_tests;
-      runner.tests[tests_size++] = argv[arg];
-      runner.tests[tests_size] = NULL;
     }
   }
 
-  fflush(stderr);
-  fprintf(MUNIT_OUTPUT_FILE, "Running test suite with seed 0x%08" PRIx32 "...\n", runner.seed);
+#if !defined(MUNIT_NO_FORK)
+  if (munit_fail_alloc.mode != MUNIT_FAIL_ALLOC_NONE) {
+    if (!runner.fork) {
+      munit_log_internal(MUNIT_LOG_ERROR, stderr, "--fail-alloc can't be used with --no-fork");
+      goto cleanup;
+    }
+    /* The extra runs happen right after each test, so its results
+     * have to be printed first. */
+    runner.jobs = 1;
+  }
+#endif
 
-  munit_test_runner_run(&runner);
+  if (list && runner.shard.count == 0) {
+    munit_suite_list_tests(suite, list_params, NULL);
+    result = EXIT_SUCCESS;
+    goto cleanup;
+  }
 
-  tests_run = runner.report.successful + runner.report.failed + runner.report.errored;
-  tests_total = tests_run + runner.report.skipped;
-  if (tests_run == 0) {
-    fprintf(stderr, "No tests run, %d (100%%) skipped.\n", runner.report.skipped);
-  } else {
-    fprintf(MUNIT_OUTPUT_FILE, "%d of %d (%0.0f%%) tests successful, %d (%0.0f%%) test skipped.\n",
-            runner.report.successful, tests_run,
-            (((double) runner.report.successful) / ((double) tests_run)) * 100.0,
-            runner.report.skipped,
-            (((double) runner.report.skipped) / ((double) tests_total)) * 100.0);
+  sharded = runner.shard.count != 0;
+#if defined(MUNIT_HAVE_TIMING_DB)
+  if (timing_db != NULL) {
+    if (!munit_timing_db_open(&(runner.timing_db), timing_db))
+      goto cleanup;
+    /* Plan a single shard, just so we know what's coming for the
+     * estimate. */
+    if (!sharded && runner.timing_db.header != NULL)
+      runner.shard.count = 1;
+  }
+#endif
+
+  if (runner.shard.count != 0) {
+#if defined(MUNIT_ENABLE_TIMING)
+    if (shard_timings != NULL && !munit_baseline_load(&(runner.shard.timings), &(runner.shard.timings_l), shard_timings))
+      goto cleanup;
+#endif
+    if (!munit_test_runner_shard_plan(&runner))
+      goto cleanup;
+
+    if (list) {
+      runner.shard.mode = MUNIT_SHARD_LIST;
+      munit_test_runner_run_suite(&runner, suite, NULL);
+      result = EXIT_SUCCESS;
+      goto cleanup;
+    }
+  }
+
+#if defined(MUNIT_ENABLE_TIMING)
+  /* Load the old baseline first, in case it's also where the new one
+   * is going. */
+  if (compare_baseline != NULL && !munit_baseline_load(&(runner.baseline), &(runner.baseline_l), compare_baseline))
+    goto cleanup;
+  if (save_baseline != NULL) {
+    runner.baseline_out = fopen(save_baseline, "w");
+    if (runner.baseline_out == NULL) {
+      munit_logf_internal(MUNIT_LOG_ERROR, stderr, "unable to open baseline file '%s': %s", save_baseline, strerror(errno));
+      goto cleanup;
+    }
   }
+#endif
+
+  memset(&plan, 0, sizeof(plan));
+  if (sharded) {
+    plan.shard_index = runner.shard.index;
+    plan.shard_count = runner.shard.count;
+    plan.cases = munit_shard_plan_size(&(runner.shard));
+    plan.total_cases = runner.shard.cases_l;
+  }
+#if defined(MUNIT_HAVE_TIMING_DB)
+  if (runner.timing_db.header != NULL)
+    plan.eta = munit_test_runner_eta(&runner);
+#endif
 
-  if (runner.report.failed == 0 && runner.report.errored == 0) {
+  fflush(stderr);
+  munit_test_runner_suite_start(&runner);
+  munit_test_runner_plan(&runner, &plan);
+
+  munit_test_runner_run(&runner);
+  munit_test_runner_summary(&runner);
+
+  if (runner.report.failed == 0 && runner.report.errored == 0
+#if !defined(MUNIT_NO_FORK)
+      && runner.fail_alloc_crashes == 0
+#endif
+#if defined(MUNIT_ENABLE_TIMING)
+      && runner.regressions == 0
+#endif
+      ) {
     result = EXIT_SUCCESS;
   }
 
  cleanup:
   free(runner.parameters);
-  free((void*) runner.tests);
+  munit_filter_free(&(runner.tests));
+  munit_filter_free(&(runner.exclude));
+  free(runner.shard.cases);
+  munit_arena_fini();
+  munit_parameters_index_fini();
+#if defined(MUNIT_ENABLE_TIMING)
+  munit_baseline_free(&(runner.baseline), &(runner.baseline_l));
+  munit_baseline_free(&(runner.shard.timings), &(runner.shard.timings_l));
+  munit_test_runner_scaling_reset(&runner);
+  free(runner.scaling_points);
+  if (runner.baseline_out != NULL && fclose(runner.baseline_out) != 0) {
+    munit_log_errno(MUNIT_LOG_ERROR, stderr, "unable to write baseline file");
+    result = EXIT_FAILURE;
+  }
+#endif
+#if defined(MUNIT_HAVE_TIMING_DB)
+  munit_timing_db_close(&(runner.timing_db));
+#endif
+  for (i = 0 ; i < runner.reporters_l ; i++) {
+    if (runner.reporters[i].fp != NULL && fclose(runner.reporters[i].fp) != 0) {
+      munit_log_errno(MUNIT_LOG_ERROR, stderr, "unable to write report file");
+      result = EXIT_FAILURE;
+    }
+  }
+  free(runner.reporters);
+#if !defined(MUNIT_NO_FORK)
+  free(runner.pollfds);
+  free(runner.workers);
+#endif
 
   return result;
 }
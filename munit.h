@@ -378,7 +378,13 @@ void munit_errorf_ex(const char* filename, int line, const char* format, ...);
 
 /*** Memory allocation ***/
 
+/* Memory from munit_malloc() is zeroed.  With --arena it comes from
+ * an arena which is reset once the test's tear_down has run, and with
+ * --guard-pages each allocation has a mapping of its own, so it must
+ * be released with munit_free() rather than free().  munit_free()
+ * also works for memory from malloc(). */
 void* munit_malloc_ex(const char* filename, int line, size_t size);
+void munit_free(void* ptr);
 
 #define munit_malloc(size) \
   munit_malloc_ex(__FILE__, __LINE__, (size))
@@ -392,9 +398,64 @@ void* munit_malloc_ex(const char* filename, int line, size_t size);
 #define munit_newa(type, nmemb) \
   ((type*) munit_calloc((nmemb), sizeof(type)))
 
+/*** Allocation counting ***/
+
+/* Count the allocations (malloc, calloc, realloc, posix_memalign,
+ * aligned_alloc, memalign and valloc) made by every thread between
+ * munit_alloc_count_begin() and munit_alloc_count_end().  This
+ * replaces the program's allocator, so munit.c has to be compiled
+ * with MUNIT_ENABLE_ALLOC_HOOKS defined.  Only supported with glibc,
+ * and not with the sanitizers; elsewhere nothing is ever counted. */
+munit_uint64_t munit_alloc_count_begin(void);
+munit_uint64_t munit_alloc_count_end(munit_uint64_t begin);
+
+#define munit_assert_allocs_in(stmt, op, n) \
+  do { \
+    const munit_uint64_t munit_tmp_begin_ = munit_alloc_count_begin(); \
+    munit_uint64_t munit_tmp_allocs_; \
+    stmt; \
+    munit_tmp_allocs_ = munit_alloc_count_end(munit_tmp_begin_); \
+    if (!(munit_tmp_allocs_ op ((munit_uint64_t) (n)))) { \
+      munit_errorf("assertion failed: allocations in %s %s %s (%" PRIu64 " %s %" PRIu64 ")", \
+                   #stmt, #op, #n, munit_tmp_allocs_, #op, (munit_uint64_t) (n)); \
+    } \
+    MUNIT_PUSH_DISABLE_MSVC_C4127_ \
+  } while (0) \
+  MUNIT_POP_DISABLE_MSVC_C4127_
+
+#define munit_assert_no_alloc_in(stmt) \
+  munit_assert_allocs_in(stmt, ==, 0)
+
+/*** Resource usage ***/
+
+/* The peak resident set size of the current process, in bytes, or 0
+ * if the platform can't tell us.  This includes the test runner
+ * itself, and with --no-fork or --fork-server any earlier tests run
+ * in the same process. */
+munit_uint64_t munit_memory_peak(void);
+
+/* Fail unless the peak resident set size is at most budget bytes. */
+#define munit_assert_memory_budget(budget) \
+  do { \
+    const munit_uint64_t munit_tmp_peak_ = munit_memory_peak(); \
+    const munit_uint64_t munit_tmp_budget_ = (budget); \
+    if (!(munit_tmp_peak_ <= munit_tmp_budget_)) { \
+      munit_errorf("assertion failed: peak memory usage <= %s (%" PRIu64 " <= %" PRIu64 ")", \
+                   #budget, munit_tmp_peak_, munit_tmp_budget_); \
+    } \
+    MUNIT_PUSH_DISABLE_MSVC_C4127_ \
+  } while (0) \
+  MUNIT_POP_DISABLE_MSVC_C4127_
+
 /*** Random number generation ***/
 
 void munit_rand_seed(munit_uint32_t seed);
+/* Each thread has its own PRNG state, derived from the seed and the
+ * thread's index.  Threads are numbered in the order they first use
+ * the PRNG after it is seeded (the thread which seeded it is 0), which
+ * isn't reproducible if several threads start at once; call this at
+ * the start of each thread to pick the index yourself. */
+void munit_rand_seed_thread(munit_uint32_t index);
 munit_uint32_t munit_rand_uint32(void);
 int munit_rand_int_range(int min, int max);
 double munit_rand_double(void);
@@ -415,9 +476,47 @@ typedef enum {
   MUNIT_ERROR
 } MunitResult;
 
+/* Values which are generated as they're needed instead of listed.
+ * The arguments are strings, which may use the same suffixes as
+ * munit_parameters_get_int() (e.g., "64M"):
+ *
+ *   static const MunitParameterGenerator sizes =
+ *     MUNIT_PARAMETER_GEOMETRIC("64", "64M", "2");
+ *
+ *   static MunitParameterEnum params[] = {
+ *     { (char*) "size", NULL, &sizes },
+ *     { NULL, NULL, NULL }
+ *   };
+ *
+ * MUNIT_PARAMETER_RANGE(first, last, step) is first, first + step,
+ * first + 2 * step, ... up to last, and MUNIT_PARAMETER_GEOMETRIC
+ * (first, last, factor) is first, first * factor, first * factor^2,
+ * ... up to last. */
+typedef enum {
+  MUNIT_PARAMETER_GENERATOR_RANGE,
+  MUNIT_PARAMETER_GENERATOR_GEOMETRIC
+} MunitParameterGeneratorType;
+
+typedef struct {
+  MunitParameterGeneratorType type;
+  const char* first;
+  const char* last;
+  const char* step;
+} MunitParameterGenerator;
+
+#define MUNIT_PARAMETER_RANGE(first, last, step) \
+  { MUNIT_PARAMETER_GENERATOR_RANGE, (first), (last), (step) }
+#define MUNIT_PARAMETER_GEOMETRIC(first, last, factor) \
+  { MUNIT_PARAMETER_GENERATOR_GEOMETRIC, (first), (last), (factor) }
+
 typedef struct {
   char*  name;
+  /* NULL-terminated list of possible values, or NULL for any value
+   * (which must then be passed on the command line). */
   char** values;
+  /* If not NULL, the values are generated by this instead, and values
+   * is ignored. */
+  const MunitParameterGenerator* generator;
 } MunitParameterEnum;
 
 typedef struct {
@@ -427,6 +526,15 @@ typedef struct {
 
 const char* munit_parameters_get(const MunitParameter params[], const char* key);
 
+/* Typed parameter values.  Integers may have a binary suffix ("4K",
+ * "1M", "2GiB"); booleans are true/false, yes/no, on/off or 1/0.  A
+ * missing or invalid value makes the test return MUNIT_ERROR. */
+int            munit_parameters_get_int(const MunitParameter params[], const char* key);
+munit_uint64_t munit_parameters_get_uint64(const MunitParameter params[], const char* key);
+double         munit_parameters_get_double(const MunitParameter params[], const char* key);
+munit_bool     munit_parameters_get_bool(const MunitParameter params[], const char* key);
+size_t         munit_parameters_get_size(const MunitParameter params[], const char* key);
+
 typedef enum {
   MUNIT_TEST_OPTION_NONE             = 0,
   MUNIT_TEST_OPTION_SINGLE_ITERATION = 1 << 0,
@@ -444,20 +552,33 @@ typedef struct {
   MunitTestTearDown   tear_down;
   MunitTestOptions    options;
   MunitParameterEnum* parameters;
+  /* Seconds a test case may run before it is killed, or 0 to use the
+   * --timeout value (if any).  Only enforced when forking. */
+  double              timeout;
 } MunitTest;
 
 typedef enum {
   MUNIT_SUITE_OPTION_NONE = 0
 } MunitSuiteOptions;
 
+/* Suite fixtures are set up once, in the runner process, before any
+ * of the suite's tests are run.  Since tests run in child processes
+ * they get the fixture through copy-on-write memory.  The return
+ * value replaces the user_data for the suite's tests and child
+ * suites. */
+typedef void*       (* MunitSuiteSetup)(void* user_data);
+typedef void        (* MunitSuiteTearDown)(void* fixture);
+
 typedef struct MunitSuite_ MunitSuite;
 
 struct MunitSuite_ {
-  char*             prefix;
-  MunitTest*        tests;
-  MunitSuite*       suites;
-  unsigned int      iterations;
-  MunitSuiteOptions options;
+  char*              prefix;
+  MunitTest*         tests;
+  MunitSuite*        suites;
+  unsigned int       iterations;
+  MunitSuiteOptions  options;
+  MunitSuiteSetup    setup;
+  MunitSuiteTearDown tear_down;
 };
 
 int munit_suite_main(const MunitSuite* suite, void* user_data, int argc, char* const argv[MUNIT_ARRAY_PARAM(argc + 1)]);